@@ -5,6 +5,8 @@
 // Architecture:
 //   Client mode  --Unix socket-->  Server/daemon  --PTY-->  child process (bash -l)
 //   Socket path: /tmp/ghostly-<UID>/<name>.sock
+//   Server mode: one per-UID daemon hosts many sessions behind
+//   /tmp/ghostly-<UID>/server.ctl; clients name the session in HELLO.
 
 // ============================================================================
 // 1. Platform includes & compat macros
@@ -13,12 +15,15 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstdint>
+#include <climits>
 #include <cstring>
 #include <cerrno>
 #include <csignal>
 #include <ctime>
 #include <string>
 #include <vector>
+#include <deque>
+#include <algorithm>
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -29,9 +34,15 @@
 #include <sys/wait.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/file.h>
 #include <termios.h>
 #include <poll.h>
 #include <dirent.h>
+#include <regex.h>
 
 #ifdef __APPLE__
 #include <sys/mount.h>
@@ -41,6 +52,43 @@
 #include <pty.h>
 #endif
 
+// Server event backend (see EventLoop): -DGHOSTLY_USE_POLL forces poll()
+#if !defined(GHOSTLY_USE_POLL)
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define GHOSTLY_EPOLL 1
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+      defined(__OpenBSD__) || defined(__DragonFly__)
+#include <sys/event.h>
+#define GHOSTLY_KQUEUE 1
+#endif
+#endif
+
+// VT parser text scan (see TextScan): vectors the target always has
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// list --watch: socket dir change notification
+#if defined(__linux__)
+#include <sys/inotify.h>
+#define GHOSTLY_INOTIFY 1
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+      defined(__OpenBSD__) || defined(__DragonFly__)
+#include <sys/event.h>
+#define GHOSTLY_DIR_KQUEUE 1
+#endif
+
+// create --io-thread (see PtyReader): only in builds with -pthread, as the
+// Makefile's; the installers' plain command line leaves it out
+#if defined(_REENTRANT) || defined(__APPLE__)
+#include <atomic>
+#include <pthread.h>
+#define GHOSTLY_IO_THREAD 1
+#endif
+
 // For getloadavg
 #include <cstdlib>
 
@@ -59,28 +107,145 @@ enum MsgType : uint8_t {
     MSG_DETACH = 0x03,
     MSG_EXIT   = 0x04,
     MSG_HELLO  = 0x05,
+    MSG_DATA_Z = 0x06,  // compressed DATA (HELLO_FLAG_COMPRESS clients only)
+    MSG_PING   = 0x07,  // liveness probe, answered by PONG with the same payload
+    MSG_PONG   = 0x08,
+    // Requests sent instead of a HELLO, answered by one REPLY. QUERY works
+    // on any session socket, CREATE and KILL only on the per-UID server's.
+    MSG_CREATE = 0x09,  // [overflow u8][scrollback u32][name len u8][name][cwd len u16][cwd]
+                        // [env len u32][env][cmd]
+    MSG_QUERY  = 0x0A,  // live metadata of the sessions behind the socket
+    MSG_KILL   = 0x0B,  // [name]
+    MSG_REPLY  = 0x0C,  // [status u8, 0 = ok][text]
+    MSG_STATS  = 0x0D,  // [name]: the daemon's counters
+    MSG_ECHO_ACK = 0x0E,  // [seq u32]: the client's DATA frames up to seq have
+                          // had ECHO_ACK_MS to be echoed (HELLO_FLAG_ECHO_ACK)
+    MSG_SYNC   = 0x0F,  // [stream id u64][offset u64]: the output that follows
+                        // continues the session's stream at offset (HELLO_FLAG_RESUME)
+    MSG_MUX    = 0x10,  // [channel u16][type u8][payload]: a frame of one of the
+                        // sessions carried by `mux`
 };
 
-// Max clients per session
-static const int MAX_CLIENTS = 16;
+// Max clients per session (read-only viewers included). The client table
+// grows as they connect; the daemon raises its open file limit to fit.
+static const int MAX_CLIENTS = 256;
+// Max connections to the per-UID server, across all of its sessions
+static const int MAX_SERVER_CLIENTS = 1024;
 // Buffer sizes
 static const int BUF_SIZE = 8192;
-// Scrollback buffer: replayed to new clients on attach
-static const int SCROLLBACK_SIZE = 128 * 1024; // 128KB
-// Alt-screen replay limit: only replay last 8KB for TUI apps (htop, vim, etc.)
-static const int ALT_SCREEN_REPLAY = 8 * 1024;
+// PTY output coalesced into one DATA frame per wakeup (at most)
+static const int PTY_READ_BATCH = 4 * BUF_SIZE;
+// With no client attached, PTY output only goes to the scrollback: it is
+// read in larger batches, and a child writing only a little at a time is
+// left alone this long (ms) between reads so its output collects in the
+// kernel and arrives in one wakeup
+static const int DETACHED_READ_BATCH = 64 * 1024;
+static const int DETACHED_COALESCE_MS = 20;
+// create --io-thread: PTY output the reader thread can hold ahead of the
+// event loop (power of two)
+static const size_t IO_THREAD_RING = 1024 * 1024;
+// Scrollback buffer: replayed to new clients on attach. Default size; set per
+// session with --scrollback (rounded up to a power of two so ring positions
+// wrap with a mask).
+static const size_t SCROLLBACK_SIZE = 128 * 1024; // 128KB
+static const size_t SCROLLBACK_MIN = 16 * 1024;
+static const size_t SCROLLBACK_MAX = 1024UL * 1024 * 1024; // 1GB
+// Heap scrollback starts this small and doubles as output arrives
+static const size_t SCROLLBACK_INITIAL = 64 * 1024;
+// Larger scrollbacks live in an mmap'd file in the socket dir
+static const size_t SCROLLBACK_MMAP_THRESHOLD = 4 * 1024 * 1024; // 4MB
+// File-backed scrollback is released from memory in spans of this size
+static const size_t SCROLLBACK_SPAN = 1024 * 1024;
+// Scrollback replays are written straight from the ring in frames of this
+// size, one more whenever the socket has taken the last
+static const size_t REPLAY_FRAME = 64 * 1024;
+// Journal (create --journal): segment size, how many segments are kept,
+// and when buffered output is written out (bytes / ms)
+static const uint64_t JOURNAL_SEGMENT_SIZE = 4 * 1024 * 1024;
+static const int JOURNAL_MAX_SEGMENTS = 16;
+static const size_t JOURNAL_BUFFER = 64 * 1024;
+static const int JOURNAL_FLUSH_MS = 1000;
+// Screen model size until the first client reports its window
+static const int DEFAULT_COLS = 80;
+static const int DEFAULT_ROWS = 24;
 // Max session name length
 static const int MAX_NAME_LEN = 64;
-// Socket read timeout for client connections (seconds)
+// A new daemon must report that it is listening within this time (ms)
+static const int DAEMON_START_TIMEOUT_MS = 5000;
+// A client must complete its HELLO within this time after connecting (ms)
+static const int HELLO_TIMEOUT_MS = 2000;
+// list: how long all daemons together get to answer QUERY (ms)
+static const int LIST_QUERY_TIMEOUT_MS = 1000;
+// A partially received frame must complete within this time (seconds)
 static const int CLIENT_RECV_TIMEOUT = 30;
+// Per-client output queue: framed bytes waiting for POLLOUT before the
+// overflow policy kicks in. The scrollback replay is not queued but read
+// from the ring as the socket takes it.
+static const size_t CLIENT_QUEUE_LIMIT = 1024 * 1024; // 1MB
+// Display-rate clients: backlog at which live output is dropped in favour of
+// screen redraws, and the minimum interval between those redraws (10 fps)
+static const size_t DISPLAY_RATE_BACKLOG = 64 * 1024;
+static const int DISPLAY_RATE_INTERVAL_MS = 100;
+// info: how long cached probe results are served fresh (seconds), and when
+// a background refresh that never finished is presumed dead
+static const int INFO_DISK_TTL = 60;
+static const int INFO_SLURM_TTL = 30;
+static const int INFO_REFRESH_LOCK_MAX = 120;
+static const int INFO_WATCH_INTERVAL = 5;
+// list --watch: sessions are listed again this long after a change in the
+// socket dir (ms), so a burst of changes is one update; and every interval
+// seconds regardless, for changes no notification reports (a daemon
+// killed with SIGKILL leaves its socket behind)
+static const int LIST_WATCH_SETTLE_MS = 50;
+static const int LIST_WATCH_INTERVAL = 30;
+// Ping interval a client may negotiate in its HELLO (seconds)
+static const int PING_INTERVAL_MIN = 1;
+static const int PING_INTERVAL_MAX = 3600;
+// Echo acknowledgements: client input counts as answered once the session
+// has had this long to echo it, with no new input since (ms)
+static const int ECHO_ACK_MS = 50;
+
+// What to do with a client whose output queue overflows
+enum OverflowPolicy {
+    OVERFLOW_DROP,    // disconnect the client
+    OVERFLOW_RESYNC,  // discard its backlog, redraw the current screen
+};
+
+// Whose window size the PTY gets when clients of different sizes share it
+enum ResizePolicy {
+    RESIZE_LATEST,    // the client that most recently typed, resized or attached
+    RESIZE_SMALLEST,  // the smallest columns and rows of any client
+    RESIZE_LARGEST,   // the largest
+};
+// At most one TIOCSWINSZ per session this often (ms); sizes arriving in
+// between are merged into the next one
+static const int RESIZE_DEBOUNCE_MS = 100;
 
 // HELLO flags (byte 4, optional)
 static const uint8_t HELLO_FLAG_NO_REPLAY = 0x01;
+static const uint8_t HELLO_FLAG_SCREEN = 0x02;  // redraw the screen, no history
+static const uint8_t HELLO_FLAG_COMPRESS = 0x04; // client accepts MSG_DATA_Z
+static const uint8_t HELLO_FLAG_DISPLAY_RATE = 0x08; // may skip output when behind
+static const uint8_t HELLO_FLAG_ECHO_ACK = 0x10; // client wants MSG_ECHO_ACK
+static const uint8_t HELLO_FLAG_RESUME = 0x20;   // client tracks stream offsets (MSG_SYNC)
+static const uint8_t HELLO_FLAG_READ_ONLY = 0x40; // viewer: input and resizes are ignored
+
+// MSG_CREATE: set in the overflow byte for --journal, --pausable and
+// --io-thread, and for the caller's environment after the cwd; the resize
+// policy is in bits 4-5 of it
+static const uint8_t CREATE_FLAG_JOURNAL = 0x80;
+static const uint8_t CREATE_FLAG_PAUSABLE = 0x40;
+static const uint8_t CREATE_FLAG_IO_THREAD = 0x08;
+static const uint8_t CREATE_FLAG_ENV = 0x04;
+static const int CREATE_RESIZE_SHIFT = 4;
+static const uint8_t CREATE_RESIZE_MASK = 0x30;
 
 // ============================================================================
 // 3. Utility functions
 // ============================================================================
 
+extern char **environ;
+
 static uid_t my_uid() { return getuid(); }
 
 static std::string socket_dir() {
@@ -116,6 +281,26 @@ static std::string info_path(const std::string &name) {
     return socket_dir() + "/" + name + ".info";
 }
 
+static std::string scrollback_path(const std::string &name) {
+    return socket_dir() + "/" + name + ".scrollback";
+}
+
+// Session journal directory (create --journal), kept after the session ends
+static std::string journal_dir(const std::string &name) {
+    return socket_dir() + "/" + name + ".journal";
+}
+
+// Control socket of the per-UID server. Not a ".sock", so the directory
+// scan for standalone sessions never mistakes it for one.
+static std::string server_socket_path() {
+    return socket_dir() + "/server.ctl";
+}
+
+// Held while the per-UID server is started (see create_in_server())
+static std::string server_lock_path() {
+    return socket_dir() + "/server.lock";
+}
+
 // [FIX #2] Hardened socket directory creation with symlink protection.
 // Refuses to use the directory if it's a symlink or not owned by us.
 static bool ensure_socket_dir() {
@@ -168,6 +353,34 @@ static std::string json_escape(const std::string &s) {
     return out;
 }
 
+// Monotonic clock in milliseconds, for timeouts
+static int64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Times write_all()/write_allv() found the fd full and had to wait (in the
+// daemon: the PTY not taking client input), and for how long. See stats.
+static uint64_t write_stalls = 0;
+static uint64_t write_stall_us = 0;
+
+// Wait up to 1s for fd to take more output
+static bool write_stall(int fd) {
+    int64_t t0 = now_us();
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    int r = poll(&pfd, 1, 1000);
+    write_stalls++;
+    write_stall_us += now_us() - t0;
+    return r > 0;
+}
+
 // Write all bytes, handling partial writes and EAGAIN [FIX #6]
 static bool write_all(int fd, const void *buf, size_t len) {
     const uint8_t *p = (const uint8_t *)buf;
@@ -176,10 +389,8 @@ static bool write_all(int fd, const void *buf, size_t len) {
         if (n < 0) {
             if (errno == EINTR) continue;
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // Brief spin-wait for non-blocking fds (PTY master)
-                struct pollfd pfd = {fd, POLLOUT, 0};
-                int r = poll(&pfd, 1, 1000); // 1s timeout
-                if (r <= 0) return false;     // timeout or error
+                // Brief wait for non-blocking fds (PTY master)
+                if (!write_stall(fd)) return false;  // timeout or error
                 continue;
             }
             return false;
@@ -190,6 +401,33 @@ static bool write_all(int fd, const void *buf, size_t len) {
     return true;
 }
 
+// Vectored write_all: writes every iovec in as few writev() calls as the fd
+// allows. The iovec array is consumed (modified) in place.
+static bool write_allv(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!write_stall(fd)) return false;
+                continue;
+            }
+            return false;
+        }
+        // Skip fully written iovecs, trim the partially written one
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
 // Read exactly len bytes
 static bool read_all(int fd, void *buf, size_t len) {
     uint8_t *p = (uint8_t *)buf;
@@ -210,8 +448,25 @@ static bool file_exists(const std::string &path) {
     return stat(path.c_str(), &st) == 0;
 }
 
+// A zombie counts as gone: where nothing reaps orphans (a container without
+// an init), a crashed daemon stays one
 static bool process_alive(pid_t pid) {
-    return kill(pid, 0) == 0;
+    if (kill(pid, 0) != 0) return false;
+#if defined(__linux__)
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return true;
+    char buf[512];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    // The state follows the command name, which may itself contain spaces
+    const char *p = strrchr(buf, ')');
+    return !(p && p[1] == ' ' && p[2] == 'Z');
+#else
+    return true;
+#endif
 }
 
 static pid_t read_pid_file(const std::string &path) {
@@ -231,20 +486,40 @@ static void write_pid_file(const std::string &path, pid_t pid) {
     }
 }
 
-static void write_info_file(const std::string &path, pid_t pid, int clients,
-                            time_t created, const std::string &cmd) {
-    FILE *f = fopen(path.c_str(), "w");
-    if (f) {
-        fprintf(f, "pid=%d\nclients=%d\ncreated=%ld\ncmd=%s\n",
-                (int)pid, clients, (long)created, cmd.c_str());
-        fclose(f);
-    }
-}
-
 static void cleanup_session_files(const std::string &name) {
     unlink(socket_path(name).c_str());
     unlink(pid_path(name).c_str());
-    unlink(info_path(name).c_str());
+    unlink(info_path(name).c_str());  // written by daemons before QUERY
+    unlink(scrollback_path(name).c_str());
+}
+
+// Parse a byte size with an optional K/M/G suffix ("16M", "512k", "65536")
+static bool parse_size(const char *s, size_t *out) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno != 0 || end == s) return false;
+    int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+        default: break;
+    }
+    // 17179869185G must not wrap around to 1G
+    if (v > (ULLONG_MAX >> shift)) return false;
+    v <<= shift;
+    if (*end == 'b' || *end == 'B') end++;
+    if (*end != '\0' || v > SIZE_MAX) return false;
+    *out = (size_t)v;
+    return true;
+}
+
+// Smallest power of two >= v
+static size_t round_up_pow2(size_t v) {
+    size_t p = 1;
+    while (p < v) p <<= 1;
+    return p;
 }
 
 // Set fd to non-blocking
@@ -253,22 +528,103 @@ static void set_nonblock(int fd) {
     if (flags >= 0) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
+// Keep fd out of session children: a server forks shells while holding
+// other sessions' PTYs and client sockets
+static void set_cloexec(int fd) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+// Raise the soft open file limit to at least want, as far as the hard limit
+// allows (many shells start daemons with a soft limit of 256 or 1024)
+static void raise_fd_limit(rlim_t want) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur >= want) return;
+    rl.rlim_cur = rl.rlim_max == RLIM_INFINITY ? want : std::min(want, rl.rlim_max);
+    setrlimit(RLIMIT_NOFILE, &rl);
+}
+
 // ============================================================================
 // 4. Protocol framing
 // ============================================================================
 
-static bool send_msg(int fd, MsgType type, const void *data, uint32_t len) {
-    uint8_t hdr[5];
+static void put_header(uint8_t *hdr, MsgType type, uint32_t len) {
     hdr[0] = (uint8_t)type;
     hdr[1] = (len >> 24) & 0xFF;
     hdr[2] = (len >> 16) & 0xFF;
     hdr[3] = (len >>  8) & 0xFF;
     hdr[4] = len & 0xFF;
-    if (!write_all(fd, hdr, 5)) return false;
-    if (len > 0 && !write_all(fd, data, len)) return false;
-    return true;
 }
 
+// Header and payload go out in a single writev()
+static bool send_msg(int fd, MsgType type, const void *data, uint32_t len) {
+    uint8_t hdr[5];
+    put_header(hdr, type, len);
+    struct iovec iov[2];
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = 5;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    return write_allv(fd, iov, len > 0 ? 2 : 1);
+}
+
+// Several frames gathered into one writev(). Headers are stored inline;
+// payloads are referenced and must stay valid until send().
+struct FrameBatch {
+    static const int MAX_FRAMES = 16;
+    uint8_t hdrs[MAX_FRAMES][8];
+    struct iovec iov[MAX_FRAMES * 2];
+    int nframes;
+    int niov;
+
+    FrameBatch() : nframes(0), niov(0) {}
+
+    bool empty() const { return nframes == 0; }
+    bool full() const { return nframes >= MAX_FRAMES; }
+
+    // Returns false if the batch is full (send() it and retry)
+    bool add(MsgType type, const void *data, uint32_t len) {
+        if (nframes >= MAX_FRAMES) return false;
+        put_header(hdrs[nframes], type, len);
+        iov[niov].iov_base = hdrs[nframes];
+        iov[niov].iov_len = 5;
+        niov++;
+        if (len > 0) {
+            iov[niov].iov_base = (void *)data;
+            iov[niov].iov_len = len;
+            niov++;
+        }
+        nframes++;
+        return true;
+    }
+
+    // The same frame wrapped in MSG_MUX for channel id
+    bool add_mux(uint16_t id, MsgType type, const void *data, uint32_t len) {
+        if (nframes >= MAX_FRAMES) return false;
+        uint8_t *h = hdrs[nframes];
+        put_header(h, MSG_MUX, len + 3);
+        h[5] = (uint8_t)(id >> 8);
+        h[6] = (uint8_t)id;
+        h[7] = (uint8_t)type;
+        iov[niov].iov_base = h;
+        iov[niov].iov_len = 8;
+        niov++;
+        if (len > 0) {
+            iov[niov].iov_base = (void *)data;
+            iov[niov].iov_len = len;
+            niov++;
+        }
+        nframes++;
+        return true;
+    }
+
+    bool send(int fd) {
+        bool ok = write_allv(fd, iov, niov);
+        nframes = 0;
+        niov = 0;
+        return ok;
+    }
+};
+
 // Returns false on disconnect. Caller must free *out_data if *out_len > 0.
 static bool recv_msg(int fd, MsgType *out_type, uint8_t **out_data, uint32_t *out_len) {
     uint8_t hdr[5];
@@ -284,464 +640,4351 @@ static bool recv_msg(int fd, MsgType *out_type, uint8_t **out_data, uint32_t *ou
     return true;
 }
 
-// ============================================================================
-// 5. Terminal raw mode
-// ============================================================================
-
-static struct termios saved_termios;
-static bool termios_saved = false;
-
-static void term_raw() {
-    if (!isatty(STDIN_FILENO)) return;
-    struct termios t;
-    if (tcgetattr(STDIN_FILENO, &saved_termios) < 0) return;
-    termios_saved = true;
-    t = saved_termios;
-    cfmakeraw(&t);
-    tcsetattr(STDIN_FILENO, TCSANOW, &t);
-}
-
-static void term_restore() {
-    if (termios_saved)
-        tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
-    termios_saved = false;
-}
-
-// [FIX #4 partial] atexit handler to restore terminal on unexpected exit
-static void atexit_restore() {
-    term_restore();
-}
+// Largest frame payload we accept from a peer
+static const uint32_t MAX_FRAME_LEN = 1024 * 1024;
+
+// FrameReader buffers allocated or grown, for stats: once per connection
+// slot, or for a frame larger than any before it, never per frame
+static uint64_t g_rx_allocs = 0;
+
+// Incremental frame parser for a non-blocking socket. Whatever has arrived is
+// read into a reusable buffer and complete frames are parsed in place, so a
+// peer that stalls mid-frame never blocks the reader.
+struct FrameReader {
+    std::vector<uint8_t> buf;
+    size_t start;           // first unparsed byte
+    size_t end;             // end of received data
+    int64_t partial_since;  // when the pending partial frame began (0 = none)
+
+    // A buffer of up to RETAIN bytes is kept for the next connection, so a
+    // reused client slot doesn't allocate again
+    static const size_t RETAIN = 2 * BUF_SIZE;
+
+    void reset() {
+        if (buf.size() > RETAIN) std::vector<uint8_t>().swap(buf);
+        start = 0;
+        end = 0;
+        partial_since = 0;
+    }
 
-// ============================================================================
-// 6. Server: PTY, daemon fork, poll() event loop, multi-client broadcast
-// ============================================================================
+    // One non-blocking read. Returns bytes read, 0 if nothing was available,
+    // or -1 on EOF/error. Frames already buffered remain parseable after -1.
+    ssize_t fill(int fd) {
+        if (start == end) {
+            start = 0;
+            end = 0;
+        }
+        // Make room for at least the frame currently being assembled
+        size_t want = BUF_SIZE;
+        if (end - start >= 5) {
+            size_t frame = 5 + (size_t)peek_len(start);
+            if (frame > end - start && frame - (end - start) > want)
+                want = frame - (end - start);
+        }
+        if (buf.size() - end < want) {
+            if (start > 0) {
+                memmove(&buf[0], &buf[start], end - start);
+                end -= start;
+                start = 0;
+            }
+            if (buf.size() - end < want) {
+                buf.resize(end + want);
+                g_rx_allocs++;
+            }
+        }
+        for (;;) {
+            ssize_t n = read(fd, &buf[end], buf.size() - end);
+            if (n > 0) {
+                end += n;
+                return n;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+            return -1;
+        }
+    }
 
-// Scrollback ring buffer: stores recent PTY output for replay on reattach
-struct ScrollbackBuffer {
-    uint8_t data[SCROLLBACK_SIZE];
-    int head;   // next write position
-    int count;  // bytes stored (up to SCROLLBACK_SIZE)
-    bool in_alt_screen; // true when TUI app is using alternate screen buffer
-
-    void reset() { head = 0; count = 0; in_alt_screen = false; }
-
-    void append(const uint8_t *buf, int len) {
-        if (in_alt_screen) return;  // Don't buffer TUI content
-        for (int i = 0; i < len; i++) {
-            data[head] = buf[i];
-            head = (head + 1) % SCROLLBACK_SIZE;
-            if (count < SCROLLBACK_SIZE) count++;
-        }
-    }
-
-    // Scan PTY output for alternate screen enter/exit sequences.
-    // Detects: CSI ?1049h/l, CSI ?47h/l, CSI ?1047h/l
-    // Must be called BEFORE append() so the flag is current.
-    void scan_alt_screen(const uint8_t *buf, int len) {
-        for (int i = 0; i < len; i++) {
-            if (buf[i] != 0x1b) continue;     // ESC
-            if (i + 1 >= len || buf[i+1] != '[') continue;  // CSI
-            if (i + 2 >= len || buf[i+2] != '?') continue;  // DEC private
-            // Parse number
-            int j = i + 3;
-            int num = 0;
-            while (j < len && buf[j] >= '0' && buf[j] <= '9') {
-                num = num * 10 + (buf[j] - '0');
-                j++;
-            }
-            if (j >= len) break;
-            if (num == 1049 || num == 47 || num == 1047) {
-                if (buf[j] == 'h') in_alt_screen = true;
-                else if (buf[j] == 'l') in_alt_screen = false;
-            }
-        }
-    }
-
-    // Replay stored data to a single client fd via MSG_DATA.
-    // If skip_replay is true, send nothing (fast attach).
-    // If in alt-screen mode, send a clean "enter alt screen + clear" instead
-    // of replaying partial TUI frames. The SIGWINCH from attach will trigger
-    // the TUI app to redraw at the correct size. This ensures clean terminal
-    // state when the TUI app later exits (ESC[?1049l works correctly).
-    bool replay_to(int fd, bool skip_replay = false) const {
-        if (count == 0 || skip_replay) return true;
-
-        if (in_alt_screen) {
-            // Enter alt screen, reset attributes, clear, show cursor.
-            // SIGWINCH will trigger the TUI app to redraw at correct size.
-            // When the TUI exits (ESC[?1049l), the clean main screen is restored.
-            const char *reset = "\033[?1049h\033[0m\033[H\033[2J\033[?25h";
-            return send_msg(fd, MSG_DATA, (const uint8_t *)reset, strlen(reset));
-        }
-
-        int start = (head - count + SCROLLBACK_SIZE) % SCROLLBACK_SIZE;
-        int remaining = count;
-        while (remaining > 0) {
-            int chunk = remaining;
-            // Don't wrap around the buffer boundary
-            if (start + chunk > SCROLLBACK_SIZE)
-                chunk = SCROLLBACK_SIZE - start;
-            if (!send_msg(fd, MSG_DATA, data + start, (uint32_t)chunk))
+    // Pop the next complete frame. The payload points into the buffer and is
+    // valid until the next fill(). Returns false when no complete frame is
+    // buffered; *bad is set if the peer violated the protocol.
+    bool next(MsgType *type, const uint8_t **data, uint32_t *len, bool *bad) {
+        *bad = false;
+        size_t avail = end - start;
+        if (avail >= 5) {
+            uint32_t plen = peek_len(start);
+            if (plen > MAX_FRAME_LEN) {
+                *bad = true;
                 return false;
-            start = (start + chunk) % SCROLLBACK_SIZE;
-            remaining -= chunk;
+            }
+            if (avail >= 5 + (size_t)plen) {
+                *type = (MsgType)buf[start];
+                *len = plen;
+                *data = plen ? &buf[start + 5] : NULL;
+                start += 5 + plen;
+                partial_since = 0;
+                return true;
+            }
         }
-        return true;
+        if (avail > 0 && partial_since == 0) partial_since = now_ms();
+        return false;
     }
-};
 
-struct ServerState {
-    std::string name;
-    std::string command;
-    int pty_master;
-    pid_t child_pid;
-    int listen_fd;
-    int client_fds[MAX_CLIENTS];
-    int num_clients;
-    time_t created;
-    int child_exit_code; // [FIX #7] saved when child is first reaped
-    volatile bool running;
-    ScrollbackBuffer *scrollback;
+private:
+    uint32_t peek_len(size_t pos) const {
+        return ((uint32_t)buf[pos + 1] << 24) | ((uint32_t)buf[pos + 2] << 16) |
+               ((uint32_t)buf[pos + 3] << 8)  | (uint32_t)buf[pos + 4];
+    }
 };
 
-static ServerState *g_server = NULL;
-
-static void server_sigchld(int) {
-    // Child exited — reap immediately and save exit code [FIX #7]
-    if (g_server && g_server->child_pid > 0) {
-        int wstatus;
-        pid_t wp = waitpid(g_server->child_pid, &wstatus, WNOHANG);
-        if (wp > 0) {
-            if (WIFEXITED(wstatus))
-                g_server->child_exit_code = WEXITSTATUS(wstatus);
-            else if (WIFSIGNALED(wstatus))
-                g_server->child_exit_code = 128 + WTERMSIG(wstatus);
-            g_server->child_pid = -1; // mark as reaped
-        }
-        g_server->running = false;
-    }
+// ---- DATA compression ----
+// MSG_DATA_Z payload: [raw length u32 BE][LZ block]. The block format follows
+// LZ4's: each sequence is a token (literal count << 4 | match length - 4),
+// extra length bytes for counts >= 15 (255 = keep adding), the literals, a
+// 16-bit little-endian match offset, and extra match length bytes. The last
+// sequence has literals only. Terminal output (prompts, SGR runs, repeated
+// lines) typically shrinks 5-10x; the encoder is single pass and greedy.
+
+static const int LZ_HASH_BITS = 12;
+static const size_t LZ_MIN_MATCH = 4;
+static const size_t LZ_MAX_OFFSET = 65535;
+// DATA payloads smaller than this go out uncompressed
+static const size_t LZ_MIN_INPUT = 64;
+
+static size_t lz_bound(size_t n) { return n + n / 255 + 16; }
+
+static uint32_t lz_load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
 }
 
-static void server_sigterm(int) {
-    if (g_server) g_server->running = false;
+static uint8_t *lz_put_len(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
 }
 
-static void server_sighup(int) {
-    // Forward HUP to child (terminal hangup) and shut down
-    if (g_server && g_server->child_pid > 0)
-        kill(g_server->child_pid, SIGHUP);
-    if (g_server) g_server->running = false;
+// Emit one sequence: literals [lit, lit + nlit), then a match (mlen 0 = none)
+static uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *lit, size_t nlit,
+                                size_t offset, size_t mlen) {
+    size_t ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    uint8_t *token = op++;
+    *token = (uint8_t)((std::min(nlit, (size_t)15) << 4) | std::min(ml, (size_t)15));
+    if (nlit >= 15) op = lz_put_len(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0) return op;
+    *op++ = (uint8_t)(offset & 0xFF);
+    *op++ = (uint8_t)(offset >> 8);
+    if (ml >= 15) op = lz_put_len(op, ml - 15);
+    return op;
 }
 
-static void server_remove_client(ServerState &srv, int idx) {
-    close(srv.client_fds[idx]);
-    srv.client_fds[idx] = srv.client_fds[srv.num_clients - 1];
-    srv.num_clients--;
-    write_info_file(info_path(srv.name), getpid(), srv.num_clients,
-                    srv.created, srv.command);
+// Compress n bytes into dst, which must hold lz_bound(n). Returns the size.
+static size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    uint8_t *op = dst;
+    size_t ip = 0, anchor = 0;
+    while (ip + LZ_MIN_MATCH <= n) {
+        uint32_t v = lz_load32(src + ip);
+        uint32_t h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t cand = table[h];
+        table[h] = (uint32_t)ip;
+        if (cand < ip && ip - cand <= LZ_MAX_OFFSET && lz_load32(src + cand) == v) {
+            size_t m = LZ_MIN_MATCH;
+            while (ip + m < n && src[cand + m] == src[ip + m]) m++;
+            op = lz_put_sequence(op, src + anchor, ip - anchor, ip - cand, m);
+            ip += m;
+            anchor = ip;
+        } else {
+            // Step faster through data that isn't matching
+            ip += 1 + ((ip - anchor) >> 6);
+        }
+    }
+    op = lz_put_sequence(op, src + anchor, n - anchor, 0, 0);
+    return op - dst;
 }
 
-static void server_broadcast(ServerState &srv, MsgType type,
-                             const void *data, uint32_t len) {
-    for (int i = srv.num_clients - 1; i >= 0; i--) {
-        if (!send_msg(srv.client_fds[i], type, data, len)) {
-            server_remove_client(srv, i);
+// Returns false unless src decodes to exactly raw_len bytes
+static bool lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t raw_len) {
+    size_t ip = 0, op = 0;
+    while (ip < n) {
+        uint8_t token = src[ip++];
+        size_t nlit = token >> 4;
+        if (nlit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= n) return false;
+                b = src[ip++];
+                nlit += b;
+            } while (b == 255);
         }
+        if (nlit > n - ip || nlit > raw_len - op) return false;
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == n) break;  // last sequence: literals only
+
+        if (n - ip < 2) return false;
+        size_t offset = src[ip] | ((size_t)src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) return false;
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            uint8_t b;
+            do {
+                if (ip >= n) return false;
+                b = src[ip++];
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > raw_len - op) return false;
+        const uint8_t *from = dst + op - offset;
+        if (offset >= mlen) {
+            memcpy(dst + op, from, mlen);
+        } else {
+            for (size_t k = 0; k < mlen; k++) dst[op + k] = from[k];  // overlapping
+        }
+        op += mlen;
     }
+    return op == raw_len;
 }
 
-static int create_listen_socket(const std::string &path) {
-    // [FIX #2 cont.] Validate path length
-    if (!socket_path_fits(path)) {
-        fprintf(stderr, "Socket path too long: %s\n", path.c_str());
-        return -1;
+// Build a MSG_DATA_Z payload from DATA gathered from parts. Returns false
+// (leaving out unspecified) if compressing wouldn't make the frame smaller.
+static bool compress_data(const struct iovec *parts, int nparts, std::vector<uint8_t> &out) {
+    size_t len = 0;
+    for (int i = 0; i < nparts; i++) len += parts[i].iov_len;
+    if (len < LZ_MIN_INPUT || len > MAX_FRAME_LEN) return false;
+    const uint8_t *raw = (const uint8_t *)parts[0].iov_base;
+    std::vector<uint8_t> joined;
+    if (nparts > 1) {
+        joined.reserve(len);
+        for (int i = 0; i < nparts; i++) {
+            const uint8_t *p = (const uint8_t *)parts[i].iov_base;
+            joined.insert(joined.end(), p, p + parts[i].iov_len);
+        }
+        raw = &joined[0];
     }
+    out.resize(4 + lz_bound(len));
+    out[0] = (len >> 24) & 0xFF;
+    out[1] = (len >> 16) & 0xFF;
+    out[2] = (len >> 8) & 0xFF;
+    out[3] = len & 0xFF;
+    size_t z = lz_compress(raw, len, &out[4]);
+    if (4 + z >= len) return false;
+    out.resize(4 + z);
+    return true;
+}
 
-    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (fd < 0) return -1;
+// Decode a MSG_DATA_Z payload into out
+static bool decompress_data(const uint8_t *data, uint32_t len, std::vector<uint8_t> &out) {
+    if (len < 4) return false;
+    uint32_t raw_len = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+                       ((uint32_t)data[2] << 8)  | (uint32_t)data[3];
+    if (raw_len == 0 || raw_len > MAX_FRAME_LEN) return false;
+    out.resize(raw_len);
+    return lz_decompress(data + 4, len - 4, &out[0], raw_len);
+}
 
-    struct sockaddr_un addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+// Framed bytes shared by every output queue holding a reference. A PTY read
+// lands directly in one and is queued for all clients of the session
+// without a copy each; small frames for one client are packed into their
+// own chunk. Chunks nobody refers to any more go back to a small pool.
+struct OutChunk {
+    std::vector<uint8_t> bytes;
+    int refs;
+};
 
-    unlink(path.c_str());
-    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        close(fd);
-        return -1;
-    }
-    if (listen(fd, 4) < 0) {
-        close(fd);
-        return -1;
+// Frames are packed into one chunk up to this size
+static const size_t OUT_CHUNK_SIZE = 64 * 1024;
+static const size_t OUT_CHUNK_POOL = 16;
+static std::vector<OutChunk *> out_chunk_pool;
+
+// A chunk with one reference. Its bytes are left over from earlier use:
+// callers resize them, which for a pooled chunk neither allocates nor fills.
+static OutChunk *out_chunk_new() {
+    OutChunk *c;
+    if (out_chunk_pool.empty()) {
+        c = new OutChunk;
+    } else {
+        c = out_chunk_pool.back();
+        out_chunk_pool.pop_back();
     }
-    chmod(path.c_str(), 0600);
-    return fd;
+    c->refs = 1;
+    return c;
 }
 
-// Set a receive timeout on a client socket [FIX #5]
-static void set_recv_timeout(int fd, int seconds) {
-    struct timeval tv;
-    tv.tv_sec = seconds;
-    tv.tv_usec = 0;
-    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+static void out_chunk_unref(OutChunk *c) {
+    if (--c->refs > 0) return;
+    // Keep chunks of ordinary size; a big one (e.g. a replay frame) is freed
+    if (c->bytes.capacity() <= 2 * OUT_CHUNK_SIZE && out_chunk_pool.size() < OUT_CHUNK_POOL) {
+        out_chunk_pool.push_back(c);
+    } else {
+        delete c;
+    }
 }
 
-static int run_server(const std::string &name, const std::string &cmd) {
-    if (!ensure_socket_dir()) return 1;
+// A chunk holding just one frame, which can then be queued for many clients
+static OutChunk *out_chunk_frame(MsgType type, const void *data, uint32_t len) {
+    OutChunk *c = out_chunk_new();
+    c->bytes.resize(5 + len);
+    put_header(&c->bytes[0], type, len);
+    if (len) memcpy(&c->bytes[5], data, len);
+    return c;
+}
 
-    // Fork PTY
-    int pty_master;
-    pid_t child = forkpty(&pty_master, NULL, NULL, NULL);
-    if (child < 0) {
-        perror("forkpty");
-        return 1;
+// Framed output waiting to be written to one client socket. The server never
+// blocks on a client: frames are queued here and drained with non-blocking
+// sends whenever the socket is writable. Everything queued during one loop
+// iteration (DATA, keepalive, EXIT...) leaves in a single sendmsg() per
+// client, gathered from the chunks it is in.
+struct OutQueue {
+    // Bytes [off, end) of chunk. Frame headers in it start at first (end
+    // if the span is the tail of a frame that has already started going out).
+    struct Span {
+        OutChunk *chunk;
+        size_t off;
+        size_t end;
+        size_t first;
+    };
+    std::deque<Span> spans;
+    size_t bytes;     // unwritten, across all spans
+    uint64_t sent;    // bytes written to the socket since reset()
+    uint64_t frames;  // frames queued or sent since reset()
+    bool corked;      // queue only, write nothing: output that must wait
+
+    OutQueue() : bytes(0), sent(0), frames(0), corked(false) {}
+    ~OutQueue() { reset(); }
+    // Moved, never copied: a copy would share chunks without references
+    OutQueue(OutQueue &&o) : bytes(0), sent(0), frames(0), corked(false) { swap(o); }
+    OutQueue &operator=(OutQueue &&o) {
+        swap(o);
+        return *this;
     }
-    if (child == 0) {
-        // Child: exec shell
-        const char *shell = getenv("SHELL");
-        if (!shell) shell = "/bin/bash";
-        if (cmd.empty()) {
-            execlp(shell, shell, "-l", (char *)NULL);
-        } else {
-            execlp(shell, shell, "-l", "-c", cmd.c_str(), (char *)NULL);
-        }
-        perror("exec");
-        _exit(127);
+    OutQueue(const OutQueue &) = delete;
+    OutQueue &operator=(const OutQueue &) = delete;
+
+    void swap(OutQueue &o) {
+        spans.swap(o.spans);
+        std::swap(bytes, o.bytes);
+        std::swap(sent, o.sent);
+        std::swap(frames, o.frames);
+        std::swap(corked, o.corked);
     }
 
-    // Parent: server daemon
-    set_nonblock(pty_master);
-
-    std::string spath = socket_path(name);
-    int listen_fd = create_listen_socket(spath);
-    if (listen_fd < 0) {
-        fprintf(stderr, "Failed to create socket: %s\n", spath.c_str());
-        kill(child, SIGTERM);
-        waitpid(child, NULL, 0);
-        return 1;
+    void reset() {
+        release();
+        sent = 0;
+        frames = 0;
+        corked = false;
     }
 
-    // Heap-allocate scrollback (128KB) to avoid stack overflow
-    ScrollbackBuffer *scrollback = new ScrollbackBuffer();
-    scrollback->reset();
-
-    ServerState srv;
-    srv.name = name;
-    srv.command = cmd.empty() ? "bash" : cmd;
-    srv.pty_master = pty_master;
-    srv.child_pid = child;
-    srv.listen_fd = listen_fd;
-    srv.num_clients = 0;
-    srv.created = time(NULL);
-    srv.child_exit_code = 0;
-    srv.running = true;
-    srv.scrollback = scrollback;
-    g_server = &srv;
+    size_t size() const { return bytes; }
+    bool empty() const { return bytes == 0; }
 
-    write_pid_file(pid_path(name), getpid());
-    write_info_file(info_path(name), getpid(), 0, srv.created, srv.command);
+    void push_frame(MsgType type, const void *data, uint32_t len) {
+        struct iovec part;
+        part.iov_base = (void *)data;
+        part.iov_len = len;
+        push_framev(type, &part, 1);
+    }
 
-    signal(SIGCHLD, server_sigchld);
-    signal(SIGTERM, server_sigterm);
-    signal(SIGHUP, server_sighup);
-    signal(SIGPIPE, SIG_IGN);
+    // One frame whose payload is gathered from several buffers
+    void push_framev(MsgType type, const struct iovec *parts, int nparts) {
+        uint32_t len = 0;
+        for (int i = 0; i < nparts; i++) len += (uint32_t)parts[i].iov_len;
+        uint8_t *p = append(5 + len);
+        frames++;
+        put_header(p, type, len);
+        p += 5;
+        for (int i = 0; i < nparts; i++) {
+            if (parts[i].iov_len == 0) continue;
+            memcpy(p, parts[i].iov_base, parts[i].iov_len);
+            p += parts[i].iov_len;
+        }
+    }
 
-    // Event loop with poll()
-    while (srv.running) {
-        // Build pollfd array: [listen_fd, pty_master, client0, client1, ...]
-        // Save client count BEFORE poll — new clients accepted this iteration
-        // must NOT be processed (their fds aren't in the poll set).
-        int poll_num_clients = srv.num_clients;
+    // Queue the frames in chunk c by reference
+    void push_shared(OutChunk *c) {
+        if (c->bytes.empty()) return;
+        c->refs++;
+        frames++;  // chunks are shared one frame at a time
+        Span s = {c, 0, c->bytes.size(), 0};
+        spans.push_back(s);
+        bytes += s.end;
+    }
 
-        std::vector<struct pollfd> fds;
-        fds.resize(2 + poll_num_clients);
+    // Like push_framev, but if nothing is queued (and the queue isn't corked)
+    // the frame is written straight from the caller's buffers with one
+    // writev() and only the part the socket didn't take is copied. Returns
+    // false if the connection is broken.
+    bool send_framev(int fd, MsgType type, const struct iovec *parts, int nparts) {
+        if (!empty() || corked || nparts > 7) {
+            push_framev(type, parts, nparts);
+            return true;
+        }
+        uint8_t hdr[5];
+        struct iovec iov[8];
+        size_t total = 5;
+        uint32_t len = 0;
+        for (int i = 0; i < nparts; i++) len += (uint32_t)parts[i].iov_len;
+        put_header(hdr, type, len);
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = 5;
+        for (int i = 0; i < nparts; i++) {
+            iov[1 + i] = parts[i];
+            total += parts[i].iov_len;
+        }
+        ssize_t n;
+        do {
+            n = writev(fd, iov, nparts + 1);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+            n = 0;
+        }
+        frames++;
+        sent += n;
+        if ((size_t)n == total) return true;
+        // Queue the unwritten tail. It belongs to a frame that has already
+        // started going out, so it is committed (see discard_pending).
+        uint8_t *p = append(total - n);
+        size_t skip = n;
+        for (int i = 0; i < nparts + 1; i++) {
+            const uint8_t *src = (const uint8_t *)iov[i].iov_base;
+            size_t l = iov[i].iov_len;
+            if (skip >= l) { skip -= l; continue; }
+            memcpy(p, src + skip, l - skip);
+            p += l - skip;
+            skip = 0;
+        }
+        spans.back().first = spans.back().end;
+        return true;
+    }
 
-        fds[0].fd = listen_fd;
-        fds[0].events = POLLIN;
-        fds[1].fd = pty_master;
-        fds[1].events = POLLIN;
-        for (int i = 0; i < poll_num_clients; i++) {
-            fds[2 + i].fd = srv.client_fds[i];
-            fds[2 + i].events = POLLIN;
+    // Terminal output as DATA, or as DATA_Z if compress is set and it helps
+    bool send_data(int fd, const struct iovec *parts, int nparts, bool compress) {
+        std::vector<uint8_t> z;
+        if (compress && compress_data(parts, nparts, z)) {
+            struct iovec part;
+            part.iov_base = &z[0];
+            part.iov_len = z.size();
+            return send_framev(fd, MSG_DATA_Z, &part, 1);
         }
+        return send_framev(fd, MSG_DATA, parts, nparts);
+    }
 
-        int ret = poll(fds.data(), fds.size(), 1000);
-        if (ret < 0) {
-            if (errno == EINTR) continue;
-            break;
+    // Drop every queued frame that hasn't started going out. A frame that is
+    // partially written must be finished, or the client loses framing.
+    void discard_pending() {
+        if (spans.empty()) return;
+        for (size_t i = 1; i < spans.size(); i++) {
+            bytes -= spans[i].end - spans[i].off;
+            out_chunk_unref(spans[i].chunk);
         }
+        spans.resize(1);
+        // Only a frame in progress in the oldest span survives
+        Span &s = spans.front();
+        size_t pos = s.first;
+        while (pos < s.off) pos += 5 + frame_len(s.chunk, pos);
+        bytes -= s.end - pos;
+        s.end = pos;
+        if (bytes == 0) release();
+    }
 
-        // Keepalive: on poll timeout, send zero-length DATA to each client.
-        // If the write fails (EPIPE/ECONNRESET), the client is dead — remove it.
-        // This detects stale connections even when the session is idle.
-        // Note: only keepalive clients that were in the poll set.
-        if (ret == 0 && poll_num_clients > 0) {
-            server_broadcast(srv, MSG_DATA, NULL, 0);
+    // Write as much as the socket takes without blocking (nothing while
+    // corked). Returns false if the connection is broken.
+    bool flush(int fd) {
+        while (!empty() && !corked) {
+            struct iovec iov[64];
+            int n = 0;
+            for (size_t i = 0; i < spans.size() && n < 64; i++) {
+                if (spans[i].off == spans[i].end) continue;
+                iov[n].iov_base = &spans[i].chunk->bytes[spans[i].off];
+                iov[n].iov_len = spans[i].end - spans[i].off;
+                n++;
+            }
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = n;
+            ssize_t w = sendmsg(fd, &msg, MSG_DONTWAIT);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return false;
+            }
+            consume(w);
         }
+        return true;
+    }
 
-        // Check for new client connections
-        if (fds[0].revents & POLLIN) {
-            int cfd = accept(listen_fd, NULL, NULL);
-            if (cfd >= 0) {
-                if (srv.num_clients >= MAX_CLIENTS) {
-                    close(cfd);
-                } else {
-                    // [FIX #3] Read HELLO with proper error handling
-                    MsgType type;
-                    uint8_t *data = NULL;
-                    uint32_t len = 0;
-                    bool hello_ok = false;
-
-                    // Set short timeout for hello handshake
-                    struct timeval tv;
-                    tv.tv_sec = 2;
-                    tv.tv_usec = 0;
-                    setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-
-                    uint8_t hello_flags = 0;
-                    if (recv_msg(cfd, &type, &data, &len)) {
-                        if (type == MSG_HELLO && (len == 4 || len == 5)) {
-                            uint16_t cols = ((uint16_t)data[0] << 8) | data[1];
-                            uint16_t rows = ((uint16_t)data[2] << 8) | data[3];
-                            if (len == 5) hello_flags = data[4];
-                            struct winsize ws;
-                            ws.ws_col = cols;
-                            ws.ws_row = rows;
-                            ws.ws_xpixel = 0;
-                            ws.ws_ypixel = 0;
-                            ioctl(pty_master, TIOCSWINSZ, &ws);
-                            hello_ok = true;
-                        }
-                        // Free data regardless of type/len match
-                        if (data) free(data);
-                    }
+private:
+    void release() {
+        for (size_t i = 0; i < spans.size(); i++) out_chunk_unref(spans[i].chunk);
+        spans.clear();
+        bytes = 0;
+    }
 
-                    if (hello_ok) {
-                        // Replay scrollback history to new client
-                        // Skip if client requested no-replay (fast attach)
-                        bool skip = (hello_flags & HELLO_FLAG_NO_REPLAY) != 0;
-                        srv.scrollback->replay_to(cfd, skip);
-
-                        // Set operational recv timeout [FIX #5]
-                        set_recv_timeout(cfd, CLIENT_RECV_TIMEOUT);
-
-                        // Add client to broadcast list BEFORE signaling child,
-                        // so the SIGWINCH-triggered redraw reaches this client.
-                        srv.client_fds[srv.num_clients++] = cfd;
-                        write_info_file(info_path(name), getpid(), srv.num_clients,
-                                        srv.created, srv.command);
-
-                        // Now signal child to redraw at new window size.
-                        // The redraw output will broadcast to all clients
-                        // including the one we just added.
-                        if (srv.child_pid > 0)
-                            kill(srv.child_pid, SIGWINCH);
-                    } else {
-                        // Failed handshake — reject client
-                        close(cfd);
-                    }
-                }
-            }
+    // Room for n bytes at the end of the queue, in a chunk no other queue
+    // refers to
+    uint8_t *append(size_t n) {
+        if (spans.empty() || spans.back().chunk->refs > 1 ||
+            spans.back().end + n > OUT_CHUNK_SIZE) {
+            Span s = {out_chunk_new(), 0, 0, 0};
+            spans.push_back(s);
         }
+        Span &s = spans.back();
+        s.chunk->bytes.resize(s.end + n);
+        uint8_t *p = &s.chunk->bytes[s.end];
+        s.end += n;
+        bytes += n;
+        return p;
+    }
 
-        // PTY output → store in scrollback + broadcast to all clients
-        if (fds[1].revents & POLLIN) {
-            uint8_t buf[BUF_SIZE];
-            ssize_t n = read(pty_master, buf, sizeof(buf));
-            if (n > 0) {
-                srv.scrollback->scan_alt_screen(buf, (int)n);
-                srv.scrollback->append(buf, (int)n);  // skips if in_alt_screen
-                server_broadcast(srv, MSG_DATA, buf, (uint32_t)n);
-            } else if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
-                srv.running = false;
+    void consume(size_t n) {
+        bytes -= n;
+        sent += n;
+        while (!spans.empty()) {
+            Span &s = spans.front();
+            if (n < s.end - s.off) {
+                s.off += n;
+                return;
             }
+            n -= s.end - s.off;
+            out_chunk_unref(s.chunk);
+            spans.pop_front();
         }
-        if (fds[1].revents & (POLLHUP | POLLERR)) {
-            srv.running = false;
-        }
+    }
 
-        // Client input — only process clients that were in the poll set
-        for (int i = poll_num_clients - 1; i >= 0; i--) {
-            if (fds[2 + i].revents & (POLLIN | POLLHUP | POLLERR)) {
-                MsgType type;
-                uint8_t *data = NULL;
-                uint32_t len = 0;
+    static uint32_t frame_len(const OutChunk *c, size_t pos) {
+        const uint8_t *p = &c->bytes[pos];
+        return ((uint32_t)p[1] << 24) | ((uint32_t)p[2] << 16) |
+               ((uint32_t)p[3] << 8)  | (uint32_t)p[4];
+    }
+};
+
+// ============================================================================
+// 5. Terminal raw mode
+// ============================================================================
+
+static struct termios saved_termios;
+static bool termios_saved = false;
+
+static void term_raw() {
+    if (!isatty(STDIN_FILENO)) return;
+    struct termios t;
+    if (tcgetattr(STDIN_FILENO, &saved_termios) < 0) return;
+    termios_saved = true;
+    t = saved_termios;
+    cfmakeraw(&t);
+    tcsetattr(STDIN_FILENO, TCSANOW, &t);
+}
+
+static void term_restore() {
+    if (termios_saved)
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
+    termios_saved = false;
+}
+
+// [FIX #4 partial] atexit handler to restore terminal on unexpected exit
+static void atexit_restore() {
+    term_restore();
+}
+
+// ============================================================================
+// 6. Terminal emulation: escape-sequence parser, screen model
+// ============================================================================
+
+// Terminal modes the daemon tracks from the PTY output stream
+struct VtModes {
+    bool alt_screen;       // CSI ?47/?1047/?1049 h/l
+    bool cursor_hidden;    // CSI ?25 l/h
+    bool bracketed_paste;  // CSI ?2004 h/l
+
+    VtModes() : alt_screen(false), cursor_hidden(false), bracketed_paste(false) {}
+
+    bool operator!=(const VtModes &o) const {
+        return alt_screen != o.alt_screen || cursor_hidden != o.cursor_hidden ||
+               bracketed_paste != o.bracketed_paste;
+    }
+};
+
+// Length of the printable run (no C0 control, no DEL) at the start of p: the
+// ground-state scan of a parser whose handler wants text. Picked at compile
+// time from what the target guarantees -- SSE2 is part of x86-64, so the
+// portable build has it; AVX2 needs -march (make fast) -- with no runtime
+// dispatch in the parser loop.
+struct ScalarTextScan {
+    static size_t run(const uint8_t *p, size_t n) {
+        size_t i = 0;
+        while (i < n && p[i] >= 0x20 && p[i] != 0x7f) i++;
+        return i;
+    }
+};
+
+#if defined(__AVX2__)
+struct Avx2TextScan {
+    static size_t run(const uint8_t *p, size_t n) {
+        const __m256i c0 = _mm256_set1_epi8(0x1f), del = _mm256_set1_epi8(0x7f);
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            // Unsigned v <= 0x1f is min(v, 0x1f) == v
+            __m256i stop = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, c0), v),
+                                           _mm256_cmpeq_epi8(v, del));
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8(stop);
+            if (mask) return i + __builtin_ctz(mask);
+        }
+        return i + ScalarTextScan::run(p + i, n - i);
+    }
+};
+typedef Avx2TextScan TextScan;
+#elif defined(__SSE2__)
+struct Sse2TextScan {
+    static size_t run(const uint8_t *p, size_t n) {
+        const __m128i c0 = _mm_set1_epi8(0x1f), del = _mm_set1_epi8(0x7f);
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            __m128i stop = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, c0), v),
+                                        _mm_cmpeq_epi8(v, del));
+            unsigned mask = (unsigned)_mm_movemask_epi8(stop);
+            if (mask) return i + __builtin_ctz(mask);
+        }
+        return i + ScalarTextScan::run(p + i, n - i);
+    }
+};
+typedef Sse2TextScan TextScan;
+#else
+typedef ScalarTextScan TextScan;
+#endif
+
+// Streaming VT500-style parser (after Paul Williams' state diagram). State is
+// carried between feed() calls, so a sequence split across PTY reads is
+// recognised, and every byte is visited once. In the ground state text is
+// skipped in bulk: memchr to the next ESC when the handler only cares about
+// sequences, or a scan to the next control byte when it wants printable runs.
+//
+// The Handler supplies:
+//   static const bool wants_text;
+//   void on_print(const uint8_t *p, size_t n);    // printable run (wants_text)
+//   void on_execute(uint8_t c);                   // C0 control (wants_text)
+//   void on_esc(const VtParser &vt, uint8_t final);
+//   void on_csi(const VtParser &vt, uint8_t final);
+//   void on_modes(const VtParser &vt, const VtModes &old,
+//                 size_t begin, size_t end, bool begin_before);
+// on_modes reports a change of vt.modes caused by the sequence occupying
+// [begin, end) of the current buffer; begin_before means the sequence started
+// in an earlier buffer (begin is then 0).
+struct VtParser {
+    enum State {
+        GROUND, ESCAPE, ESC_INTER, CSI_ENTRY, CSI_PARAM, CSI_INTER,
+        CSI_IGNORE, OSC, STRING, NUM_STATES
+    };
+    enum Class {
+        C_C0, C_CAN, C_ESC, C_INTER, C_DIGIT, C_SEMI, C_PRIV, C_CSI_OPEN,
+        C_OSC_OPEN, C_STR_OPEN, C_FINAL, C_DEL, C_HIGH, C_BEL, NUM_CLASSES
+    };
+    enum Action {
+        A_NONE, A_PRINT, A_EXEC, A_CLEAR, A_COLLECT, A_PARAM,
+        A_ESC_DISPATCH, A_CSI_DISPATCH, A_OSC_PUT, A_OSC_END
+    };
+
+    static const int MAX_PARAMS = 16;
+    static const int MAX_INTER = 4;
+
+    uint8_t state;
+    VtModes modes;
+    int params[MAX_PARAMS];
+    int nparams;
+    bool param_started;
+    char priv;                 // private marker (e.g. '?'), 0 if none
+    char inter[MAX_INTER];
+    int ninter;
+    size_t seq_begin;          // start of the current sequence in this buffer
+    bool seq_before;           // current sequence started in an earlier buffer
+
+    VtParser() { reset(); }
+
+    void reset() {
+        state = GROUND;
+        modes = VtModes();
+        clear();
+        seq_begin = 0;
+        seq_before = false;
+    }
+
+    bool in_sequence() const { return state != GROUND; }
+
+    // Parameter i, or def if absent/zero (CSI convention)
+    int param(int i, int def) const {
+        return (i < nparams && params[i] > 0) ? params[i] : def;
+    }
+
+    template <class Handler>
+    void feed(const uint8_t *buf, size_t len, Handler &h) {
+        const uint8_t *cls = class_table();
+        seq_begin = 0;
+        seq_before = in_sequence();
+        size_t i = 0;
+        while (i < len) {
+            if (state == GROUND) {
+                // Fast path: skip text in bulk
+                size_t j = i;
+                if (Handler::wants_text) {
+                    j += TextScan::run(buf + i, len - i);
+                    if (j > i) h.on_print(buf + i, j - i);
+                } else {
+                    const void *esc = memchr(buf + i, 0x1b, len - i);
+                    j = esc ? (size_t)((const uint8_t *)esc - buf) : len;
+                }
+                i = j;
+                if (i >= len) break;
+            }
+            uint8_t c = buf[i];
+            uint8_t t = TRANSITIONS[state][cls[c]];
+            uint8_t action = t >> 4;
+            uint8_t next = t & 0x0F;
+            switch (action) {
+            case A_PRINT:
+                if (Handler::wants_text) h.on_print(buf + i, 1);
+                break;
+            case A_EXEC:
+                if (Handler::wants_text) h.on_execute(c);
+                break;
+            case A_CLEAR:
+                clear();
+                if (c == 0x1b) {
+                    seq_begin = i;
+                    seq_before = false;
+                }
+                break;
+            case A_COLLECT:
+                if (cls[c] == C_PRIV) priv = (char)c;
+                else if (ninter < MAX_INTER) inter[ninter++] = (char)c;
+                break;
+            case A_PARAM:
+                if (c == ';' || c == ':') {
+                    if (nparams < MAX_PARAMS) nparams++;
+                    if (nparams < MAX_PARAMS) params[nparams] = 0;
+                } else if (nparams < MAX_PARAMS) {
+                    int &p = params[nparams];
+                    if (p < 100000) p = p * 10 + (c - '0');
+                }
+                param_started = true;
+                break;
+            case A_ESC_DISPATCH: {
+                VtModes old = modes;
+                if (c == 'c' && ninter == 0) modes = VtModes();  // RIS
+                h.on_esc(*this, c);
+                if (modes != old) h.on_modes(*this, old, seq_begin, i + 1, seq_before);
+                break;
+            }
+            case A_CSI_DISPATCH: {
+                if (param_started && nparams < MAX_PARAMS) nparams++;
+                VtModes old = modes;
+                if (priv == '?' && ninter == 0 && (c == 'h' || c == 'l'))
+                    set_private_modes(c == 'h');
+                h.on_csi(*this, c);
+                if (modes != old) h.on_modes(*this, old, seq_begin, i + 1, seq_before);
+                break;
+            }
+            default:
+                break;  // A_NONE, OSC contents (not interpreted yet)
+            }
+            state = next;
+            i++;
+        }
+    }
+
+private:
+    void clear() {
+        nparams = 0;
+        params[0] = 0;
+        param_started = false;
+        priv = 0;
+        ninter = 0;
+    }
+
+    void set_private_modes(bool on) {
+        for (int k = 0; k < nparams; k++) {
+            switch (params[k]) {
+            case 47: case 1047: case 1049: modes.alt_screen = on; break;
+            case 25:   modes.cursor_hidden = !on; break;
+            case 2004: modes.bracketed_paste = on; break;
+            default: break;
+            }
+        }
+    }
+
+    static const uint8_t *class_table() {
+        struct Table {
+            uint8_t c[256];
+            Table() {
+                for (int b = 0; b < 256; b++) {
+                    uint8_t k;
+                    if (b == 0x1b) k = C_ESC;
+                    else if (b == 0x18 || b == 0x1a) k = C_CAN;
+                    else if (b == 0x07) k = C_BEL;
+                    else if (b < 0x20) k = C_C0;
+                    else if (b < 0x30) k = C_INTER;
+                    else if (b <= 0x3a) k = C_DIGIT;   // digits and ':' sub-params
+                    else if (b == 0x3b) k = C_SEMI;
+                    else if (b < 0x40) k = C_PRIV;     // < = > ?
+                    else if (b == '[') k = C_CSI_OPEN;
+                    else if (b == ']') k = C_OSC_OPEN;
+                    else if (b == 'P' || b == 'X' || b == '^' || b == '_') k = C_STR_OPEN;
+                    else if (b < 0x7f) k = C_FINAL;
+                    else if (b == 0x7f) k = C_DEL;
+                    else k = C_HIGH;
+                    c[b] = k;
+                }
+            }
+        };
+        static const Table table;
+        return table.c;
+    }
+
+    static const uint8_t TRANSITIONS[NUM_STATES][NUM_CLASSES];
+};
+
+#define VT_T(a, s) (uint8_t)(((VtParser::a) << 4) | (VtParser::s))
+const uint8_t VtParser::TRANSITIONS[VtParser::NUM_STATES][VtParser::NUM_CLASSES] = {
+    // C0, CAN, ESC, INTER, DIGIT, SEMI, PRIV, '[', ']', P/X/^/_, FINAL, DEL, HIGH, BEL
+    { // GROUND
+        VT_T(A_EXEC, GROUND), VT_T(A_EXEC, GROUND), VT_T(A_CLEAR, ESCAPE),
+        VT_T(A_PRINT, GROUND), VT_T(A_PRINT, GROUND), VT_T(A_PRINT, GROUND),
+        VT_T(A_PRINT, GROUND), VT_T(A_PRINT, GROUND), VT_T(A_PRINT, GROUND),
+        VT_T(A_PRINT, GROUND), VT_T(A_PRINT, GROUND), VT_T(A_NONE, GROUND),
+        VT_T(A_PRINT, GROUND), VT_T(A_EXEC, GROUND) },
+    { // ESCAPE
+        VT_T(A_EXEC, ESCAPE), VT_T(A_NONE, GROUND), VT_T(A_CLEAR, ESCAPE),
+        VT_T(A_COLLECT, ESC_INTER), VT_T(A_ESC_DISPATCH, GROUND),
+        VT_T(A_ESC_DISPATCH, GROUND), VT_T(A_ESC_DISPATCH, GROUND),
+        VT_T(A_CLEAR, CSI_ENTRY), VT_T(A_CLEAR, OSC), VT_T(A_CLEAR, STRING),
+        VT_T(A_ESC_DISPATCH, GROUND), VT_T(A_NONE, ESCAPE),
+        VT_T(A_NONE, GROUND), VT_T(A_EXEC, ESCAPE) },
+    { // ESC_INTER
+        VT_T(A_EXEC, ESC_INTER), VT_T(A_NONE, GROUND), VT_T(A_CLEAR, ESCAPE),
+        VT_T(A_COLLECT, ESC_INTER), VT_T(A_ESC_DISPATCH, GROUND),
+        VT_T(A_ESC_DISPATCH, GROUND), VT_T(A_ESC_DISPATCH, GROUND),
+        VT_T(A_ESC_DISPATCH, GROUND), VT_T(A_ESC_DISPATCH, GROUND),
+        VT_T(A_ESC_DISPATCH, GROUND), VT_T(A_ESC_DISPATCH, GROUND),
+        VT_T(A_NONE, ESC_INTER), VT_T(A_NONE, GROUND), VT_T(A_EXEC, ESC_INTER) },
+    { // CSI_ENTRY
+        VT_T(A_EXEC, CSI_ENTRY), VT_T(A_NONE, GROUND), VT_T(A_CLEAR, ESCAPE),
+        VT_T(A_COLLECT, CSI_INTER), VT_T(A_PARAM, CSI_PARAM),
+        VT_T(A_PARAM, CSI_PARAM), VT_T(A_COLLECT, CSI_PARAM),
+        VT_T(A_CSI_DISPATCH, GROUND), VT_T(A_CSI_DISPATCH, GROUND),
+        VT_T(A_CSI_DISPATCH, GROUND), VT_T(A_CSI_DISPATCH, GROUND),
+        VT_T(A_NONE, CSI_ENTRY), VT_T(A_NONE, GROUND), VT_T(A_EXEC, CSI_ENTRY) },
+    { // CSI_PARAM
+        VT_T(A_EXEC, CSI_PARAM), VT_T(A_NONE, GROUND), VT_T(A_CLEAR, ESCAPE),
+        VT_T(A_COLLECT, CSI_INTER), VT_T(A_PARAM, CSI_PARAM),
+        VT_T(A_PARAM, CSI_PARAM), VT_T(A_NONE, CSI_IGNORE),
+        VT_T(A_CSI_DISPATCH, GROUND), VT_T(A_CSI_DISPATCH, GROUND),
+        VT_T(A_CSI_DISPATCH, GROUND), VT_T(A_CSI_DISPATCH, GROUND),
+        VT_T(A_NONE, CSI_PARAM), VT_T(A_NONE, GROUND), VT_T(A_EXEC, CSI_PARAM) },
+    { // CSI_INTER
+        VT_T(A_EXEC, CSI_INTER), VT_T(A_NONE, GROUND), VT_T(A_CLEAR, ESCAPE),
+        VT_T(A_COLLECT, CSI_INTER), VT_T(A_NONE, CSI_IGNORE),
+        VT_T(A_NONE, CSI_IGNORE), VT_T(A_NONE, CSI_IGNORE),
+        VT_T(A_CSI_DISPATCH, GROUND), VT_T(A_CSI_DISPATCH, GROUND),
+        VT_T(A_CSI_DISPATCH, GROUND), VT_T(A_CSI_DISPATCH, GROUND),
+        VT_T(A_NONE, CSI_INTER), VT_T(A_NONE, GROUND), VT_T(A_EXEC, CSI_INTER) },
+    { // CSI_IGNORE
+        VT_T(A_EXEC, CSI_IGNORE), VT_T(A_NONE, GROUND), VT_T(A_CLEAR, ESCAPE),
+        VT_T(A_NONE, CSI_IGNORE), VT_T(A_NONE, CSI_IGNORE),
+        VT_T(A_NONE, CSI_IGNORE), VT_T(A_NONE, CSI_IGNORE),
+        VT_T(A_NONE, GROUND), VT_T(A_NONE, GROUND), VT_T(A_NONE, GROUND),
+        VT_T(A_NONE, GROUND), VT_T(A_NONE, CSI_IGNORE),
+        VT_T(A_NONE, GROUND), VT_T(A_EXEC, CSI_IGNORE) },
+    { // OSC: terminated by BEL or ST (ESC \)
+        VT_T(A_NONE, OSC), VT_T(A_NONE, GROUND), VT_T(A_CLEAR, ESCAPE),
+        VT_T(A_OSC_PUT, OSC), VT_T(A_OSC_PUT, OSC), VT_T(A_OSC_PUT, OSC),
+        VT_T(A_OSC_PUT, OSC), VT_T(A_OSC_PUT, OSC), VT_T(A_OSC_PUT, OSC),
+        VT_T(A_OSC_PUT, OSC), VT_T(A_OSC_PUT, OSC), VT_T(A_OSC_PUT, OSC),
+        VT_T(A_OSC_PUT, OSC), VT_T(A_OSC_END, GROUND) },
+    { // STRING: DCS/SOS/PM/APC, ignored until ST
+        VT_T(A_NONE, STRING), VT_T(A_NONE, GROUND), VT_T(A_CLEAR, ESCAPE),
+        VT_T(A_NONE, STRING), VT_T(A_NONE, STRING), VT_T(A_NONE, STRING),
+        VT_T(A_NONE, STRING), VT_T(A_NONE, STRING), VT_T(A_NONE, STRING),
+        VT_T(A_NONE, STRING), VT_T(A_NONE, STRING), VT_T(A_NONE, STRING),
+        VT_T(A_NONE, STRING), VT_T(A_NONE, STRING) },
+};
+#undef VT_T
+
+// Screen model: a cell grid of the visible main and alternate screens, kept
+// up to date from the PTY stream so a reattaching client (or one being
+// resynced) can be sent an exact redraw sized by the screen, not by history.
+
+// Cell colours: 0 = terminal default, COLOR_INDEXED | n (0-255),
+// COLOR_RGB | 0xRRGGBB
+static const uint32_t COLOR_INDEXED = 1u << 24;
+static const uint32_t COLOR_RGB = 2u << 24;
+
+enum CellFlags {
+    ATTR_BOLD      = 1 << 0,
+    ATTR_DIM       = 1 << 1,
+    ATTR_ITALIC    = 1 << 2,
+    ATTR_UNDERLINE = 1 << 3,
+    ATTR_BLINK     = 1 << 4,
+    ATTR_INVERSE   = 1 << 5,
+    ATTR_HIDDEN    = 1 << 6,
+    ATTR_STRIKE    = 1 << 7,
+    ATTR_MASK      = 0xFF,
+    CELL_WIDE      = 1 << 8,   // first half of a double-width character
+    CELL_WIDE_CONT = 1 << 9,   // second half (no character of its own)
+};
+
+// Current rendition (SGR state)
+struct Pen {
+    uint16_t flags;
+    uint32_t fg;
+    uint32_t bg;
+
+    Pen() : flags(0), fg(0), bg(0) {}
+    bool operator==(const Pen &o) const { return flags == o.flags && fg == o.fg && bg == o.bg; }
+    bool operator!=(const Pen &o) const { return !(*this == o); }
+};
+
+struct Cell {
+    uint32_t cp : 21;     // Unicode code point
+    uint32_t flags : 11;  // CellFlags
+    uint32_t fg;
+    uint32_t bg;
+};
+
+// Display width of a code point: 0 (combining), 1, or 2 (East Asian wide)
+static int char_width(uint32_t cp) {
+    if (cp < 0x300) return 1;
+    if ((cp >= 0x300 && cp <= 0x36F) || (cp >= 0x200B && cp <= 0x200F) ||
+        (cp >= 0x20D0 && cp <= 0x20FF) || (cp >= 0xFE00 && cp <= 0xFE0F) ||
+        (cp >= 0xFE20 && cp <= 0xFE2F))
+        return 0;
+    if ((cp >= 0x1100 && cp <= 0x115F) || (cp >= 0x2E80 && cp <= 0xA4CF && cp != 0x303F) ||
+        (cp >= 0xAC00 && cp <= 0xD7A3) || (cp >= 0xF900 && cp <= 0xFAFF) ||
+        (cp >= 0xFE30 && cp <= 0xFE4F) || (cp >= 0xFF00 && cp <= 0xFF60) ||
+        (cp >= 0xFFE0 && cp <= 0xFFE6) || (cp >= 0x1F300 && cp <= 0x1F64F) ||
+        (cp >= 0x1F900 && cp <= 0x1F9FF) || (cp >= 0x20000 && cp <= 0x3FFFD))
+        return 2;
+    return 1;
+}
+
+static void append_utf8(std::string &out, uint32_t cp) {
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+// Box-drawing replacements for the DEC Special Graphics charset (ESC ( 0),
+// for 0x60-0x7E. Stored as Unicode so the redraw doesn't depend on charsets.
+static const uint16_t DEC_GRAPHICS[31] = {
+    0x25C6, 0x2592, 0x2409, 0x240C, 0x240D, 0x240A, 0x00B0, 0x00B1,
+    0x2424, 0x240B, 0x2518, 0x2510, 0x250C, 0x2514, 0x253C, 0x23BA,
+    0x23BB, 0x2500, 0x23BC, 0x23BD, 0x251C, 0x2524, 0x2534, 0x252C,
+    0x2502, 0x2264, 0x2265, 0x03C0, 0x2260, 0x00A3, 0x00B7,
+};
+
+// DEC private modes that are replayed verbatim on redraw when set
+static const int STICKY_MODES[] = {1, 12, 1000, 1002, 1003, 1004, 1005, 1006, 1015, 2004};
+static const int NUM_STICKY_MODES = sizeof(STICKY_MODES) / sizeof(STICKY_MODES[0]);
+
+// One screen buffer (main or alternate). Rows are a ring starting at base,
+// so scrolling the whole screen -- once per line of ordinary output -- moves
+// no cells.
+struct Grid {
+    std::vector<Cell> cells;
+    int cols, rows;
+    int base;              // index in cells of the top row
+    int cx, cy;            // cursor (0-based)
+    bool wrap_pending;     // cursor is past the last column (DECAWM)
+    int top, bottom;       // scroll region, inclusive
+    Pen pen;
+
+    struct Saved {         // DECSC/DECRC
+        int cx, cy;
+        Pen pen;
+        bool origin;
+        uint8_t g0, g1, gl;
+    } saved;
+
+    void init(int c, int r) {
+        cols = c;
+        rows = r;
+        Cell blank = blank_cell(Pen());
+        cells.assign((size_t)cols * rows, blank);
+        base = 0;
+        cx = cy = 0;
+        wrap_pending = false;
+        top = 0;
+        bottom = rows - 1;
+        pen = Pen();
+        saved.cx = saved.cy = 0;
+        saved.pen = Pen();
+        saved.origin = false;
+        saved.g0 = saved.g1 = 'B';
+        saved.gl = 0;
+    }
+
+    int slot(int y) const {
+        int r = y + base;
+        return r >= rows ? r - rows : r;
+    }
+    Cell *row(int y) { return &cells[(size_t)slot(y) * cols]; }
+    const Cell *row(int y) const { return &cells[(size_t)slot(y) * cols]; }
+
+    // Erased cells keep the current background (xterm "bce")
+    static Cell blank_cell(const Pen &p) {
+        Cell c;
+        c.cp = ' ';
+        c.flags = 0;
+        c.fg = 0;
+        c.bg = p.bg;
+        return c;
+    }
+
+    void clear_cells(int y, int x0, int x1) {  // [x0, x1) on row y
+        Cell b = blank_cell(pen);
+        Cell *r = row(y);
+        for (int x = std::max(0, x0); x < std::min(cols, x1); x++) r[x] = b;
+    }
+
+    void clear_rows(int y0, int y1) {  // [y0, y1)
+        for (int y = std::max(0, y0); y < std::min(rows, y1); y++) clear_cells(y, 0, cols);
+    }
+
+    // Scroll rows [t, b] up by n (content moves up, blank lines at bottom)
+    void scroll_up(int t, int b, int n) {
+        if (n <= 0 || t > b) return;
+        n = std::min(n, b - t + 1);
+        if (t == 0 && b == rows - 1) {
+            base = slot(n);
+        } else {
+            for (int y = t; y + n <= b; y++)
+                memcpy(row(y), row(y + n), sizeof(Cell) * cols);
+        }
+        clear_rows(b - n + 1, b + 1);
+    }
+
+    void scroll_down(int t, int b, int n) {
+        if (n <= 0 || t > b) return;
+        n = std::min(n, b - t + 1);
+        for (int y = b; y - n >= t; y--)
+            memcpy(row(y), row(y - n), sizeof(Cell) * cols);
+        clear_rows(t, t + n);
+    }
+
+    // Resize keeping the top-left content; rows are dropped from the top if
+    // the cursor would otherwise fall off the bottom.
+    void resize(int c, int r) {
+        int shift = std::max(0, cy - (r - 1));
+        std::vector<Cell> n((size_t)c * r, blank_cell(Pen()));
+        for (int y = 0; y < r && y + shift < rows; y++)
+            memcpy(&n[(size_t)y * c], row(y + shift), sizeof(Cell) * std::min(c, cols));
+        cells.swap(n);
+        base = 0;
+        cols = c;
+        rows = r;
+        cy -= shift;
+        cx = std::min(cx, cols - 1);
+        cy = std::min(cy, rows - 1);
+        wrap_pending = false;
+        top = 0;
+        bottom = rows - 1;
+        saved.cx = std::min(saved.cx, cols - 1);
+        saved.cy = std::min(saved.cy, rows - 1);
+    }
+};
+
+struct Screen {
+    static const bool wants_text = true;  // VtParser handler
+
+    Grid main, alt;
+    Grid *g;               // active grid
+    int cols, rows;
+    bool autowrap;         // DECAWM
+    bool origin;           // DECOM
+    bool insert;           // IRM
+    bool app_keypad;       // DECKPAM
+    bool cursor_hidden;
+    bool sticky[NUM_STICKY_MODES];
+    uint8_t g0, g1, gl;    // designated charsets ('B' ASCII, '0' graphics), GL
+    uint32_t last_cp;      // for REP
+    std::vector<bool> tabs;
+    uint32_t u_cp;         // pending UTF-8 sequence
+    int u_need;
+
+    void init(int c, int r) {
+        cols = std::max(1, c);
+        rows = std::max(1, r);
+        main.init(cols, rows);
+        alt.init(cols, rows);
+        g = &main;
+        autowrap = true;
+        origin = false;
+        insert = false;
+        app_keypad = false;
+        cursor_hidden = false;
+        for (int i = 0; i < NUM_STICKY_MODES; i++) sticky[i] = false;
+        g0 = g1 = 'B';
+        gl = 0;
+        last_cp = ' ';
+        reset_tabs();
+        u_cp = 0;
+        u_need = 0;
+    }
+
+    bool alt_active() const { return g == &alt; }
+
+    void resize(int c, int r) {
+        c = std::max(1, c);
+        r = std::max(1, r);
+        if (c == cols && r == rows) return;
+        main.resize(c, r);
+        alt.resize(c, r);
+        cols = c;
+        rows = r;
+        reset_tabs();
+    }
+
+    // ---- VtParser handler ----
+
+    void on_print(const uint8_t *p, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            uint8_t b = p[i];
+            if (u_need == 0 && b < 0x80) {
+                put_char(b);
+            } else if (b >= 0x80 && b < 0xC0) {
+                if (u_need == 0) { put_char(0xFFFD); continue; }
+                u_cp = (u_cp << 6) | (b & 0x3F);
+                if (--u_need == 0) put_char(u_cp);
+            } else {
+                if (u_need) put_char(0xFFFD);  // truncated sequence
+                if (b < 0x80) { u_need = 0; put_char(b); }
+                else if (b < 0xE0) { u_cp = b & 0x1F; u_need = 1; }
+                else if (b < 0xF0) { u_cp = b & 0x0F; u_need = 2; }
+                else if (b < 0xF8) { u_cp = b & 0x07; u_need = 3; }
+                else { u_need = 0; put_char(0xFFFD); }
+            }
+        }
+    }
+
+    void on_execute(uint8_t c) {
+        u_need = 0;
+        switch (c) {
+        case '\b':
+            if (g->cx > 0) g->cx--;
+            g->wrap_pending = false;
+            break;
+        case '\t': tab_forward(1); break;
+        case '\n': case 0x0B: case 0x0C: index(); break;
+        case '\r':
+            g->cx = 0;
+            g->wrap_pending = false;
+            break;
+        case 0x0E: gl = 1; break;  // SO
+        case 0x0F: gl = 0; break;  // SI
+        default: break;
+        }
+    }
+
+    void on_esc(const VtParser &vt, uint8_t f) {
+        if (vt.ninter == 1 && (vt.inter[0] == '(' || vt.inter[0] == ')')) {
+            uint8_t cs = (f == '0') ? '0' : 'B';
+            if (vt.inter[0] == '(') g0 = cs; else g1 = cs;
+            return;
+        }
+        if (vt.ninter) return;
+        switch (f) {
+        case '7': save_cursor(); break;
+        case '8': restore_cursor(); break;
+        case 'D': index(); break;
+        case 'E': index(); g->cx = 0; break;
+        case 'M': reverse_index(); break;
+        case 'H': if (g->cx < cols) tabs[g->cx] = true; break;
+        case '=': app_keypad = true; break;
+        case '>': app_keypad = false; break;
+        case 'c': init(cols, rows); break;  // RIS
+        default: break;
+        }
+    }
+
+    void on_csi(const VtParser &vt, uint8_t f) {
+        if (vt.priv == '?') {
+            if (vt.ninter == 0 && (f == 'h' || f == 'l'))
+                for (int i = 0; i < vt.nparams; i++) set_private_mode(vt.params[i], f == 'h');
+            return;
+        }
+        if (vt.ninter == 1 && vt.inter[0] == '!' && f == 'p') {  // DECSTR
+            soft_reset();
+            return;
+        }
+        if (vt.priv || vt.ninter) return;  // not tracked (DA, cursor style...)
+
+        Grid &s = *g;
+        int n = vt.param(0, 1);
+        switch (f) {
+        case '@': insert_chars(n); break;
+        case 'A': move_to(s.cx, std::max(s.cy - n, cursor_top())); break;
+        case 'B': case 'e': move_to(s.cx, std::min(s.cy + n, cursor_bottom())); break;
+        case 'C': case 'a': move_to(s.cx + n, s.cy); break;
+        case 'D': move_to(s.cx - n, s.cy); break;
+        case 'E': move_to(0, std::min(s.cy + n, cursor_bottom())); break;
+        case 'F': move_to(0, std::max(s.cy - n, cursor_top())); break;
+        case 'G': case '`': move_to(n - 1, s.cy); break;
+        case 'H': case 'f': move_origin(vt.param(1, 1) - 1, n - 1); break;
+        case 'I': tab_forward(n); break;
+        case 'Z': tab_backward(n); break;
+        case 'J': erase_display(vt.param(0, 0)); break;
+        case 'K': erase_line(vt.param(0, 0)); break;
+        case 'L': insert_lines(n); break;
+        case 'M': delete_lines(n); break;
+        case 'P': delete_chars(n); break;
+        case 'S': s.scroll_up(s.top, s.bottom, n); break;
+        case 'T': s.scroll_down(s.top, s.bottom, n); break;
+        case 'X': s.clear_cells(s.cy, s.cx, s.cx + n); s.wrap_pending = false; break;
+        case 'b': for (int i = 0; i < std::min(n, 65535); i++) put_char(last_cp); break;
+        case 'd': move_origin(s.cx, n - 1); break;
+        case 'g':
+            if (vt.param(0, 0) == 3) tabs.assign(cols, false);
+            else if (s.cx < cols) tabs[s.cx] = false;
+            break;
+        case 'h': case 'l':
+            for (int i = 0; i < vt.nparams; i++)
+                if (vt.params[i] == 4) insert = (f == 'h');
+            break;
+        case 'm': sgr(vt); break;
+        case 'r': {
+            int t = vt.param(0, 1) - 1;
+            int b = vt.param(1, rows) - 1;
+            if (t < b && b < rows) {
+                s.top = t;
+                s.bottom = b;
+                move_origin(0, 0);
+            }
+            break;
+        }
+        case 's': save_cursor(); break;
+        case 'u': restore_cursor(); break;
+        default: break;
+        }
+    }
+
+    void on_modes(const VtParser &, const VtModes &, size_t, size_t, bool) {}
+
+    // ---- Redraw ----
+
+    // Append escape sequences that repaint this screen state onto a terminal
+    // in any state: the main screen, and on top of it the alternate screen if
+    // one is active, then cursor, rendition and modes.
+    void render(std::string &out) const {
+        out += "\033[?1049l\033[!p\033[?7l";  // main screen, soft reset, no wrap
+        render_grid(out, main);
+        if (alt_active()) {
+            // The terminal saves the main cursor on entering the alt screen
+            place_cursor(out, main);
+            out += "\033[?1049h";
+            render_grid(out, alt);
+        }
+        const Grid &s = *g;
+        if (s.top != 0 || s.bottom != rows - 1) {
+            char b[32];
+            snprintf(b, sizeof(b), "\033[%d;%dr", s.top + 1, s.bottom + 1);
+            out += b;
+        }
+        if (origin) out += "\033[?6h";
+        place_cursor(out, s);
+        append_sgr(out, s.pen);
+        if (autowrap) out += "\033[?7h";
+        if (insert) out += "\033[4h";
+        if (app_keypad) out += "\033=";
+        if (g0 == '0') out += "\033(0";
+        if (g1 == '0') out += "\033)0";
+        if (gl == 1) out += '\016';
+        for (int i = 0; i < NUM_STICKY_MODES; i++) {
+            if (!sticky[i]) continue;
+            char b[16];
+            snprintf(b, sizeof(b), "\033[?%dh", STICKY_MODES[i]);
+            out += b;
+        }
+        out += cursor_hidden ? "\033[?25l" : "\033[?25h";
+    }
+
+    // Repaint cells [x0, x1) of row y of the active screen, then put the
+    // cursor and rendition back: undoes whatever was drawn there behind the
+    // model's back (predicted echo, see LocalEcho). Assumes DECOM is off.
+    void repaint(std::string &out, int y, int x0, int x1) const {
+        const Grid &s = *g;
+        const Cell *r = s.row(y);
+        while (x0 > 0 && (r[x0].flags & CELL_WIDE_CONT)) x0--;
+        char b[32];
+        snprintf(b, sizeof(b), "\033[%d;%dH", y + 1, x0 + 1);
+        out += b;
+        Pen cur;
+        for (int x = x0; x < std::min(x1, s.cols); x++) {
+            if (r[x].flags & CELL_WIDE_CONT) continue;
+            Pen p;
+            p.flags = r[x].flags & ATTR_MASK;
+            p.fg = r[x].fg;
+            p.bg = r[x].bg;
+            if (x == x0 || p != cur) {
+                append_sgr(out, p);
+                cur = p;
+            }
+            append_utf8(out, r[x].cp);
+        }
+        place_cursor(out, s);
+        append_sgr(out, s.pen);
+    }
+
+    // The current rendition, to restore after drawing behind the model's back
+    void restore_pen(std::string &out) const { append_sgr(out, g->pen); }
+
+private:
+    void reset_tabs() {
+        tabs.assign(cols, false);
+        for (int x = 0; x < cols; x += 8) tabs[x] = true;
+    }
+
+    int cursor_top() const { return (g->cy >= g->top) ? g->top : 0; }
+    int cursor_bottom() const { return (g->cy <= g->bottom) ? g->bottom : rows - 1; }
+
+    void move_to(int x, int y) {
+        g->cx = std::max(0, std::min(x, cols - 1));
+        g->cy = std::max(0, std::min(y, rows - 1));
+        g->wrap_pending = false;
+    }
+
+    // Absolute position, relative to the scroll region in origin mode
+    void move_origin(int x, int y) {
+        if (origin) move_to(x, std::min(y + g->top, g->bottom));
+        else move_to(x, y);
+    }
+
+    void index() {
+        Grid &s = *g;
+        s.wrap_pending = false;
+        if (s.cy == s.bottom) s.scroll_up(s.top, s.bottom, 1);
+        else if (s.cy < rows - 1) s.cy++;
+    }
+
+    void reverse_index() {
+        Grid &s = *g;
+        s.wrap_pending = false;
+        if (s.cy == s.top) s.scroll_down(s.top, s.bottom, 1);
+        else if (s.cy > 0) s.cy--;
+    }
+
+    void tab_forward(int n) {
+        Grid &s = *g;
+        while (n-- > 0) {
+            int x = s.cx + 1;
+            while (x < cols && !tabs[x]) x++;
+            s.cx = std::min(x, cols - 1);
+        }
+        s.wrap_pending = false;
+    }
+
+    void tab_backward(int n) {
+        Grid &s = *g;
+        while (n-- > 0 && s.cx > 0) {
+            int x = s.cx - 1;
+            while (x > 0 && !tabs[x]) x--;
+            s.cx = x;
+        }
+        s.wrap_pending = false;
+    }
+
+    void put_char(uint32_t cp) {
+        Grid &s = *g;
+        if (cp >= 0x60 && cp <= 0x7E && (gl ? g1 : g0) == '0')
+            cp = DEC_GRAPHICS[cp - 0x60];
+        int w = char_width(cp);
+        if (w == 0) return;  // combining marks are not modelled
+        last_cp = cp;
+        if (s.wrap_pending && autowrap) {
+            s.cx = 0;
+            index();
+        }
+        s.wrap_pending = false;
+        if (w == 2 && s.cx == cols - 1) {
+            // No room for a wide char: wrap (or stay) like xterm
+            if (!autowrap) return;
+            s.clear_cells(s.cy, s.cx, cols);
+            s.cx = 0;
+            index();
+        }
+        if (insert) insert_chars(w);
+        Cell *r = s.row(s.cy);
+        fix_wide_pair(r, s.cx);
+        if (w == 2) fix_wide_pair(r, s.cx + 1);
+        r[s.cx].cp = cp;
+        r[s.cx].flags = s.pen.flags | (w == 2 ? CELL_WIDE : 0);
+        r[s.cx].fg = s.pen.fg;
+        r[s.cx].bg = s.pen.bg;
+        if (w == 2) {
+            r[s.cx + 1].cp = ' ';
+            r[s.cx + 1].flags = s.pen.flags | CELL_WIDE_CONT;
+            r[s.cx + 1].fg = s.pen.fg;
+            r[s.cx + 1].bg = s.pen.bg;
+        }
+        if (s.cx + w >= cols) {
+            s.cx = cols - 1;
+            s.wrap_pending = true;
+        } else {
+            s.cx += w;
+        }
+    }
+
+    // Overwriting half of a wide character blanks the other half
+    void fix_wide_pair(Cell *r, int x) {
+        if (x >= cols) return;
+        if ((r[x].flags & CELL_WIDE) && x + 1 < cols) {
+            r[x + 1].cp = ' ';
+            r[x + 1].flags &= ~CELL_WIDE_CONT;
+        }
+        if ((r[x].flags & CELL_WIDE_CONT) && x > 0) {
+            r[x - 1].cp = ' ';
+            r[x - 1].flags &= ~CELL_WIDE;
+        }
+        r[x].flags &= ~(CELL_WIDE | CELL_WIDE_CONT);
+    }
+
+    void insert_chars(int n) {
+        Grid &s = *g;
+        n = std::min(n, cols - s.cx);
+        Cell *r = s.row(s.cy);
+        memmove(r + s.cx + n, r + s.cx, sizeof(Cell) * (cols - s.cx - n));
+        s.clear_cells(s.cy, s.cx, s.cx + n);
+        s.wrap_pending = false;
+    }
+
+    void delete_chars(int n) {
+        Grid &s = *g;
+        n = std::min(n, cols - s.cx);
+        Cell *r = s.row(s.cy);
+        memmove(r + s.cx, r + s.cx + n, sizeof(Cell) * (cols - s.cx - n));
+        s.clear_cells(s.cy, cols - n, cols);
+        s.wrap_pending = false;
+    }
+
+    void insert_lines(int n) {
+        Grid &s = *g;
+        if (s.cy < s.top || s.cy > s.bottom) return;
+        s.scroll_down(s.cy, s.bottom, n);
+        s.cx = 0;
+        s.wrap_pending = false;
+    }
+
+    void delete_lines(int n) {
+        Grid &s = *g;
+        if (s.cy < s.top || s.cy > s.bottom) return;
+        s.scroll_up(s.cy, s.bottom, n);
+        s.cx = 0;
+        s.wrap_pending = false;
+    }
+
+    void erase_display(int mode) {
+        Grid &s = *g;
+        switch (mode) {
+        case 0:
+            s.clear_cells(s.cy, s.cx, cols);
+            s.clear_rows(s.cy + 1, rows);
+            break;
+        case 1:
+            s.clear_rows(0, s.cy);
+            s.clear_cells(s.cy, 0, s.cx + 1);
+            break;
+        case 2: case 3:
+            s.clear_rows(0, rows);
+            break;
+        default: break;
+        }
+        s.wrap_pending = false;
+    }
+
+    void erase_line(int mode) {
+        Grid &s = *g;
+        if (mode == 0) s.clear_cells(s.cy, s.cx, cols);
+        else if (mode == 1) s.clear_cells(s.cy, 0, s.cx + 1);
+        else if (mode == 2) s.clear_cells(s.cy, 0, cols);
+        s.wrap_pending = false;
+    }
+
+    void save_cursor() {
+        Grid::Saved &sv = g->saved;
+        sv.cx = g->cx;
+        sv.cy = g->cy;
+        sv.pen = g->pen;
+        sv.origin = origin;
+        sv.g0 = g0;
+        sv.g1 = g1;
+        sv.gl = gl;
+    }
+
+    void restore_cursor() {
+        const Grid::Saved &sv = g->saved;
+        origin = sv.origin;
+        g->pen = sv.pen;
+        g0 = sv.g0;
+        g1 = sv.g1;
+        gl = sv.gl;
+        move_to(sv.cx, sv.cy);
+    }
+
+    void soft_reset() {
+        autowrap = true;
+        origin = false;
+        insert = false;
+        app_keypad = false;
+        cursor_hidden = false;
+        g0 = g1 = 'B';
+        gl = 0;
+        g->pen = Pen();
+        g->top = 0;
+        g->bottom = rows - 1;
+        g->saved.cx = g->saved.cy = 0;
+    }
+
+    void set_private_mode(int mode, bool on) {
+        switch (mode) {
+        case 6: origin = on; move_origin(0, 0); break;
+        case 7: autowrap = on; if (!on) g->wrap_pending = false; break;
+        case 25: cursor_hidden = !on; break;
+        case 47: case 1047: case 1049:
+            if (on == alt_active()) break;
+            if (on) {
+                if (mode == 1049) save_cursor();
+                alt.cx = main.cx;
+                alt.cy = main.cy;
+                alt.pen = main.pen;
+                g = &alt;
+                if (mode != 47) alt.clear_rows(0, rows);
+            } else {
+                if (mode == 1047) alt.clear_rows(0, rows);
+                main.pen = alt.pen;
+                g = &main;
+                if (mode == 1049) restore_cursor();
+            }
+            break;
+        default:
+            for (int i = 0; i < NUM_STICKY_MODES; i++)
+                if (STICKY_MODES[i] == mode) sticky[i] = on;
+            break;
+        }
+    }
+
+    // Colour after 38/48: ;5;n or ;2;r;g;b. Returns params consumed.
+    static int sgr_color(const VtParser &vt, int i, uint32_t *out) {
+        if (i + 1 >= vt.nparams) return 0;
+        if (vt.params[i + 1] == 5 && i + 2 < vt.nparams) {
+            *out = COLOR_INDEXED | (vt.params[i + 2] & 0xFF);
+            return 2;
+        }
+        if (vt.params[i + 1] == 2 && i + 4 < vt.nparams) {
+            *out = COLOR_RGB | ((vt.params[i + 2] & 0xFF) << 16) |
+                   ((vt.params[i + 3] & 0xFF) << 8) | (vt.params[i + 4] & 0xFF);
+            return 4;
+        }
+        return 1;
+    }
+
+    void sgr(const VtParser &vt) {
+        Pen &p = g->pen;
+        if (vt.nparams == 0) { p = Pen(); return; }
+        for (int i = 0; i < vt.nparams; i++) {
+            int a = vt.params[i];
+            switch (a) {
+            case 0: p = Pen(); break;
+            case 1: p.flags |= ATTR_BOLD; break;
+            case 2: p.flags |= ATTR_DIM; break;
+            case 3: p.flags |= ATTR_ITALIC; break;
+            case 4: p.flags |= ATTR_UNDERLINE; break;
+            case 5: p.flags |= ATTR_BLINK; break;
+            case 7: p.flags |= ATTR_INVERSE; break;
+            case 8: p.flags |= ATTR_HIDDEN; break;
+            case 9: p.flags |= ATTR_STRIKE; break;
+            case 21: case 22: p.flags &= ~(ATTR_BOLD | ATTR_DIM); break;
+            case 23: p.flags &= ~ATTR_ITALIC; break;
+            case 24: p.flags &= ~ATTR_UNDERLINE; break;
+            case 25: p.flags &= ~ATTR_BLINK; break;
+            case 27: p.flags &= ~ATTR_INVERSE; break;
+            case 28: p.flags &= ~ATTR_HIDDEN; break;
+            case 29: p.flags &= ~ATTR_STRIKE; break;
+            case 38: i += sgr_color(vt, i, &p.fg); break;
+            case 39: p.fg = 0; break;
+            case 48: i += sgr_color(vt, i, &p.bg); break;
+            case 49: p.bg = 0; break;
+            default:
+                if (a >= 30 && a <= 37) p.fg = COLOR_INDEXED | (a - 30);
+                else if (a >= 40 && a <= 47) p.bg = COLOR_INDEXED | (a - 40);
+                else if (a >= 90 && a <= 97) p.fg = COLOR_INDEXED | (a - 90 + 8);
+                else if (a >= 100 && a <= 107) p.bg = COLOR_INDEXED | (a - 100 + 8);
+                break;
+            }
+        }
+    }
+
+    static void append_color(std::string &out, uint32_t c, int base) {
+        char b[32];
+        uint32_t v = c & 0xFFFFFF;
+        if ((c & ~0xFFFFFFu) == COLOR_RGB)
+            snprintf(b, sizeof(b), ";%d;2;%u;%u;%u", base + 8, v >> 16, (v >> 8) & 0xFF, v & 0xFF);
+        else if (v < 8)
+            snprintf(b, sizeof(b), ";%u", base + v);
+        else if (v < 16)
+            snprintf(b, sizeof(b), ";%u", base + 60 + v - 8);
+        else
+            snprintf(b, sizeof(b), ";%d;5;%u", base + 8, v);
+        out += b;
+    }
+
+    static void append_sgr(std::string &out, const Pen &p) {
+        static const char *codes[8] = {";1", ";2", ";3", ";4", ";5", ";7", ";8", ";9"};
+        out += "\033[0";
+        for (int i = 0; i < 8; i++)
+            if (p.flags & (1 << i)) out += codes[i];
+        if (p.fg) append_color(out, p.fg, 30);
+        if (p.bg) append_color(out, p.bg, 40);
+        out += 'm';
+    }
+
+    static void place_cursor(std::string &out, const Grid &s) {
+        char b[32];
+        snprintf(b, sizeof(b), "\033[%d;%dH", s.cy + 1, s.cx + 1);
+        out += b;
+    }
+
+    // Clear, then paint each row up to its last non-blank cell. Autowrap is
+    // off while painting, so writing the last column never scrolls.
+    static void render_grid(std::string &out, const Grid &s) {
+        out += "\033[0m\033[H\033[2J";
+        Pen cur;
+        for (int y = 0; y < s.rows; y++) {
+            const Cell *r = s.row(y);
+            int end = s.cols;
+            while (end > 0 && r[end - 1].cp == ' ' && r[end - 1].bg == 0 &&
+                   (r[end - 1].flags & (ATTR_INVERSE | ATTR_UNDERLINE | ATTR_STRIKE)) == 0)
+                end--;
+            if (end == 0) continue;
+            char b[32];
+            snprintf(b, sizeof(b), "\033[%dH", y + 1);
+            out += b;
+            for (int x = 0; x < end; x++) {
+                if (r[x].flags & CELL_WIDE_CONT) continue;
+                Pen p;
+                p.flags = r[x].flags & ATTR_MASK;
+                p.fg = r[x].fg;
+                p.bg = r[x].bg;
+                if (p != cur) {
+                    append_sgr(out, p);
+                    cur = p;
+                }
+                append_utf8(out, r[x].cp);
+            }
+        }
+        out += "\033[0m";
+    }
+};
+
+// ============================================================================
+// 7. Server: PTY, daemon fork, poll() event loop, multi-client broadcast
+// ============================================================================
+
+// Event backend: epoll on Linux, kqueue on macOS/BSD, poll() elsewhere (or
+// with -DGHOSTLY_USE_POLL). Interest is registered once per fd and kept by
+// the kernel; level-triggered, so an fd that still has data reports again.
+// Each fd carries a caller-chosen token that comes back with its events.
+// Every backend has the same interface; EventLoop is the one this platform
+// gets, picked at compile time, so the loop calls it directly.
+struct EventBuffer {
+    struct Event {
+        int token;
+        bool readable;  // also set on hangup/error, so the read sees it
+        bool writable;
+    };
+    static const int MAX_EVENTS = 64;
+
+    Event events[MAX_EVENTS];
+};
+
+#if defined(GHOSTLY_EPOLL)
+struct EpollBackend : EventBuffer {
+    int epfd;
+
+    bool init() {
+        epfd = epoll_create(MAX_EVENTS);  // size is only a hint
+        if (epfd >= 0) fcntl(epfd, F_SETFD, FD_CLOEXEC);
+        return epfd >= 0;
+    }
+    void destroy() {
+        if (epfd >= 0) close(epfd);
+        epfd = -1;
+    }
+    bool add(int fd, int token, bool want_write) { return ctl(EPOLL_CTL_ADD, fd, token, want_write); }
+    bool modify(int fd, int token, bool want_write) { return ctl(EPOLL_CTL_MOD, fd, token, want_write); }
+    void remove(int fd) {
+        struct epoll_event ev;  // non-NULL for kernels before 2.6.9
+        memset(&ev, 0, sizeof(ev));
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+    }
+
+    // Wait up to timeout_ms (-1 = forever). Returns the number of entries in
+    // events[], or -1 on error (EINTR included).
+    int wait(int timeout_ms) {
+        struct epoll_event evs[MAX_EVENTS];
+        int n = epoll_wait(epfd, evs, MAX_EVENTS, timeout_ms);
+        for (int i = 0; i < n; i++) {
+            events[i].token = (int)evs[i].data.u32;
+            events[i].readable = (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+            events[i].writable = (evs[i].events & EPOLLOUT) != 0;
+        }
+        return n;
+    }
+
+private:
+    bool ctl(int op, int fd, int token, bool want_write) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = want_write ? (uint32_t)(EPOLLIN | EPOLLOUT) : (uint32_t)EPOLLIN;
+        ev.data.u32 = (uint32_t)token;
+        return epoll_ctl(epfd, op, fd, &ev) == 0;
+    }
+};
+typedef EpollBackend EventLoop;
+
+#elif defined(GHOSTLY_KQUEUE)
+struct KqueueBackend : EventBuffer {
+    int kq;
+
+    bool init() {
+        kq = kqueue();
+        if (kq >= 0) fcntl(kq, F_SETFD, FD_CLOEXEC);
+        return kq >= 0;
+    }
+    void destroy() {
+        if (kq >= 0) close(kq);
+        kq = -1;
+    }
+    bool add(int fd, int token, bool want_write) {
+        struct kevent ch[2];
+        EV_SET(&ch[0], fd, EVFILT_READ, EV_ADD, 0, 0, token_ptr(token));
+        EV_SET(&ch[1], fd, EVFILT_WRITE, EV_ADD | (want_write ? EV_ENABLE : EV_DISABLE),
+               0, 0, token_ptr(token));
+        return kevent(kq, ch, 2, NULL, 0, NULL) == 0;
+    }
+    bool modify(int fd, int token, bool want_write) {
+        struct kevent ch;
+        EV_SET(&ch, fd, EVFILT_WRITE, want_write ? EV_ENABLE : EV_DISABLE, 0, 0, token_ptr(token));
+        return kevent(kq, &ch, 1, NULL, 0, NULL) == 0;
+    }
+    void remove(int fd) {
+        struct kevent ch[2];
+        EV_SET(&ch[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+        EV_SET(&ch[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+        kevent(kq, ch, 2, NULL, 0, NULL);
+    }
+
+    int wait(int timeout_ms) {
+        struct kevent evs[MAX_EVENTS];
+        struct timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+        int n = kevent(kq, NULL, 0, evs, MAX_EVENTS, timeout_ms < 0 ? NULL : &ts);
+        // One kevent per filter; a read and a write for the same fd arrive
+        // as two entries, which callers handle independently.
+        for (int i = 0; i < n; i++) {
+            events[i].token = (int)(intptr_t)evs[i].udata;
+            events[i].readable = evs[i].filter == EVFILT_READ;
+            events[i].writable = evs[i].filter == EVFILT_WRITE;
+        }
+        return n;
+    }
+
+private:
+    static void *token_ptr(int token) { return (void *)(intptr_t)token; }
+};
+typedef KqueueBackend EventLoop;
+
+#else
+struct PollBackend : EventBuffer {
+    std::vector<struct pollfd> fds;  // persistent poll set
+    std::vector<int> tokens;         // parallel to fds
+
+    bool init() { return true; }
+    void destroy() {
+        fds.clear();
+        tokens.clear();
+    }
+    bool add(int fd, int token, bool want_write) {
+        struct pollfd p;
+        p.fd = fd;
+        p.events = POLLIN | (want_write ? POLLOUT : 0);
+        p.revents = 0;
+        fds.push_back(p);
+        tokens.push_back(token);
+        return true;
+    }
+    bool modify(int fd, int token, bool want_write) {
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (fds[i].fd != fd) continue;
+            fds[i].events = POLLIN | (want_write ? POLLOUT : 0);
+            tokens[i] = token;
+            return true;
+        }
+        return false;
+    }
+    void remove(int fd) {
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (fds[i].fd != fd) continue;
+            fds[i] = fds.back();
+            tokens[i] = tokens.back();
+            fds.pop_back();
+            tokens.pop_back();
+            return;
+        }
+    }
+
+    int wait(int timeout_ms) {
+        int r = poll(fds.data(), fds.size(), timeout_ms);
+        if (r <= 0) return r;
+        int n = 0;
+        for (size_t i = 0; i < fds.size() && n < MAX_EVENTS; i++) {
+            short re = fds[i].revents;
+            if (!re) continue;
+            events[n].token = tokens[i];
+            events[n].readable = (re & (POLLIN | POLLHUP | POLLERR)) != 0;
+            events[n].writable = (re & POLLOUT) != 0;
+            n++;
+        }
+        return n;
+    }
+};
+typedef PollBackend EventLoop;
+#endif
+
+// Wait for a file's data to reach the disk
+static void sync_data(int fd) {
+#ifdef __APPLE__
+    fsync(fd);
+#else
+    fdatasync(fd);
+#endif
+}
+
+// Session journal (create --journal): the scrollback's input, appended to
+// files in <socket dir>/<name>.journal/ that outlive the daemon, for `log`.
+// Output goes to numbered segments (a new one per session, and after each
+// JOURNAL_SEGMENT_SIZE); index gets a "time segment offset" line for the
+// first output of every second. append() only buffers; the event loop
+// writes out (see write_due()) once JOURNAL_BUFFER fills, a segment is full,
+// or JOURNAL_FLUSH_MS after the first buffered byte, so a PTY read never
+// waits on the disk. Writeback is only started, not waited for (Linux),
+// also for a finished segment; the last one is fdatasync'd on close.
+// A daemon that is killed loses at most the last JOURNAL_FLUSH_MS.
+struct Journal {
+    std::string dir;
+    int fd;             // current segment, -1 = not journaling
+    int index_fd;
+    uint32_t seg;       // current segment number
+    uint64_t seg_size;  // including what is still buffered
+    std::string buf;    // segment bytes not written yet
+    std::string ibuf;   // index lines not written yet
+    int64_t flush_at;   // ms, 0 = nothing buffered
+    time_t indexed_at;  // second of the last index line
+
+    Journal() : fd(-1), index_fd(-1), seg(0), seg_size(0), flush_at(0), indexed_at(0) {}
+
+    static std::string segment_path(const std::string &dir, uint32_t n) {
+        char b[32];
+        snprintf(b, sizeof(b), "/%08u.log", n);
+        return dir + b;
+    }
+
+    // Segment numbers in dir, oldest first
+    static std::vector<uint32_t> segments(const std::string &dir) {
+        std::vector<uint32_t> list;
+        DIR *d = opendir(dir.c_str());
+        if (!d) return list;
+        struct dirent *ent;
+        while ((ent = readdir(d)) != NULL) {
+            unsigned n;
+            char tail[8];
+            if (sscanf(ent->d_name, "%8u.%7s", &n, tail) == 2 && strcmp(tail, "log") == 0)
+                list.push_back(n);
+        }
+        closedir(d);
+        std::sort(list.begin(), list.end());
+        return list;
+    }
+
+    // Start a new segment after any kept from earlier sessions
+    bool open(const std::string &d) {
+        dir = d;
+        if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) return false;
+        std::vector<uint32_t> old = segments(dir);
+        index_fd = ::open((dir + "/index").c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+        if (index_fd < 0) return false;
+        set_cloexec(index_fd);
+        if (!open_segment(old.empty() ? 1 : old.back() + 1)) {
+            ::close(index_fd);
+            index_fd = -1;
+            return false;
+        }
+        return true;
+    }
+
+    void append(const uint8_t *p, size_t n) {
+        if (fd < 0 || n == 0) return;
+        time_t now = time(NULL);
+        if (now != indexed_at) {
+            char line[64];
+            snprintf(line, sizeof(line), "%ld %u %llu\n", (long)now, seg, (unsigned long long)seg_size);
+            ibuf += line;
+            indexed_at = now;
+        }
+        buf.append((const char *)p, n);
+        seg_size += n;
+        if (!flush_at) flush_at = now_ms() + JOURNAL_FLUSH_MS;
+        // Due right away: the loop gets to it before it next waits
+        if (buf.size() >= JOURNAL_BUFFER || seg_size >= JOURNAL_SEGMENT_SIZE) flush_at = now_ms();
+    }
+
+    // From the event loop once flush_at is due: write out what is buffered,
+    // and move on to a new segment if this one is full
+    void write_due() {
+        flush();
+        if (fd < 0 || seg_size < JOURNAL_SEGMENT_SIZE) return;
+        // flush() has started its writeback
+        ::close(fd);
+        fd = -1;
+        if (open_segment(seg + 1)) prune();
+    }
+
+    // Write out what is buffered. A write error ends journaling.
+    void flush() {
+        flush_at = 0;
+        if (fd < 0) return;
+        bool ok = write_all(fd, buf.data(), buf.size()) && write_all(index_fd, ibuf.data(), ibuf.size());
+        buf.clear();
+        ibuf.clear();
+        if (!ok) {
+            close();
+            return;
+        }
+#ifdef SYNC_FILE_RANGE_WRITE
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+    }
+
+    void close() {
+        if (fd >= 0) {
+            flush();
+            if (fd >= 0) {
+                sync_data(fd);
+                ::close(fd);
+            }
+        }
+        fd = -1;
+        if (index_fd >= 0) ::close(index_fd);
+        index_fd = -1;
+        buf.clear();
+        ibuf.clear();
+        flush_at = 0;
+    }
+
+private:
+    bool open_segment(uint32_t n) {
+        fd = ::open(segment_path(dir, n).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        seg = n;
+        seg_size = 0;
+        indexed_at = 0;
+        if (fd < 0) return false;
+        set_cloexec(fd);
+        return true;
+    }
+
+    // Keep the newest JOURNAL_MAX_SEGMENTS, and the index lines for them
+    void prune() {
+        std::vector<uint32_t> list = segments(dir);
+        if (list.size() <= (size_t)JOURNAL_MAX_SEGMENTS) return;
+        size_t drop = list.size() - JOURNAL_MAX_SEGMENTS;
+        for (size_t i = 0; i < drop; i++) unlink(segment_path(dir, list[i]).c_str());
+        uint32_t oldest = list[drop];
+
+        std::string path = dir + "/index", tmp = path + ".tmp";
+        FILE *in = fopen(path.c_str(), "r");
+        FILE *out = fopen(tmp.c_str(), "w");
+        if (in && out) {
+            char line[128];
+            long t;
+            unsigned n;
+            unsigned long long off;
+            while (fgets(line, sizeof(line), in))
+                if (sscanf(line, "%ld %u %llu", &t, &n, &off) == 3 && n >= oldest) fputs(line, out);
+        }
+        if (in) fclose(in);
+        if (out && fclose(out) == 0 && in && rename(tmp.c_str(), path.c_str()) == 0) {
+            ::close(index_fd);
+            index_fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+            if (index_fd < 0) close();
+            else set_cloexec(index_fd);
+        } else {
+            unlink(tmp.c_str());
+        }
+    }
+};
+
+// Scrollback ring buffer: stores recent PTY output for replay on reattach.
+// Small rings live on the heap and grow by doubling up to their configured
+// size. Rings above SCROLLBACK_MMAP_THRESHOLD are a sparse file mapping that
+// is unlinked right away; spans nobody is reading are handed back to the
+// kernel, so an idle session's scrollback costs page cache, not RSS.
+struct ScrollbackBuffer {
+    uint8_t *data;
+    size_t cap;      // current ring size (power of two)
+    size_t max_cap;  // configured size (power of two)
+    size_t head;     // next write position
+    size_t count;    // bytes stored (up to cap)
+    uint64_t stored; // bytes ever stored: the ring holds [stored - count, stored)
+    bool mapped;     // data is a file mapping of max_cap bytes
+    std::string held; // incomplete escape sequence at the end of the last read
+    // Stream offsets (bytes of PTY output since the session started): the
+    // newest stored byte ends at end_pos, and from verbatim_from on the ring
+    // plus held is an exact copy of the stream, nothing left out
+    uint64_t end_pos;
+    uint64_t verbatim_from;
+    Journal *journal;  // also gets everything stored, if journaling
+
+    // Allocate storage for up to size bytes. map_path names the backing file
+    // for large rings; falls back to the heap if the mapping fails.
+    void init(size_t size, const std::string &map_path) {
+        data = NULL;
+        cap = 0;
+        max_cap = size;
+        mapped = false;
+        journal = NULL;
+        reset();
+        if (size > SCROLLBACK_MMAP_THRESHOLD && map_file(map_path)) return;
+        cap = std::min(max_cap, SCROLLBACK_INITIAL);
+        data = (uint8_t *)malloc(cap);
+    }
+
+    void destroy() {
+        if (mapped) munmap(data, max_cap);
+        else free(data);
+        data = NULL;
+        cap = 0;
+    }
+
+    void reset() {
+        head = 0;
+        count = 0;
+        stored = 0;
+        held.clear();
+        end_pos = 0;
+        verbatim_from = 0;
+    }
+
+    // Copies in at most two memcpy segments (up to the end of the ring, then
+    // from the start). Only the last max_cap bytes of buf can survive.
+    void append(const uint8_t *buf, size_t len) {
+        if (journal) journal->append(buf, len);
+        if (len == 0 || !data) return;
+        stored += len;
+        if (count + len > cap && cap < max_cap) grow(count + len);
+        if (len > cap) {
+            buf += len - cap;
+            len = cap;
+        }
+        size_t old_head = head;
+        size_t first = std::min(len, cap - head);
+        memcpy(data + head, buf, first);
+        if (len > first) memcpy(data, buf + first, len - first);
+        head = (head + len) & (cap - 1);
+        count = std::min(count + len, cap);
+        // Release written-out spans whenever head moves into a new one
+        if (mapped && (old_head / SCROLLBACK_SPAN != head / SCROLLBACK_SPAN || len > first))
+            release_cold();
+    }
+
+    // Oldest byte still stored, as an offset like stored
+    uint64_t oldest() const { return stored - count; }
+
+    // Stored bytes [from, from + len) as up to two contiguous ring segments;
+    // they must all still be stored. Returns the number of segments filled.
+    int segments(uint64_t from, size_t len, struct iovec seg[2]) const {
+        size_t start = (head - (size_t)(stored - from)) & (cap - 1);
+        size_t first = std::min(len, cap - start);
+        seg[0].iov_base = (void *)(data + start);
+        seg[0].iov_len = first;
+        if (len == first) return len > 0 ? 1 : 0;
+        seg[1].iov_base = (void *)data;
+        seg[1].iov_len = len - first;
+        return 2;
+    }
+
+    // Drop every span except the one being written from memory. The data
+    // stays in the (unlinked) file and is faulted back in on replay.
+    void release_cold() {
+#ifdef MADV_DONTNEED
+        if (!mapped) return;
+        size_t span = head & ~(SCROLLBACK_SPAN - 1);
+        if (span > 0) madvise(data, span, MADV_DONTNEED);
+        size_t after = span + SCROLLBACK_SPAN;
+        if (after < max_cap) madvise(data + after, max_cap - after, MADV_DONTNEED);
+#endif
+    }
+
+    // Stores main-screen output from one PTY read, driven by the parser's
+    // mode changes (see OutputTap). Output produced while a TUI app has the
+    // alternate screen is not stored, nor are the sequences that switch
+    // screens. A short sequence cut off at the end of a read is held back
+    // until it completes, so half a switch sequence never lands in the ring.
+    struct Recorder {
+        ScrollbackBuffer &sb;
+        const uint8_t *buf;
+        uint64_t base;     // stream offset of buf[0]
+        size_t seg_start;  // start of the main-screen span being collected
+
+        Recorder(ScrollbackBuffer &s, const uint8_t *b, uint64_t at)
+            : sb(s), buf(b), base(at), seg_start(0) {}
+
+        void on_modes(const VtParser &vt, const VtModes &old,
+                      size_t begin, size_t end, bool begin_before) {
+            if (vt.modes.alt_screen == old.alt_screen) return;
+            sb.verbatim_from = base + end;  // some of what came before is left out
+            if (vt.modes.alt_screen) {
+                // Entering: store main-screen output up to the switch sequence
+                if (begin_before) {
+                    sb.held.clear();
+                } else {
+                    sb.flush_held();
+                    sb.append(buf + seg_start, begin - seg_start);
+                }
+            }
+            seg_start = end;  // the switch sequence itself is never stored
+        }
+
+        // Called after the whole read has been fed to vt
+        void finish(const VtParser &vt, size_t len) {
+            if (vt.modes.alt_screen) {
+                sb.held.clear();
+                sb.end_pos = sb.verbatim_from = base + len;
+                return;
+            }
+            // Hold back a short, unfinished ESC/CSI sequence (not OSC/DCS
+            // strings, which can be long and never switch screens)
+            bool hold = vt.state >= VtParser::ESCAPE && vt.state <= VtParser::CSI_IGNORE;
+            size_t stop = len;
+            if (hold && vt.seq_before) {
+                // This whole read continues the already held sequence
+                if (sb.held.size() + len <= MAX_HELD) {
+                    sb.held.append((const char *)buf, len);
+                    sb.end_pos = base + len - sb.held.size();
+                    return;
+                }
+            } else if (hold && len - vt.seq_begin <= MAX_HELD) {
+                stop = vt.seq_begin;
+            }
+            sb.flush_held();
+            sb.append(buf + seg_start, stop - seg_start);
+            if (stop < len) sb.held.assign((const char *)buf + stop, len - stop);
+            sb.end_pos = base + len - sb.held.size();
+        }
+    };
+
+private:
+    static const size_t MAX_HELD = 64;
+
+    void flush_held() {
+        if (held.empty()) return;
+        append((const uint8_t *)held.data(), held.size());
+        held.clear();
+    }
+
+    bool map_file(const std::string &path) {
+        unlink(path.c_str());
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+        if (fd < 0) return false;
+        void *p = MAP_FAILED;
+        if (ftruncate(fd, (off_t)max_cap) == 0)
+            p = mmap(NULL, max_cap, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        unlink(path.c_str());
+        if (p == MAP_FAILED) return false;
+        data = (uint8_t *)p;
+        cap = max_cap;
+        mapped = true;
+        return true;
+    }
+
+    // Heap rings: double (at least to need) and linearize the contents
+    void grow(size_t need) {
+        size_t ncap = cap;
+        while (ncap < need && ncap < max_cap) ncap *= 2;
+        uint8_t *ndata = (uint8_t *)malloc(ncap);
+        if (!ndata) return;  // keep the smaller ring
+        struct iovec seg[2];
+        int nseg = segments(oldest(), count, seg);
+        size_t pos = 0;
+        for (int i = 0; i < nseg; i++) {
+            memcpy(ndata + pos, seg[i].iov_base, seg[i].iov_len);
+            pos += seg[i].iov_len;
+        }
+        free(data);
+        data = ndata;
+        cap = ncap;
+        head = count & (cap - 1);
+    }
+
+public:
+    // Replay the stored bytes from *pos (still stored) up to stop to a single
+    // client as MSG_DATA frames of up to REPLAY_FRAME, advancing *pos. Each
+    // frame covers both ring segments and goes out with one writev() straight
+    // from the ring, as long as q is empty and the socket takes whole frames.
+    // Only the tail of a frame the socket cuts off is copied into q; the
+    // next call continues once q has drained, so a client that stops reading
+    // holds up one frame, not the replay. compress sends each frame as DATA_Z
+    // where that's smaller.
+    bool replay_to(int fd, OutQueue &q, bool compress, uint64_t *pos, uint64_t stop) {
+        bool ok = true;
+        while (ok && *pos < stop && q.empty()) {
+            size_t len = (size_t)std::min(stop - *pos, (uint64_t)REPLAY_FRAME);
+            struct iovec seg[2];
+            int nseg = segments(*pos, len, seg);
+            ok = q.send_data(fd, seg, nseg, compress);
+            *pos += len;
+        }
+        release_cold();  // the replayed spans have been sent
+        return ok;
+    }
+
+    // Whether the stream from offset from up to stream_end (the session's
+    // output so far) is still stored exactly
+    bool holds_since(uint64_t from, uint64_t stream_end) const {
+        return from >= verbatim_from && from <= stream_end &&
+               from + count >= end_pos && end_pos + held.size() == stream_end;
+    }
+
+    // Where in the ring (as an offset like stored) the stream from offset
+    // from on starts, for a client that already has everything before it
+    // (see holds_since). The held bytes follow the ring: see send_held().
+    uint64_t resume_offset(uint64_t from) const {
+        return from < end_pos ? stored - (end_pos - from) : stored;
+    }
+
+    // Send the held bytes from stream offset from on, after the ring
+    bool send_held(uint64_t from, int fd, OutQueue &q, bool compress) const {
+        size_t skip = from > end_pos ? (size_t)(from - end_pos) : 0;
+        if (held.size() <= skip) return true;
+        struct iovec part;
+        part.iov_base = (void *)(held.data() + skip);
+        part.iov_len = held.size() - skip;
+        return q.send_data(fd, &part, 1, compress);
+    }
+};
+
+// Per-session settings chosen at create/open time
+struct SessionOptions {
+    OverflowPolicy overflow;
+    size_t scrollback_size;  // power of two
+    bool server;             // host it in the per-UID server (--server)
+    bool journal;            // keep a journal of the output on disk (--journal)
+    ResizePolicy resize;
+    bool pausable;           // detached: stop reading once the scrollback is full
+    bool io_thread;          // read the PTY on a thread of its own (--io-thread)
+
+    SessionOptions()
+        : overflow(OVERFLOW_RESYNC), scrollback_size(SCROLLBACK_SIZE), server(false), journal(false),
+          resize(RESIZE_LATEST), pausable(false), io_thread(false) {}
+};
+
+struct Session;
+
+// One client connection. It is "attached" (receives output) once its HELLO
+// has been processed.
+struct ClientConn {
+    int fd;
+    Session *sess;       // attached to; NULL before HELLO and once it ended
+    FrameReader in;
+    OutQueue out;        // corked while a scrollback replay is being written
+    OutQueue replay;     // the replay frame the socket cut off
+    uint64_t replay_pos; // scrollback still to replay: [replay_pos, replay_stop)
+    uint64_t replay_stop;
+    bool attached;
+    bool compress;       // HELLO_FLAG_COMPRESS: DATA may be sent as DATA_Z
+    bool display_rate;   // HELLO_FLAG_DISPLAY_RATE
+    bool skipping;       // display-rate: live output dropped, redrawing instead
+    bool stale;          // output arrived since the last redraw
+    int64_t redraw_at;   // earliest time for the next redraw
+    int ping_ms;         // negotiated ping interval, 0 = never ping
+    int64_t last_rx;     // when the last frame from this client arrived
+    bool ping_out;       // PING sent since last_rx
+    bool echo_ack;       // HELLO_FLAG_ECHO_ACK
+    bool echo_model;     // echo_ack: sent a full redraw, its screen model can be exact
+    bool echo_synced;    // ECHO_ACKs are being sent (see server_sync_echo)
+    bool resume;         // HELLO_FLAG_RESUME: gets MSG_SYNC
+    bool read_only;      // HELLO_FLAG_READ_ONLY
+    uint16_t cols, rows; // window size from HELLO or WINCH, 0 = none (viewers)
+    int64_t active_at;   // last input, resize or attach, for RESIZE_LATEST
+    uint32_t input_seq;  // DATA frames received
+    uint32_t acked_seq;  // last sent in an ECHO_ACK
+    int64_t input_at;    // when DATA frame input_seq arrived
+    bool want_write;     // registered for writability (output pending)
+    bool closing;        // last frame (REPLY/EXIT) queued: close once sent
+    int64_t close_by;    // closing: give up on the queue at this time
+    bool dead;           // removed at the end of the loop iteration
+    Session *kill_wait;  // MSG_KILL: replied to once this session is torn down
+    int64_t connected_at;
+    uint64_t frames_in;
+    uint64_t replay_end;   // out.sent once the frames queued with the replay are written
+    int64_t replay_start;  // when the replay began (us), 0 = written out
+
+    void reset(int cfd) {
+        fd = cfd;
+        sess = NULL;
+        in.reset();
+        out.reset();
+        replay.reset();
+        replay_pos = replay_stop = 0;
+        attached = false;
+        compress = false;
+        display_rate = false;
+        skipping = false;
+        stale = false;
+        redraw_at = 0;
+        ping_ms = 0;
+        ping_out = false;
+        echo_ack = false;
+        echo_model = false;
+        echo_synced = false;
+        resume = false;
+        read_only = false;
+        cols = rows = 0;
+        active_at = 0;
+        input_seq = 0;
+        acked_seq = 0;
+        input_at = 0;
+        want_write = false;
+        closing = false;
+        close_by = 0;
+        dead = false;
+        kill_wait = NULL;
+        connected_at = now_ms();
+        last_rx = connected_at;
+        frames_in = 0;
+        replay_end = 0;
+        replay_start = 0;
+    }
+};
+
+// create --io-thread: a thread that does nothing but read the session's PTY
+// into a single-producer single-consumer ring, so the child keeps writing
+// while the event loop is busy with scrollback, parsing and client sockets.
+// The loop watches event_fd() instead of the PTY and takes the output with
+// read(), which behaves like read() on the PTY itself. Positions only grow;
+// the ring wraps with a mask. While the ring holds data, the notify pipe
+// holds a byte, so a level-triggered wait keeps reporting it.
+#if defined(GHOSTLY_IO_THREAD)
+struct PtyReader {
+    PtyReader() : ring(NULL), mask(0), head(0), tail(0), eof(false), quit(false),
+                  child_gone(false), waiting(false), stalls(0), pty(-1), running(false) {
+        notify_pipe[0] = notify_pipe[1] = wake_pipe[0] = wake_pipe[1] = -1;
+    }
+
+    bool start(int pty_fd, std::string *err) {
+        pty = pty_fd;
+        ring = (uint8_t *)malloc(IO_THREAD_RING);
+        mask = IO_THREAD_RING - 1;
+        if (!ring || pipe(notify_pipe) != 0 || pipe(wake_pipe) != 0) {
+            *err = std::string("io thread: ") + strerror(errno);
+            return false;
+        }
+        for (int k = 0; k < 2; k++) {
+            set_nonblock(notify_pipe[k]);
+            set_cloexec(notify_pipe[k]);
+            set_nonblock(wake_pipe[k]);
+            set_cloexec(wake_pipe[k]);
+        }
+        // Signals stay with the event loop: the thread starts with all blocked
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        int r = pthread_create(&thread, NULL, thread_main, this);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (r != 0) {
+            *err = std::string("io thread: ") + strerror(r);
+            return false;
+        }
+        running = true;
+        return true;
+    }
+
+    // Stops the thread and releases everything; the PTY stays open
+    void stop() {
+        if (running) {
+            quit = true;
+            poke(wake_pipe[1]);
+            pthread_join(thread, NULL);
+            running = false;
+        }
+        for (int k = 0; k < 2; k++) {
+            if (notify_pipe[k] >= 0) close(notify_pipe[k]);
+            if (wake_pipe[k] >= 0) close(wake_pipe[k]);
+        }
+        notify_pipe[0] = notify_pipe[1] = wake_pipe[0] = wake_pipe[1] = -1;
+        free(ring);
+        ring = NULL;
+    }
+
+    int event_fd() const { return notify_pipe[0]; }
+    uint64_t stall_count() const { return stalls; }
+
+    // The child has exited, so whatever it wrote is in the PTY already:
+    // the thread reads until the PTY is empty, then reports EOF
+    void child_exited() {
+        child_gone = true;
+        poke(wake_pipe[1]);
+    }
+
+    // Loop side. Up to n bytes of output; 0 once the PTY has hung up and
+    // everything before that was taken, -1 with EAGAIN when there is none.
+    ssize_t read(uint8_t *buf, size_t n) {
+        bool hung_up = eof;  // before tail: the last output is then visible
+        uint64_t h = head, t = tail;
+        size_t got = (size_t)std::min((uint64_t)n, t - h);
+        size_t off = (size_t)(h & mask);
+        size_t first = std::min(got, IO_THREAD_RING - off);
+        memcpy(buf, ring + off, first);
+        memcpy(buf + first, ring, got - first);
+        head = h + got;
+        if (got && waiting) poke(wake_pipe[1]);
+        if (h + got == t) {
+            // Looks empty: clear the pipe, then look again, in case output
+            // arrived (and its byte was just cleared) in between
+            char drain[64];
+            while (::read(notify_pipe[0], drain, sizeof(drain)) > 0) {}
+            if (tail != h + got || hung_up) poke(notify_pipe[1]);
+        }
+        if (got) return (ssize_t)got;
+        if (hung_up) return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+
+private:
+    uint8_t *ring;
+    size_t mask;
+    std::atomic<uint64_t> head;  // taken by the loop up to here
+    std::atomic<uint64_t> tail;  // filled by the thread up to here
+    std::atomic<bool> eof;       // the PTY hung up; set after the last tail
+    std::atomic<bool> quit;
+    std::atomic<bool> child_gone;  // see child_exited()
+    std::atomic<bool> waiting;   // the thread waits for room in the ring
+    std::atomic<uint64_t> stalls;  // times it had to
+    int notify_pipe[2];          // thread -> loop: output in the ring
+    int wake_pipe[2];            // loop -> thread: room in the ring, or quit
+    int pty;
+    pthread_t thread;
+    bool running;
+
+    static void poke(int fd) {
+        char c = 0;
+        ssize_t r = write(fd, &c, 1);
+        (void)r;
+    }
+
+    // Block until fd is readable (or the loop pokes wake_pipe). EINTR can't
+    // happen, all signals are blocked.
+    void wait_for(int fd) {
+        struct pollfd pfd[2] = {{wake_pipe[0], POLLIN, 0}, {fd, POLLIN, 0}};
+        poll(pfd, fd >= 0 ? 2 : 1, -1);
+        char drain[64];
+        if (pfd[0].revents) while (::read(wake_pipe[0], drain, sizeof(drain)) > 0) {}
+    }
+
+    void run() {
+        while (!quit) {
+            uint64_t t = tail, h = head;
+            if (t - h == IO_THREAD_RING) {
+                // Full: the loop pokes wake_pipe once it has taken some, if
+                // it sees waiting set, and we re-check head after setting it
+                waiting = true;
+                if (head == h && !quit) {
+                    stalls++;
+                    wait_for(-1);
+                }
+                waiting = false;
+                continue;
+            }
+            size_t off = (size_t)(t & mask);
+            size_t room = (size_t)std::min(IO_THREAD_RING - (t - h), (uint64_t)(IO_THREAD_RING - off));
+            ssize_t n = ::read(pty, ring + off, room);
+            if (n > 0) {
+                tail = t + n;
+                // Empty until now (the loop has taken all before t): wake it
+                if (head == t) poke(notify_pipe[1]);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EAGAIN && !child_gone) {
+                wait_for(pty);
+                continue;
+            }
+            // EOF, EIO once the child side has hung up, or drained after
+            // the child exited
+            eof = true;
+            poke(notify_pipe[1]);
+            return;
+        }
+    }
+
+    static void *thread_main(void *self) {
+        ((PtyReader *)self)->run();
+        return NULL;
+    }
+};
+#else
+struct PtyReader {
+    bool start(int, std::string *err) {
+        *err = "--io-thread: this build has no thread support (build with -pthread)";
+        return false;
+    }
+    void stop() {}
+    int event_fd() const { return -1; }
+    uint64_t stall_count() const { return 0; }
+    void child_exited() {}
+    ssize_t read(uint8_t *, size_t) {
+        errno = EAGAIN;
+        return -1;
+    }
+};
+#endif
+
+// One PTY and its child, with everything recorded from it. A standalone
+// daemon hosts exactly one session, the per-UID server any number.
+struct Session {
+    std::string name;
+    std::string command;
+    SessionOptions opts;
+    int pty_master;
+    PtyReader *reader;   // --io-thread: reads pty_master, else NULL
+    pid_t child_pid;
+    time_t created;
+    int child_exit_code; // [FIX #7] saved when child is first reaped
+    bool ended;          // child exited, PTY hung up or killed: torn down
+                         // once the child is stopped (server_end_sessions)
+    int stop_step;       // ended: signals sent so far, see session_stop_child()
+    int64_t stop_at;     // ended: when the next one is due
+    uint64_t bytes_in;   // client input written to the PTY
+    uint64_t bytes_out;  // PTY output, and the stream offset of what comes next
+    uint64_t stream_id;  // tells this session's stream offsets from another's
+    time_t last_activity;  // last input or output
+    int clients;           // attached
+    uint64_t detached_at;  // bytes_out when the last client left
+    bool watching;         // the PTY is registered with the event loop
+    int64_t read_at;       // detached: watch the PTY again then, 0 = not waiting
+    bool paused;           // pausable: not read until a client attaches
+    uint16_t cols, rows;   // window size applied to the PTY, 0 = none yet
+    int64_t resized_at;    // when it was applied (ms)
+    int64_t resize_at;     // a new size is due then (debounced), 0 = none
+    ScrollbackBuffer scrollback;
+    Journal journal;      // on disk copy of the scrollback's input, if opts.journal
+    VtParser vt;          // PTY output stream state
+    Screen screen;        // what the session's terminal currently shows
+};
+
+// What the daemon has done since it started, for `stats`. Client counters
+// cover departed clients; live ones are added when reporting.
+struct ServerStats {
+    time_t started;
+    uint64_t pty_reads;         // wakeups with PTY output
+    uint64_t pty_bytes;
+    uint64_t frames_in;
+    uint64_t frames_out;
+    uint64_t bytes_sent;
+    uint64_t clients_accepted;
+    uint64_t clients_removed;   // for any reason
+    uint64_t clients_dropped;   // by the daemon: overflow, timeout, bad frame
+    uint64_t resyncs;           // overflowed queues replaced by a redraw
+    uint64_t replays;
+    uint64_t resumes;           // replays of just the output a client missed
+    uint64_t resizes;           // window sizes applied to a PTY
+    uint64_t pauses;            // pausable sessions that stopped being read
+    uint64_t reader_stalls;     // --io-thread rings found full, ended sessions
+    uint64_t replay_bytes;
+    uint64_t replay_us;         // from HELLO until the replay was written out
+    uint64_t wakeups;           // event loop iterations
+    uint64_t max_iteration_us;  // longest time spent handling one wakeup
+
+    ServerStats() { memset(this, 0, sizeof(*this)); started = time(NULL); }
+};
+
+struct ServerState {
+    bool multi;           // per-UID server: sessions are created by request
+    int listen_fd;
+    int wake_pipe[2];     // see server_wake()
+    EventLoop loop;       // listen fd, PTYs, wake pipe and every client
+    std::vector<ClientConn> clients;  // [0, num_clients) in use; slots are reused
+    std::vector<int> client_slot;     // by fd: index in clients, -1 = none
+    int num_clients;
+    int max_clients;      // MAX_CLIENTS standalone, MAX_SERVER_CLIENTS multi
+    std::vector<Session *> sessions;
+    int exit_code;        // of the last session to end (standalone: the daemon's)
+    volatile sig_atomic_t got_sigchld;
+    volatile bool running;
+    std::vector<uint8_t> zbuf;  // broadcast DATA_Z payload, reused
+    std::vector<uint8_t> pty_buf;  // detached PTY reads, reused
+    ServerStats stats;
+};
+
+static ServerState *g_server = NULL;
+
+// Self-pipe: signal handlers poke it so a signal arriving just before poll()
+// still wakes the loop (poll has no timeout when the session is idle)
+static void server_wake() {
+    if (!g_server || g_server->wake_pipe[1] < 0) return;
+    int saved = errno;
+    char c = 0;
+    ssize_t r = write(g_server->wake_pipe[1], &c, 1);
+    (void)r;
+    errno = saved;
+}
+
+static void server_sigchld(int) {
+    // Children are reaped in the loop (server_reap_children), which knows
+    // which session each one belongs to
+    if (g_server) g_server->got_sigchld = 1;
+    server_wake();
+}
+
+static void server_sigterm(int) {
+    if (g_server) g_server->running = false;
+    server_wake();
+}
+
+static void server_sighup(int) {
+    // Terminal hangup: shut down. The children are sent SIGHUP first on the
+    // way out, see session_stop_child().
+    if (g_server) g_server->running = false;
+    server_wake();
+}
+
+// EventLoop tokens. Clients use their fd as token, a session's PTY master
+// pty_token(fd).
+static const int TOKEN_LISTEN = -1;
+static const int TOKEN_WAKE = -2;
+static const int TOKEN_PTY = -3;
+
+static int pty_token(int fd) { return TOKEN_PTY - fd; }
+
+static ClientConn *server_find_client(ServerState &srv, int fd) {
+    if (fd < 0 || (size_t)fd >= srv.client_slot.size() || srv.client_slot[fd] < 0) return NULL;
+    return &srv.clients[srv.client_slot[fd]];
+}
+
+// Take a slot for a new connection, growing the table if all are in use.
+// References to clients don't survive this.
+static ClientConn &server_add_client(ServerState &srv, int cfd) {
+    if ((size_t)srv.num_clients == srv.clients.size()) srv.clients.push_back(ClientConn());
+    if ((size_t)cfd >= srv.client_slot.size()) srv.client_slot.resize(cfd + 1, -1);
+    srv.client_slot[cfd] = srv.num_clients;
+    ClientConn &c = srv.clients[srv.num_clients++];
+    c.reset(cfd);
+    srv.stats.clients_accepted++;
+    return c;
+}
+
+static Session *server_find_session(ServerState &srv, const std::string &name) {
+    for (size_t i = 0; i < srv.sessions.size(); i++)
+        if (srv.sessions[i]->name == name) return srv.sessions[i];
+    return NULL;
+}
+
+static Session *server_find_pty(ServerState &srv, int token) {
+    for (size_t i = 0; i < srv.sessions.size(); i++)
+        if (pty_token(srv.sessions[i]->pty_master) == token) return srv.sessions[i];
+    return NULL;
+}
+
+// What the event loop watches for a session's output: the PTY, or the
+// reader thread's notify pipe
+static int session_output_fd(const Session &s) {
+    return s.reader ? s.reader->event_fd() : s.pty_master;
+}
+
+// PTY output into buf, like read(2) on the PTY: from the reader thread's
+// ring with --io-thread
+static ssize_t session_read_output(Session &s, uint8_t *buf, size_t n) {
+    if (s.reader) return s.reader->read(buf, n);
+    return read(s.pty_master, buf, n);
+}
+
+// Start or stop watching a session's PTY for output
+static void session_watch_pty(ServerState &srv, Session &s, bool on) {
+    if (s.watching == on || s.ended) return;
+    if (on) {
+        s.watching = srv.loop.add(session_output_fd(s), pty_token(s.pty_master), false);
+    } else {
+        srv.loop.remove(session_output_fd(s));
+        s.watching = false;
+    }
+}
+
+// The window size the session's clients call for under its resize policy.
+// False when none has one (viewers don't).
+static bool session_wanted_size(const ServerState &srv, const Session &s,
+                                uint16_t *cols, uint16_t *rows) {
+    const ClientConn *latest = NULL;
+    bool any = false;
+    for (int i = 0; i < srv.num_clients; i++) {
+        const ClientConn &c = srv.clients[i];
+        if (c.dead || !c.attached || c.sess != &s || !c.cols || !c.rows) continue;
+        if (s.opts.resize == RESIZE_LATEST) {
+            if (!latest || c.active_at >= latest->active_at) latest = &c;
+        } else if (!any) {
+            *cols = c.cols;
+            *rows = c.rows;
+        } else if (s.opts.resize == RESIZE_SMALLEST) {
+            *cols = std::min(*cols, c.cols);
+            *rows = std::min(*rows, c.rows);
+        } else {
+            *cols = std::max(*cols, c.cols);
+            *rows = std::max(*rows, c.rows);
+        }
+        any = true;
+    }
+    if (latest) {
+        *cols = latest->cols;
+        *rows = latest->rows;
+    }
+    return any;
+}
+
+// Bring the PTY to the size its clients call for. Nothing happens when that
+// is the size it already has: no ioctl, so no SIGWINCH and no redraw. A
+// change goes out at once if the last one is RESIZE_DEBOUNCE_MS old, else
+// when it will be (server_apply_resizes), merged with any that follow.
+// Returns whether the size changes, now or then.
+static bool session_update_size(ServerState &srv, Session &s) {
+    uint16_t cols = 0, rows = 0;
+    if (!session_wanted_size(srv, s, &cols, &rows) || (cols == s.cols && rows == s.rows)) {
+        s.resize_at = 0;
+        return false;
+    }
+    int64_t now = now_ms();
+    if (now - s.resized_at < RESIZE_DEBOUNCE_MS) {
+        if (!s.resize_at) s.resize_at = s.resized_at + RESIZE_DEBOUNCE_MS;
+        return true;
+    }
+    // The kernel sends the foreground process group SIGWINCH
+    struct winsize ws;
+    ws.ws_col = cols;
+    ws.ws_row = rows;
+    ws.ws_xpixel = 0;
+    ws.ws_ypixel = 0;
+    ioctl(s.pty_master, TIOCSWINSZ, &ws);
+    s.screen.resize(cols, rows);
+    s.cols = cols;
+    s.rows = rows;
+    s.resized_at = now;
+    s.resize_at = 0;
+    srv.stats.resizes++;
+    return true;
+}
+
+// What a resize would do, without one: SIGWINCH to the PTY's foreground
+// process group, so that a full-screen program redraws
+static void session_send_winch(const Session &s) {
+    pid_t pgrp = tcgetpgrp(s.pty_master);
+    kill(pgrp > 0 ? -pgrp : s.child_pid, SIGWINCH);
+}
+
+// A client's size from a HELLO or WINCH payload: [cols u16][rows u16]
+static void client_set_size(ClientConn &c, const uint8_t *p) {
+    c.cols = ((uint16_t)p[0] << 8) | p[1];
+    c.rows = ((uint16_t)p[2] << 8) | p[3];
+    c.active_at = now_ms();
+}
+
+// Touch the socket a session is reached through when its client count
+// changes, so `list --watch` hears of it from the socket dir
+static void session_touch(const ServerState &srv, const Session &s) {
+    utimes((srv.multi ? server_socket_path() : socket_path(s.name)).c_str(), NULL);
+}
+
+// The daemon gives up on a client (as opposed to the client leaving)
+static void server_drop_client(ServerState &srv, ClientConn &c) {
+    c.dead = true;
+    srv.stats.clients_dropped++;
+}
+
+// The client's last frame has been queued: stop reading from it and
+// close the connection once the queue has drained (or after a second)
+static void client_close_when_sent(ClientConn &c) {
+    c.closing = true;
+    c.skipping = false;
+    c.close_by = now_ms() + 1000;
+}
+
+// Answer a control request and hang up
+static void server_reply(ClientConn &c, uint8_t status, const std::string &text) {
+    std::string payload(1, (char)status);
+    payload += text;
+    c.out.push_frame(MSG_REPLY, payload.data(), (uint32_t)payload.size());
+    client_close_when_sent(c);
+}
+
+// VtParser handler for PTY output: one pass over each read updates the
+// screen model and picks the spans that go to scrollback
+struct OutputTap {
+    static const bool wants_text = true;
+    Screen &screen;
+    ScrollbackBuffer::Recorder rec;
+
+    OutputTap(Screen &s, ScrollbackBuffer &sb, const uint8_t *buf, uint64_t at)
+        : screen(s), rec(sb, buf, at) {}
+
+    void on_print(const uint8_t *p, size_t n) { screen.on_print(p, n); }
+    void on_execute(uint8_t c) { screen.on_execute(c); }
+    void on_esc(const VtParser &vt, uint8_t f) { screen.on_esc(vt, f); }
+    void on_csi(const VtParser &vt, uint8_t f) { screen.on_csi(vt, f); }
+    void on_modes(const VtParser &vt, const VtModes &old,
+                  size_t begin, size_t end, bool begin_before) {
+        rec.on_modes(vt, old, begin, end, begin_before);
+    }
+};
+
+// After s.bytes_out has been advanced past buf
+static void session_record_output(Session &s, const uint8_t *buf, size_t len) {
+    OutputTap tap(s.screen, s.scrollback, buf, s.bytes_out - len);
+    s.vt.feed(buf, len, tap);
+    tap.rec.finish(s.vt, len);
+}
+
+// Tell a resuming client where in the session's stream the output that
+// follows starts
+static void server_send_sync(ClientConn &c) {
+    if (!c.resume) return;
+    uint8_t sync[16];
+    for (int k = 0; k < 8; k++) {
+        sync[k] = (uint8_t)(c.sess->stream_id >> (56 - 8 * k));
+        sync[8 + k] = (uint8_t)(c.sess->bytes_out >> (56 - 8 * k));
+    }
+    c.out.push_frame(MSG_SYNC, sync, sizeof(sync));
+}
+
+// Send a client a redraw of the current screen (both screens if a TUI app
+// has the alternate one), sized by the window rather than by history
+static bool server_send_screen(ClientConn &c) {
+    std::string redraw;
+    c.sess->screen.render(redraw);
+    struct iovec part;
+    part.iov_base = (void *)redraw.data();
+    part.iov_len = redraw.size();
+    if (!c.out.send_data(c.fd, &part, 1, c.compress)) return false;
+    // The redraw stands for all output so far, including any the client
+    // was not sent
+    server_send_sync(c);
+    return true;
+}
+
+// Replay the scrollback to a client from ring offset from on. It is written
+// by server_replay_step() as the socket takes it, and output queued for the
+// client meanwhile waits behind it.
+static void server_start_replay(ClientConn &c, uint64_t from) {
+    c.replay_pos = from;
+    c.replay_stop = c.sess->scrollback.stored;
+    c.out.corked = c.replay_pos < c.replay_stop;
+}
+
+// Initial output for a newly attached client. A resuming client whose
+// stream offset is still in the scrollback gets just what it missed. By
+// default: the scrollback (main-screen history), followed by a redraw of
+// the alternate screen if one is active, or for a client that predicts echo
+// (a screen model fed the history as it was written, at whatever sizes, is
+// not the screen). HELLO_FLAG_SCREEN sends just the redraw, and
+// HELLO_FLAG_NO_REPLAY nothing: the child is asked to redraw instead, unless
+// the attach resizes it (which does that anyway).
+static bool server_replay(ServerState &srv, ClientConn &c, uint8_t hello_flags,
+                          uint64_t resume_id, uint64_t resume_from, bool resizing) {
+    Session &s = *c.sess;
+    if (c.resume && resume_id == s.stream_id && s.scrollback.holds_since(resume_from, s.bytes_out)) {
+        srv.stats.resumes++;
+        server_start_replay(c, s.scrollback.resume_offset(resume_from));
+        return s.scrollback.send_held(resume_from, c.fd, c.out, c.compress);
+    }
+    if (hello_flags & HELLO_FLAG_NO_REPLAY) {
+        if (!resizing) session_send_winch(s);
+        return true;
+    }
+    c.echo_model = c.echo_ack;
+    if (hello_flags & HELLO_FLAG_SCREEN) return server_send_screen(c);
+    server_start_replay(c, s.scrollback.oldest());
+    if (!c.sess->screen.alt_active() && !c.echo_ack) return true;
+    return server_send_screen(c);
+}
+
+// Apply the overflow policy to a client whose queue is full
+static void server_overflow(ServerState &srv, ClientConn &c) {
+    if (c.sess->opts.overflow == OVERFLOW_DROP) {
+        server_drop_client(srv, c);
+        return;
+    }
+    // Resync: throw away the backlog and redraw the current screen, which
+    // is all the client would have ended up showing anyway.
+    srv.stats.resyncs++;
+    c.out.discard_pending();
+    if (!server_send_screen(c)) c.dead = true;
+}
+
+// Write more of a client's scrollback replay (see server_start_replay), then
+// let the output queued behind it go. If the session has overwritten what
+// is left before the client caught up, the rest of the replay is given up
+// and the overflow policy applies, as for a full queue. Returns false if the
+// connection is broken.
+static bool server_replay_step(ServerState &srv, ClientConn &c) {
+    if (!c.replay.flush(c.fd)) return false;
+    if (!c.replay.empty()) return true;
+    if (c.replay_pos < c.replay_stop) {
+        if (!c.sess) {
+            c.replay_pos = c.replay_stop;  // ended, and its scrollback is gone
+        } else if (c.replay_pos < c.sess->scrollback.oldest()) {
+            c.replay_pos = c.replay_stop;
+            server_overflow(srv, c);
+            if (c.dead) return true;
+        } else if (!c.sess->scrollback.replay_to(c.fd, c.replay, c.compress,
+                                                 &c.replay_pos, c.replay_stop)) {
+            return false;
+        }
+        if (c.replay_pos < c.replay_stop || !c.replay.empty()) return true;
+    }
+    c.out.corked = false;
+    return true;
+}
+
+// Queue a frame for every client of session s. Never blocks; the queues are
+// drained by server_flush_clients() and on POLLOUT. Every queue refers to the
+// same frame, and DATA is compressed at most once, the first time a
+// compressing client needs it.
+static void server_broadcast(ServerState &srv, Session &s, OutChunk *frame) {
+    MsgType type = (MsgType)frame->bytes[0];
+    uint32_t len = (uint32_t)frame->bytes.size() - 5;
+    OutChunk *zframe = NULL;
+    int zstate = 0;  // 0 = not tried, 1 = zframe ready, -1 = send plain
+    for (int i = 0; i < srv.num_clients; i++) {
+        ClientConn &c = srv.clients[i];
+        if (c.dead || !c.attached || c.sess != &s) continue;
+        if (type == MSG_DATA && len > 0 && c.display_rate) {
+            if (c.skipping) {
+                c.stale = true;
+                continue;
+            }
+            // Too far behind: drop the backlog and catch up with redraws,
+            // see server_redraw_clients()
+            if (c.out.size() + 5 + len > DISPLAY_RATE_BACKLOG) {
+                c.out.discard_pending();
+                c.skipping = true;
+                c.stale = true;
+                c.redraw_at = 0;
+                continue;
+            }
+        }
+        OutChunk *f = frame;
+        if (type == MSG_DATA && c.compress && len > 0) {
+            if (zstate == 0) {
+                struct iovec part;
+                part.iov_base = &frame->bytes[5];
+                part.iov_len = len;
+                zstate = compress_data(&part, 1, srv.zbuf) ? 1 : -1;
+                if (zstate == 1)
+                    zframe = out_chunk_frame(MSG_DATA_Z, &srv.zbuf[0], (uint32_t)srv.zbuf.size());
+            }
+            if (zstate == 1) f = zframe;
+        }
+        if (c.out.size() + f->bytes.size() > CLIENT_QUEUE_LIMIT) {
+            server_overflow(srv, c);
+            if (c.dead) continue;
+        }
+        c.out.push_shared(f);
+    }
+    if (zframe) out_chunk_unref(zframe);
+}
+
+// Display-rate clients that are skipping output get the current screen at
+// most every DISPLAY_RATE_INTERVAL_MS, and only once the previous redraw has
+// been written out. When a redraw is current, live output resumes.
+static void server_redraw_clients(ServerState &srv) {
+    int64_t now = now_ms();
+    for (int i = 0; i < srv.num_clients; i++) {
+        ClientConn &c = srv.clients[i];
+        if (c.dead || !c.skipping) continue;
+        if (!c.stale) {
+            c.skipping = false;
+            continue;
+        }
+        if (now < c.redraw_at || !c.out.empty() || c.out.corked) continue;
+        if (!server_send_screen(c)) {
+            c.dead = true;
+            continue;
+        }
+        c.stale = false;
+        c.redraw_at = now + DISPLAY_RATE_INTERVAL_MS;
+    }
+}
+
+static void earliest(int64_t *next, int64_t t) {
+    if (*next < 0 || t < *next) *next = t;
+}
+
+// Poll timeout until the next client timer: a display-rate redraw, a HELLO
+// or partial-frame timeout, a ping, an echo acknowledgement, or giving up on
+// a closing client; or a journal flush, debounced resize or detached PTY
+// read. -1 (wait for events) when there is none, so an idle session doesn't
+// wake up at all.
+static int server_poll_timeout(const ServerState &srv) {
+    int64_t next = -1;
+    for (int i = 0; i < srv.num_clients; i++) {
+        const ClientConn &c = srv.clients[i];
+        if (c.dead) continue;
+        if (c.closing) {
+            earliest(&next, c.close_by);
+            continue;
+        }
+        if (c.skipping && c.out.empty() && !c.out.corked) earliest(&next, c.redraw_at);  // else POLLOUT
+        if (!c.attached) earliest(&next, c.connected_at + HELLO_TIMEOUT_MS);
+        if (c.in.partial_since) earliest(&next, c.in.partial_since + CLIENT_RECV_TIMEOUT * 1000);
+        if (c.ping_ms) earliest(&next, c.last_rx + (c.ping_out ? 2 : 1) * c.ping_ms);
+        if (c.echo_synced && c.acked_seq != c.input_seq) earliest(&next, c.input_at + ECHO_ACK_MS);
+    }
+    for (size_t i = 0; i < srv.sessions.size(); i++) {
+        const Session *s = srv.sessions[i];
+        if (s->journal.flush_at) earliest(&next, s->journal.flush_at);
+        if (s->resize_at) earliest(&next, s->resize_at);
+        if (s->read_at) earliest(&next, s->read_at);
+        if (s->ended && s->child_pid > 0 && s->stop_step < 3) earliest(&next, s->stop_at);
+    }
+    if (next < 0) return -1;
+    int64_t wait = std::max((int64_t)0, next - now_ms());
+    return (int)std::min(wait, (int64_t)PING_INTERVAL_MAX * 2000);
+}
+
+// Write queued output (and replays) to every client that has some, without
+// blocking, and keep each client's writability interest in step with it
+static void server_flush_clients(ServerState &srv) {
+    for (int i = 0; i < srv.num_clients; i++) {
+        ClientConn &c = srv.clients[i];
+        if (c.dead) continue;
+        if (c.out.corked && !server_replay_step(srv, c)) c.dead = true;
+        if (c.dead) continue;
+        if (!c.out.flush(c.fd)) {
+            c.dead = true;
+            continue;
+        }
+        if (c.replay_start && !c.out.corked && c.out.sent >= c.replay_end) {
+            srv.stats.replay_us += now_us() - c.replay_start;
+            c.replay_start = 0;
+        }
+        if (c.closing && c.out.empty() && !c.out.corked) {
+            c.dead = true;
+            continue;
+        }
+        bool want = !c.out.empty() || c.out.corked;
+        if (want != c.want_write && srv.loop.modify(c.fd, c.fd, want))
+            c.want_write = want;
+    }
+}
+
+// Shutdown: give queued output (e.g. the final MSG_EXIT) a bounded amount
+// of time to reach the clients.
+static void server_drain_clients(ServerState &srv, int timeout_ms) {
+    int64_t deadline = now_ms() + timeout_ms;
+    for (;;) {
+        server_flush_clients(srv);
+        std::vector<struct pollfd> fds;
+        for (int i = 0; i < srv.num_clients; i++) {
+            const OutQueue &out = srv.clients[i].out;
+            if (srv.clients[i].dead || (out.empty() && !out.corked)) continue;
+            struct pollfd pfd = {srv.clients[i].fd, POLLOUT, 0};
+            fds.push_back(pfd);
+        }
+        if (fds.empty() || now_ms() >= deadline) return;
+        if (poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR) return;
+    }
+}
+
+static int create_listen_socket(const std::string &path) {
+    // [FIX #2 cont.] Validate path length
+    if (!socket_path_fits(path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path.c_str());
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    unlink(path.c_str());
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+    chmod(path.c_str(), 0600);
+    return fd;
+}
+
+// Fork the session's shell on a new PTY and register it with the loop. It
+// gets env ("NAME=VALUE" entries) as its environment, or the daemon's if
+// empty. Returns NULL with a reason in *err if the session can't be started.
+static Session *server_start_session(ServerState &srv, const std::string &name,
+                                     const std::string &cmd, const SessionOptions &opts,
+                                     const std::string &cwd,
+                                     const std::vector<std::string> &env, std::string *err) {
+    if (!valid_session_name(name)) {
+        *err = "invalid session name";
+        return NULL;
+    }
+    if (server_find_session(srv, name)) {
+        *err = "session already exists";
+        return NULL;
+    }
+    if (opts.io_thread && opts.pausable) {
+        // The thread would go on filling its ring past the pause point
+        *err = "--pausable and --io-thread can't be combined";
+        return NULL;
+    }
+    if (srv.multi) {
+        pid_t pid = read_pid_file(pid_path(name));
+        if (pid > 0 && process_alive(pid)) {
+            *err = "a standalone session of that name exists";
+            return NULL;
+        }
+    }
+
+    // Built before the fork: a reader thread may hold the allocator's lock
+    std::vector<char *> envp;
+    for (size_t i = 0; i < env.size(); i++) envp.push_back((char *)env[i].c_str());
+    envp.push_back(NULL);
+
+    // Fork PTY
+    int pty_master;
+    pid_t child = forkpty(&pty_master, NULL, NULL, NULL);
+    if (child < 0) {
+        *err = std::string("forkpty: ") + strerror(errno);
+        return NULL;
+    }
+    if (child == 0) {
+        // Child: exec shell, without the server's signal dispositions
+        signal(SIGPIPE, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGHUP, SIG_DFL);
+        if (!cwd.empty() && chdir(cwd.c_str()) != 0) {
+            // Stay in the server's directory
+        }
+        if (!env.empty()) environ = &envp[0];
+        const char *shell = getenv("SHELL");
+        if (!shell) shell = "/bin/bash";
+        if (cmd.empty()) {
+            execlp(shell, shell, "-l", (char *)NULL);
+        } else {
+            execlp(shell, shell, "-l", "-c", cmd.c_str(), (char *)NULL);
+        }
+        perror("exec");
+        _exit(127);
+    }
+
+    set_nonblock(pty_master);
+    set_cloexec(pty_master);
+    PtyReader *reader = NULL;
+    if (opts.io_thread) {
+        reader = new PtyReader();
+        if (!reader->start(pty_master, err)) {
+            reader->stop();
+            delete reader;
+            close(pty_master);
+            kill(child, SIGKILL);
+            waitpid(child, NULL, 0);
+            return NULL;
+        }
+    }
+    if (!srv.loop.add(reader ? reader->event_fd() : pty_master, pty_token(pty_master), false)) {
+        *err = std::string("event loop: ") + strerror(errno);
+        if (reader) {
+            reader->stop();
+            delete reader;
+        }
+        close(pty_master);
+        kill(child, SIGKILL);
+        waitpid(child, NULL, 0);
+        return NULL;
+    }
+
+    Session *s = new Session();
+    s->name = name;
+    s->command = cmd.empty() ? "bash" : cmd;
+    s->opts = opts;
+    s->pty_master = pty_master;
+    s->reader = reader;
+    s->child_pid = child;
+    s->created = time(NULL);
+    s->child_exit_code = 0;
+    s->ended = false;
+    s->stop_step = 0;
+    s->stop_at = 0;
+    s->bytes_in = 0;
+    s->bytes_out = 0;
+    s->stream_id = ((uint64_t)s->created << 32) | (uint32_t)child;
+    s->last_activity = s->created;
+    s->clients = 0;
+    s->detached_at = 0;
+    s->watching = true;
+    s->read_at = 0;
+    s->paused = false;
+    s->cols = s->rows = 0;
+    s->resized_at = 0;
+    s->resize_at = 0;
+    s->scrollback.init(opts.scrollback_size, scrollback_path(name));
+    if (opts.journal && s->journal.open(journal_dir(name))) s->scrollback.journal = &s->journal;
+    s->screen.init(DEFAULT_COLS, DEFAULT_ROWS);
+    srv.sessions.push_back(s);
+    return s;
+}
+
+// ECHO_ACK for all input received so far. Queued behind the output already
+// broadcast, so the client has seen whatever echo the input got.
+static void server_send_echo_ack(ClientConn &c) {
+    uint8_t seq[4];
+    for (int k = 0; k < 4; k++) seq[k] = (uint8_t)(c.input_seq >> (24 - 8 * k));
+    c.out.push_frame(MSG_ECHO_ACK, seq, sizeof(seq));
+    c.acked_seq = c.input_seq;
+}
+
+// Acknowledgements let the client guess the echo on its own model of the
+// screen, so they are only sent while that model can be exact: after a full
+// redraw, with the client's window the session's size. When the sizes part,
+// an empty ECHO_ACK withdraws them; when they meet again, a redraw brings
+// the model back in step and they resume.
+static void server_sync_echo(ServerState &srv, Session &s) {
+    for (int i = 0; i < srv.num_clients; i++) {
+        ClientConn &c = srv.clients[i];
+        if (c.dead || c.closing || !c.attached || c.sess != &s || !c.echo_model) continue;
+        bool fits = c.cols == s.cols && c.rows == s.rows;
+        if (fits == c.echo_synced) continue;
+        c.echo_synced = fits;
+        if (!fits) {
+            c.out.push_frame(MSG_ECHO_ACK, NULL, 0);
+        } else if (server_send_screen(c)) {
+            server_send_echo_ack(c);
+        } else {
+            c.dead = true;
+        }
+    }
+}
+
+// Apply the resizes that have waited out their debounce interval
+static void server_apply_resizes(ServerState &srv) {
+    int64_t now = now_ms();
+    for (size_t i = 0; i < srv.sessions.size(); i++) {
+        Session &s = *srv.sessions[i];
+        if (s.resize_at && now >= s.resize_at && !s.ended) {
+            session_update_size(srv, s);
+            server_sync_echo(srv, s);
+        }
+    }
+}
+
+static void server_remove_client(ServerState &srv, int idx) {
+    const ClientConn &c = srv.clients[idx];
+    // Its size may have been the one the session had
+    Session *resized = c.attached && c.cols ? c.sess : NULL;
+    if (c.attached && c.sess) {
+        if (--c.sess->clients == 0) c.sess->detached_at = c.sess->bytes_out;
+        session_touch(srv, *c.sess);
+    }
+    srv.stats.frames_in += c.frames_in;
+    srv.stats.frames_out += c.out.frames + c.replay.frames;
+    srv.stats.bytes_sent += c.out.sent + c.replay.sent;
+    srv.stats.clients_removed++;
+    srv.loop.remove(c.fd);
+    close(c.fd);
+    srv.client_slot[c.fd] = -1;
+    int last = srv.num_clients - 1;
+    // Swap (moves) rather than copy so the queue buffers aren't duplicated
+    if (idx != last) {
+        std::swap(srv.clients[idx], srv.clients[last]);
+        srv.client_slot[srv.clients[idx].fd] = idx;
+    }
+    srv.clients[last].reset(-1);
+    srv.num_clients--;
+    if (resized && !resized->ended) {
+        session_update_size(srv, *resized);
+        server_sync_echo(srv, *resized);
+    }
+}
+
+// Remove clients marked dead during this loop iteration. Removal is deferred
+// so client indices stay stable while the poll results are being processed.
+static void server_reap_clients(ServerState &srv) {
+    for (int i = srv.num_clients - 1; i >= 0; i--) {
+        if (srv.clients[i].dead) server_remove_client(srv, i);
+    }
+}
+
+// [FIX #3] HELLO: [cols u16][rows u16], then optionally [flags u8] and
+// [ping interval u16, seconds], then [name len u8][name] to pick a session
+// of the per-UID server, then with HELLO_FLAG_RESUME [stream id u64]
+// [offset u64] of the output the client already has (the name may be empty
+// on a standalone daemon). Later bytes are ignored, for extensions.
+// Attaches the client: applies its window size and queues the replay.
+static bool server_handle_hello(ServerState &srv, ClientConn &c,
+                                const uint8_t *data, uint32_t len) {
+    if (len < 4 || len == 6 || len > 128) return false;
+    uint8_t hello_flags = (len >= 5) ? data[4] : 0;
+    if (len >= 7) {
+        int secs = ((int)data[5] << 8) | data[6];
+        if (secs > 0)
+            c.ping_ms = std::max(PING_INTERVAL_MIN, std::min(secs, PING_INTERVAL_MAX)) * 1000;
+    }
+    uint64_t resume_id = 0, resume_from = 0;
+    if (hello_flags & HELLO_FLAG_RESUME) {
+        uint32_t at = len >= 8 ? 8 + data[7] : len;
+        if (at + 16 <= len) {
+            for (int k = 0; k < 8; k++) {
+                resume_id = (resume_id << 8) | data[at + k];
+                resume_from = (resume_from << 8) | data[at + 8 + k];
+            }
+        }
+    }
+    Session *s;
+    if (srv.multi) {
+        if (len < 8 || 8 + (uint32_t)data[7] > len) return false;
+        s = server_find_session(srv, std::string((const char *)data + 8, data[7]));
+        if (!s || s->ended) {
+            server_reply(c, 1, "no such session");
+            return true;
+        }
+        if (s->clients >= MAX_CLIENTS) {
+            server_reply(c, 1, "too many clients");
+            return true;
+        }
+    } else {
+        // Standalone: the one session, whatever the HELLO names
+        if (srv.sessions.empty()) return false;
+        s = srv.sessions[0];
+    }
+    c.sess = s;
+    // A viewer watches at the session's size
+    c.read_only = (hello_flags & HELLO_FLAG_READ_ONLY) != 0;
+    if (!c.read_only) client_set_size(c, data);
+    c.attached = true;
+    s->clients++;
+    session_touch(srv, *s);
+    // Someone is watching again: read output as it comes
+    s->read_at = 0;
+    s->paused = false;
+    session_watch_pty(srv, *s, true);
+    c.compress = (hello_flags & HELLO_FLAG_COMPRESS) != 0;
+    c.display_rate = (hello_flags & HELLO_FLAG_DISPLAY_RATE) != 0;
+    c.echo_ack = (hello_flags & HELLO_FLAG_ECHO_ACK) != 0;
+    c.resume = (hello_flags & HELLO_FLAG_RESUME) != 0;
+    // The new client may change the session's size (before a screen replay
+    // is drawn). If it doesn't, the child isn't disturbed with a SIGWINCH:
+    // the replay shows the screen as it is.
+    bool resizing = false;
+    if (!c.read_only) {
+        resizing = session_update_size(srv, *s);
+        server_sync_echo(srv, *s);
+    }
+
+    // Replay to the new client (unless it asked for a fast attach)
+    int64_t replay_start = now_us();
+    if (!server_replay(srv, c, hello_flags, resume_id, resume_from, resizing)) {
+        c.dead = true;
+        return true;
+    }
+    if (c.out.corked || c.out.frames > 0) {
+        // Nothing but the replay has been sent yet
+        srv.stats.replays++;
+        srv.stats.replay_bytes += (c.replay_stop - c.replay_pos) + c.out.sent + c.out.size();
+        if (c.out.empty() && !c.out.corked) {
+            srv.stats.replay_us += now_us() - replay_start;
+        } else {
+            c.replay_end = c.out.sent + c.out.size();
+            c.replay_start = replay_start;
+        }
+    }
+    server_send_sync(c);
+    // Tells the client that acknowledgements will follow its input. If the
+    // redraw was at another size, they wait for the resize to be applied.
+    c.echo_synced = c.echo_model && c.cols == s->cols && c.rows == s->rows;
+    if (c.echo_synced) server_send_echo_ack(c);
+    return true;
+}
 
-                if (fds[2 + i].revents & POLLIN) {
-                    if (!recv_msg(srv.client_fds[i], &type, &data, &len)) {
-                        server_remove_client(srv, i);
-                        continue;
-                    }
+// MSG_CREATE: [overflow u8, | resize policy << CREATE_RESIZE_SHIFT
+// | CREATE_FLAG_JOURNAL | CREATE_FLAG_PAUSABLE | CREATE_FLAG_IO_THREAD]
+// [scrollback u32]
+// [name len u8][name][cwd len u16][cwd], with CREATE_FLAG_ENV [env len u32]
+// [env: NAME=VALUE entries, each ending in NUL], then [cmd]. The shell starts
+// in cwd with that environment, as it would have had the requesting process
+// forked it.
+static bool server_handle_create(ServerState &srv, ClientConn &c,
+                                 const uint8_t *data, uint32_t len) {
+    if (len < 6) return false;
+    SessionOptions opts;
+    opts.journal = (data[0] & CREATE_FLAG_JOURNAL) != 0;
+    opts.pausable = (data[0] & CREATE_FLAG_PAUSABLE) != 0;
+    opts.io_thread = (data[0] & CREATE_FLAG_IO_THREAD) != 0;
+    bool has_env = (data[0] & CREATE_FLAG_ENV) != 0;
+    uint8_t resize = (data[0] & CREATE_RESIZE_MASK) >> CREATE_RESIZE_SHIFT;
+    uint8_t overflow = data[0] & ~(CREATE_FLAG_JOURNAL | CREATE_FLAG_PAUSABLE |
+                                   CREATE_FLAG_IO_THREAD | CREATE_FLAG_ENV | CREATE_RESIZE_MASK);
+    if (overflow > OVERFLOW_RESYNC || resize > RESIZE_LARGEST) return false;
+    opts.overflow = (OverflowPolicy)overflow;
+    opts.resize = (ResizePolicy)resize;
+    opts.scrollback_size = ((size_t)data[1] << 24) | ((size_t)data[2] << 16) |
+                           ((size_t)data[3] << 8) | data[4];
+    if (opts.scrollback_size < SCROLLBACK_MIN || opts.scrollback_size > SCROLLBACK_MAX ||
+        round_up_pow2(opts.scrollback_size) != opts.scrollback_size)
+        return false;
+    uint32_t pos = 6 + data[5];
+    if (pos + 2 > len) return false;
+    std::string name((const char *)data + 6, data[5]);
+    uint32_t cwd_len = ((uint32_t)data[pos] << 8) | data[pos + 1];
+    pos += 2;
+    if (pos + cwd_len > len) return false;
+    std::string cwd((const char *)data + pos, cwd_len);
+    pos += cwd_len;
+    std::vector<std::string> env;
+    if (has_env) {
+        if (pos + 4 > len) return false;
+        uint32_t env_len = ((uint32_t)data[pos] << 24) | ((uint32_t)data[pos + 1] << 16) |
+                           ((uint32_t)data[pos + 2] << 8) | data[pos + 3];
+        pos += 4;
+        if (env_len > len - pos) return false;
+        for (uint32_t end = pos + env_len; pos < end;) {
+            const uint8_t *nul = (const uint8_t *)memchr(data + pos, 0, end - pos);
+            if (!nul) return false;
+            env.push_back(std::string((const char *)data + pos, nul - (data + pos)));
+            pos = (uint32_t)(nul - data) + 1;
+        }
+    }
+    std::string cmd((const char *)data + pos, len - pos);
 
-                    switch (type) {
-                    case MSG_DATA:
-                        if (len > 0) {
-                            write_all(pty_master, data, len);
-                        }
-                        break;
-                    case MSG_WINCH:
-                        if (len == 4) {
-                            struct winsize ws;
-                            ws.ws_col = ((uint16_t)data[0] << 8) | data[1];
-                            ws.ws_row = ((uint16_t)data[2] << 8) | data[3];
-                            ws.ws_xpixel = 0;
-                            ws.ws_ypixel = 0;
-                            ioctl(pty_master, TIOCSWINSZ, &ws);
-                        }
-                        break;
-                    case MSG_DETACH:
-                        server_remove_client(srv, i);
-                        if (data) free(data);
-                        continue;
-                    default:
-                        break;
-                    }
-                    if (data) free(data);
-                } else {
-                    // POLLHUP/POLLERR
-                    server_remove_client(srv, i);
-                }
+    std::string err;
+    if (!server_start_session(srv, name, cmd, opts, cwd, env, &err))
+        server_reply(c, 1, err);
+    else
+        server_reply(c, 0, "");
+    return true;
+}
+
+// MSG_QUERY reply, straight from memory: one line per session,
+// "name \t pid \t clients \t created \t last activity \t bytes in \t
+// bytes out \t cmd"
+static std::string server_query_text(ServerState &srv) {
+    std::string text;
+    char head[160];
+    for (size_t i = 0; i < srv.sessions.size(); i++) {
+        const Session *s = srv.sessions[i];
+        if (s->ended) continue;
+        snprintf(head, sizeof(head), "\t%d\t%d\t%ld\t%ld\t%llu\t%llu\t", (int)getpid(),
+                 s->clients, (long)s->created, (long)s->last_activity,
+                 (unsigned long long)s->bytes_in, (unsigned long long)s->bytes_out);
+        std::string cmd = s->command;
+        std::replace(cmd.begin(), cmd.end(), '\t', ' ');
+        std::replace(cmd.begin(), cmd.end(), '\n', ' ');
+        text += s->name + head + cmd + "\n";
+    }
+    return text;
+}
+
+// MSG_STATS reply: "key \t value" counter lines for the whole daemon, then
+// "session \t name \t clients \t bytes in \t bytes out" and "client \t fd
+// \t session \t sent \t queued \t frames in \t frames out \t age" lines for
+// session only (every session if NULL)
+static std::string server_stats_text(ServerState &srv, const Session *only) {
+    ServerStats st = srv.stats;
+    for (size_t i = 0; i < srv.sessions.size(); i++)
+        if (srv.sessions[i]->reader) st.reader_stalls += srv.sessions[i]->reader->stall_count();
+    for (int i = 0; i < srv.num_clients; i++) {
+        st.frames_in += srv.clients[i].frames_in;
+        const ClientConn &c = srv.clients[i];
+        st.frames_out += c.out.frames + c.replay.frames;
+        st.bytes_sent += c.out.sent + c.replay.sent;
+    }
+    const struct { const char *key; uint64_t value; } counters[] = {
+        {"pid", (uint64_t)getpid()},
+        {"uptime", (uint64_t)(time(NULL) - st.started)},
+        {"sessions", (uint64_t)srv.sessions.size()},
+        {"clients", (uint64_t)srv.num_clients},
+        {"pty_reads", st.pty_reads},
+        {"pty_bytes", st.pty_bytes},
+        {"frames_in", st.frames_in},
+        {"rx_allocs", g_rx_allocs},
+        {"frames_out", st.frames_out},
+        {"bytes_sent", st.bytes_sent},
+        {"write_stalls", write_stalls},
+        {"write_stall_us", write_stall_us},
+        {"clients_accepted", st.clients_accepted},
+        {"clients_removed", st.clients_removed},
+        {"clients_dropped", st.clients_dropped},
+        {"resyncs", st.resyncs},
+        {"replays", st.replays},
+        {"resumes", st.resumes},
+        {"resizes", st.resizes},
+        {"pauses", st.pauses},
+        {"reader_stalls", st.reader_stalls},
+        {"replay_bytes", st.replay_bytes},
+        {"replay_us", st.replay_us},
+        {"wakeups", st.wakeups},
+        {"max_iteration_us", st.max_iteration_us},
+    };
+    std::string text;
+    char line[256];
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        snprintf(line, sizeof(line), "%s\t%llu\n", counters[i].key,
+                 (unsigned long long)counters[i].value);
+        text += line;
+    }
+    for (size_t i = 0; i < srv.sessions.size(); i++) {
+        const Session *s = srv.sessions[i];
+        if (s->ended || (only && s != only)) continue;
+        snprintf(line, sizeof(line), "session\t%s\t%d\t%llu\t%llu\n", s->name.c_str(),
+                 s->clients, (unsigned long long)s->bytes_in,
+                 (unsigned long long)s->bytes_out);
+        text += line;
+    }
+    int64_t now = now_ms();
+    for (int i = 0; i < srv.num_clients; i++) {
+        const ClientConn &c = srv.clients[i];
+        if (c.dead || !c.attached || !c.sess || (only && c.sess != only)) continue;
+        snprintf(line, sizeof(line), "client\t%d\t%s\t%llu\t%llu\t%llu\t%llu\t%lld\n",
+                 c.fd, c.sess->name.c_str(), (unsigned long long)(c.out.sent + c.replay.sent),
+                 (unsigned long long)(c.out.size() + c.replay.size()), (unsigned long long)c.frames_in,
+                 (unsigned long long)(c.out.frames + c.replay.frames),
+                 (long long)(now - c.connected_at) / 1000);
+        text += line;
+    }
+    return text;
+}
+
+// First frame of a connection: attach (HELLO) or a request. Sessions are
+// only created and killed through the per-UID server.
+static bool server_handle_request(ServerState &srv, ClientConn &c, MsgType type,
+                                  const uint8_t *data, uint32_t len) {
+    switch (type) {
+    case MSG_HELLO:
+        return server_handle_hello(srv, c, data, len);
+    case MSG_QUERY:
+        server_reply(c, 0, server_query_text(srv));
+        return true;
+    case MSG_STATS: {
+        // The per-UID server reports on the session named; a standalone
+        // daemon only has one
+        const Session *s = NULL;
+        if (srv.multi) {
+            s = server_find_session(srv, std::string((const char *)data, len));
+            if (!s || s->ended) {
+                server_reply(c, 1, "no such session");
+                return true;
             }
         }
+        server_reply(c, 0, server_stats_text(srv, s));
+        return true;
+    }
+    case MSG_CREATE:
+        return srv.multi && server_handle_create(srv, c, data, len);
+    case MSG_KILL: {
+        if (!srv.multi) return false;
+        // Answered when the session has been torn down, its child stopped
+        Session *s = server_find_session(srv, std::string((const char *)data, len));
+        if (!s || s->ended) {
+            server_reply(c, 1, "no such session");
+        } else {
+            s->ended = true;
+            c.kill_wait = s;
+        }
+        return true;
     }
+    default:
+        return false;
+    }
+}
 
-    // [FIX #8] Kill child process on shutdown if still alive
-    if (srv.child_pid > 0) {
-        kill(srv.child_pid, SIGHUP);
-        usleep(50000);
-        int wstatus;
-        if (waitpid(srv.child_pid, &wstatus, WNOHANG) == 0) {
-            kill(srv.child_pid, SIGTERM);
-            usleep(100000);
-            if (waitpid(srv.child_pid, &wstatus, WNOHANG) == 0) {
-                kill(srv.child_pid, SIGKILL);
-                waitpid(srv.child_pid, &wstatus, 0);
+static void server_handle_frame(ServerState &srv, ClientConn &c, MsgType type,
+                                const uint8_t *data, uint32_t len) {
+    if (c.closing) return;
+    if (!c.attached) {
+        // The first frame must be a valid HELLO or request — otherwise
+        // reject the client
+        if (!server_handle_request(srv, c, type, data, len)) server_drop_client(srv, c);
+        return;
+    }
+    // A viewer's input and window size never reach the session
+    if (c.read_only && (type == MSG_DATA || type == MSG_WINCH)) return;
+    switch (type) {
+    case MSG_DATA:
+        if (len > 0) {
+            write_all(c.sess->pty_master, data, len);
+            c.sess->bytes_in += len;
+            c.sess->last_activity = time(NULL);
+            c.active_at = now_ms();
+            // The typist's size takes over
+            if (c.sess->opts.resize == RESIZE_LATEST && c.cols &&
+                (c.cols != c.sess->cols || c.rows != c.sess->rows)) {
+                session_update_size(srv, *c.sess);
+                server_sync_echo(srv, *c.sess);
+            }
+            if (c.echo_ack) {
+                c.input_seq++;
+                c.input_at = now_ms();
+            }
+        }
+        break;
+    case MSG_WINCH:
+        if (len == 4) {
+            client_set_size(c, data);
+            // The client stops predicting when its window changes, and
+            // waits for a redraw at the session's new size
+            c.echo_synced = false;
+            session_update_size(srv, *c.sess);
+            server_sync_echo(srv, *c.sess);
+        }
+        break;
+    case MSG_DETACH:
+        c.dead = true;
+        break;
+    case MSG_PING:
+        c.out.push_frame(MSG_PONG, data, len);
+        break;
+    default:
+        break;  // MSG_PONG: arriving at all is the point (see last_rx)
+    }
+}
+
+// Read whatever the client has sent and handle every complete frame
+static void server_read_client(ServerState &srv, ClientConn &c) {
+    ssize_t n = c.in.fill(c.fd);
+    if (n > 0) {
+        c.last_rx = now_ms();
+        c.ping_out = false;
+    }
+    MsgType type;
+    const uint8_t *data;
+    uint32_t len;
+    bool bad;
+    while (!c.dead && c.in.next(&type, &data, &len, &bad)) {
+        c.frames_in++;
+        server_handle_frame(srv, c, type, data, len);
+    }
+    if (bad) server_drop_client(srv, c);
+    else if (n < 0) c.dead = true;
+}
+
+// Accept every pending connection. The HELLO is handled asynchronously
+// like any other frame, so a slow connecting client can't stall the loop.
+// A new client is registered with the event loop right away, and whatever
+// it already sent (usually the HELLO) is read without another wait.
+static void server_accept_clients(ServerState &srv) {
+    for (;;) {
+        int cfd = accept(srv.listen_fd, NULL, NULL);
+        if (cfd < 0) {
+            if (errno == EINTR) continue;
+            return;  // EAGAIN: no more pending connections
+        }
+        if (srv.num_clients >= srv.max_clients || !srv.loop.add(cfd, cfd, false)) {
+            close(cfd);
+            continue;
+        }
+        set_nonblock(cfd);
+        set_cloexec(cfd);
+        server_read_client(srv, server_add_client(srv, cfd));
+    }
+}
+
+// Drop clients that never completed their HELLO, or stalled mid-frame [FIX #5].
+// Clients that negotiated a ping interval are pinged once they have been
+// silent that long, and dropped if still silent after twice that. Input that
+// has gone unanswered for ECHO_ACK_MS is acknowledged.
+static void server_check_timeouts(ServerState &srv) {
+    int64_t now = now_ms();
+    for (int i = 0; i < srv.num_clients; i++) {
+        ClientConn &c = srv.clients[i];
+        if (c.dead) continue;
+        // Runs after this iteration's PTY reads: an echo that is already
+        // there goes out before the acknowledgement
+        if (!c.closing && c.echo_synced && c.acked_seq != c.input_seq &&
+            now - c.input_at >= ECHO_ACK_MS)
+            server_send_echo_ack(c);
+        if (c.closing) {
+            if (now >= c.close_by) c.dead = true;
+        } else if (!c.attached && now - c.connected_at >= HELLO_TIMEOUT_MS) {
+            server_drop_client(srv, c);
+        } else if (c.in.partial_since &&
+                   now - c.in.partial_since >= CLIENT_RECV_TIMEOUT * 1000) {
+            server_drop_client(srv, c);
+        } else if (c.ping_ms && now - c.last_rx >= c.ping_ms) {
+            if (c.ping_out) {
+                if (now - c.last_rx >= 2 * c.ping_ms) server_drop_client(srv, c);
+                continue;
             }
+            uint8_t stamp[8];
+            for (int k = 0; k < 8; k++) stamp[k] = (uint8_t)((uint64_t)now >> (56 - 8 * k));
+            c.out.push_frame(MSG_PING, stamp, sizeof(stamp));
+            c.ping_out = true;
         }
+    }
+}
+
+// PTY output → store in scrollback + queue for all clients. Never waits on
+// a client socket. Keeps reading while reads come back full, so a burst of
+// output becomes one frame per client instead of one per 8KB read.
+// Nobody attached: read a large batch straight into the scrollback, with
+// no frame to build. A child that wrote less than a full read's worth is
+// then not read again for DETACHED_COALESCE_MS. A pausable session is read
+// until output since the last client left would overwrite what it saw
+// last, then not at all (the child blocks) until a client attaches.
+static void server_read_pty_detached(ServerState &srv, Session &s) {
+    size_t batch = DETACHED_READ_BATCH;
+    if (s.opts.pausable) {
+        uint64_t since = s.bytes_out - s.detached_at;
+        batch = (size_t)std::min((uint64_t)batch, s.opts.scrollback_size - std::min(since, (uint64_t)s.opts.scrollback_size));
+    }
+    if (srv.pty_buf.size() < (size_t)DETACHED_READ_BATCH) srv.pty_buf.resize(DETACHED_READ_BATCH);
+    uint8_t *buf = &srv.pty_buf[0];
+    size_t got = 0;
+    bool drained = false;
+    while (got < batch) {
+        ssize_t n = session_read_output(s, buf + got, batch - got);
+        if (n > 0) {
+            got += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0 || (n < 0 && errno != EAGAIN))
+            s.ended = true;
+        drained = true;
+        break;
+    }
+    if (got > 0) {
+        srv.stats.pty_reads++;
+        srv.stats.pty_bytes += got;
+        s.bytes_out += got;
+        s.last_activity = time(NULL);
+        session_record_output(s, buf, got);
+    }
+    if (s.ended) return;
+    if (s.opts.pausable && s.bytes_out - s.detached_at >= s.opts.scrollback_size) {
+        session_watch_pty(srv, s, false);
+        s.paused = true;
+        srv.stats.pauses++;
+    } else if (drained && got < (size_t)BUF_SIZE) {
+        session_watch_pty(srv, s, false);
+        s.read_at = now_ms() + DETACHED_COALESCE_MS;
+    }
+}
+
+// Watch the PTYs again whose coalescing delay is over
+static void server_resume_reads(ServerState &srv) {
+    int64_t now = now_ms();
+    for (size_t i = 0; i < srv.sessions.size(); i++) {
+        Session &s = *srv.sessions[i];
+        if (!s.read_at || now < s.read_at) continue;
+        s.read_at = 0;
+        session_watch_pty(srv, s, true);
+    }
+}
+
+static void server_read_pty(ServerState &srv, Session &s) {
+    if (s.clients == 0) {
+        server_read_pty_detached(srv, s);
+        return;
+    }
+    // Read straight into the DATA frame that all client queues will share
+    OutChunk *frame = out_chunk_new();
+    frame->bytes.resize(5 + PTY_READ_BATCH);
+    uint8_t *buf = &frame->bytes[5];
+    size_t got = 0;
+    while (got < (size_t)PTY_READ_BATCH) {
+        size_t want = PTY_READ_BATCH - got;
+        ssize_t n = session_read_output(s, buf + got, want);
+        if (n > 0) {
+            got += n;
+            if ((size_t)n < want) break;  // drained for now
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        // EOF, or EIO once the child side has hung up
+        if (n == 0 || (n < 0 && errno != EAGAIN))
+            s.ended = true;
+        break;
+    }
+    if (got > 0) {
+        srv.stats.pty_reads++;
+        srv.stats.pty_bytes += got;
+        s.bytes_out += got;
+        s.last_activity = time(NULL);
+        session_record_output(s, buf, got);
+        frame->bytes.resize(5 + got);
+        put_header(&frame->bytes[0], MSG_DATA, (uint32_t)got);
+        server_broadcast(srv, s, frame);
+    }
+    out_chunk_unref(frame);
+}
+
+// Write out journal output whose flush is due, and rotate full segments
+static void server_flush_journals(ServerState &srv) {
+    int64_t now = now_ms();
+    for (size_t i = 0; i < srv.sessions.size(); i++) {
+        Journal &j = srv.sessions[i]->journal;
+        if (j.flush_at && now >= j.flush_at) j.write_due();
+    }
+}
+
+// Collect children that have exited (after SIGCHLD) and end their sessions
+static void server_reap_children(ServerState &srv) {
+    if (!srv.got_sigchld) return;
+    srv.got_sigchld = 0;
+    for (size_t i = 0; i < srv.sessions.size(); i++) {
+        Session *s = srv.sessions[i];
+        // Ended sessions' children are being stopped: session_stop_child()
+        if (s->child_pid <= 0 || s->ended) continue;
+        int wstatus;
+        if (waitpid(s->child_pid, &wstatus, WNOHANG) != s->child_pid) continue;
+        // [FIX #7] Save the exit code
+        if (WIFEXITED(wstatus))
+            s->child_exit_code = WEXITSTATUS(wstatus);
+        else if (WIFSIGNALED(wstatus))
+            s->child_exit_code = 128 + WTERMSIG(wstatus);
+        s->child_pid = -1;  // mark as reaped
+        // With a reader thread, its last output may still be in the ring
+        // or the PTY: the session ends when the read path has taken it all
+        if (s->reader) {
+            s->reader->child_exited();
+            s->read_at = 0;
+            session_watch_pty(srv, *s, true);
+            continue;
+        }
+        // What it wrote last may still be in the PTY, unread this
+        // iteration or waiting out a detached read delay: take all of it
+        for (uint64_t before = ~(uint64_t)0; !s->ended && s->bytes_out != before;) {
+            before = s->bytes_out;
+            server_read_pty(srv, *s);
+        }
+        s->ended = true;
+    }
+}
+
+// [FIX #8] Stop an ended session's child if it is still alive: SIGHUP,
+// then SIGTERM 50ms later, then SIGKILL after another 100ms. Each call sends
+// the signal that is due and never waits, so the loop goes on serving the
+// other sessions meanwhile (server_poll_timeout wakes it for the next
+// step). True once the child is gone.
+static bool session_stop_child(ServerState &srv, Session &s) {
+    static const int sigs[3] = {SIGHUP, SIGTERM, SIGKILL};
+    static const int grace_ms[3] = {50, 100, 0};
+    if (s.child_pid <= 0) return true;
+    int wstatus;
+    if (s.stop_step > 0 && waitpid(s.child_pid, &wstatus, WNOHANG) == s.child_pid) {
         // Capture exit code if not already set
-        if (srv.child_exit_code == 0 && WIFEXITED(wstatus)) {
-            srv.child_exit_code = WEXITSTATUS(wstatus);
+        if (s.child_exit_code == 0 && WIFEXITED(wstatus))
+            s.child_exit_code = WEXITSTATUS(wstatus);
+        s.child_pid = -1;
+        return true;
+    }
+    if (s.stop_step == 0 && s.watching) {
+        // Whatever it writes now would keep the PTY readable for nothing
+        srv.loop.remove(session_output_fd(s));
+        s.watching = false;
+    }
+    int64_t now = now_ms();
+    if (s.stop_step < 3 && now >= s.stop_at) {
+        kill(s.child_pid, sigs[s.stop_step]);
+        s.stop_at = now + grace_ms[s.stop_step];
+        s.stop_step++;
+    }
+    return false;
+}
+
+// Tear down the sessions marked ended whose child has been stopped: tell
+// the clients how it exited, release the PTY and scrollback, answer the
+// MSG_KILL that asked for it. The daemon exits with its last session.
+static void server_end_sessions(ServerState &srv) {
+    std::vector<Session *> ended;
+    for (size_t i = 0; i < srv.sessions.size(); i++) {
+        Session *s = srv.sessions[i];
+        if (s->ended && session_stop_child(srv, *s)) ended.push_back(s);
+    }
+    if (ended.empty()) return;
+
+    for (size_t i = 0; i < ended.size(); i++) {
+        Session *s = ended[i];
+        // [FIX #7] Send EXIT with correct exit code
+        uint8_t ec = (uint8_t)s->child_exit_code;
+        OutChunk *exit_frame = out_chunk_frame(MSG_EXIT, &ec, 1);
+        server_broadcast(srv, *s, exit_frame);
+        out_chunk_unref(exit_frame);
+        for (int k = 0; k < srv.num_clients; k++) {
+            ClientConn &c = srv.clients[k];
+            if (c.kill_wait == s) {
+                c.kill_wait = NULL;
+                if (!c.dead) server_reply(c, 0, "");
+            }
+            if (c.sess != s) continue;
+            c.sess = NULL;
+            client_close_when_sent(c);
+        }
+        if (s->watching) srv.loop.remove(session_output_fd(*s));
+        if (s->reader) {
+            srv.stats.reader_stalls += s->reader->stall_count();
+            s->reader->stop();
+            delete s->reader;
+        }
+        close(s->pty_master);
+        s->scrollback.destroy();
+        s->journal.close();
+        srv.exit_code = s->child_exit_code;
+        srv.sessions.erase(std::find(srv.sessions.begin(), srv.sessions.end(), s));
+        delete s;
+    }
+    if (srv.sessions.empty()) srv.running = false;
+}
+
+// Tell the launching process how startup went: a status byte (0 = ready)
+// followed by the error message, if any. Closes the pipe.
+static void report_ready(int *ready_fd, const std::string &err) {
+    if (*ready_fd < 0) return;
+    std::string msg(1, err.empty() ? '\0' : '\1');
+    msg += err;
+    write_all(*ready_fd, msg.data(), msg.size());
+    close(*ready_fd);
+    *ready_fd = -1;
+}
+
+// The daemon: a standalone one serving session `name` on its own socket, or
+// (multi) the per-UID server on server.ctl, with `name` as its first session.
+// Readiness is reported on ready_fd once the socket listens and the session
+// runs; handoff_fd, if any, is adopted as an already connected client.
+static int run_server(bool multi, const std::string &name, const std::string &cmd,
+                      const SessionOptions &opts, int ready_fd, int handoff_fd) {
+    std::string spath = multi ? server_socket_path() : socket_path(name);
+    // A standalone daemon's pid file goes first: `list` takes a socket that
+    // refuses connections for stale only once that process is gone
+    bool dir_ok = ensure_socket_dir();
+    if (dir_ok && !multi) write_pid_file(pid_path(name), getpid());
+    int listen_fd = dir_ok ? create_listen_socket(spath) : -1;
+    if (listen_fd < 0) {
+        if (dir_ok && !multi) unlink(pid_path(name).c_str());
+        std::string err = "Failed to create socket: " + spath;
+        fprintf(stderr, "%s\n", err.c_str());
+        report_ready(&ready_fd, err);
+        if (handoff_fd >= 0) close(handoff_fd);
+        return 1;
+    }
+    set_nonblock(listen_fd);
+    set_cloexec(listen_fd);
+
+    ServerState srv;
+    srv.multi = multi;
+    srv.listen_fd = listen_fd;
+    srv.wake_pipe[0] = srv.wake_pipe[1] = -1;
+    if (pipe(srv.wake_pipe) == 0) {
+        for (int k = 0; k < 2; k++) {
+            set_nonblock(srv.wake_pipe[k]);
+            set_cloexec(srv.wake_pipe[k]);
+        }
+    }
+    srv.num_clients = 0;
+    srv.max_clients = multi ? MAX_SERVER_CLIENTS : MAX_CLIENTS;
+    raise_fd_limit(srv.max_clients + 64);
+    srv.exit_code = 0;
+    srv.got_sigchld = 0;
+    srv.running = true;
+    g_server = &srv;
+
+    // Before the first fork, so an early child exit is not missed
+    signal(SIGCHLD, server_sigchld);
+    signal(SIGTERM, server_sigterm);
+    signal(SIGHUP, server_sighup);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::string err;
+    if (!srv.loop.init() ||
+        !srv.loop.add(listen_fd, TOKEN_LISTEN, false) ||
+        (srv.wake_pipe[0] >= 0 && !srv.loop.add(srv.wake_pipe[0], TOKEN_WAKE, false))) {
+        err = std::string("event loop: ") + strerror(errno);
+    } else if (!server_start_session(srv, name, cmd, opts, "", std::vector<std::string>(), &err)) {
+        err = "Failed to start session '" + name + "': " + err;
+    }
+    if (!err.empty()) {
+        fprintf(stderr, "%s\n", err.c_str());
+        srv.running = false;
+    }
+
+    // The launcher's end of the socketpair: a client that was connected
+    // before the socket even existed. Adopted before the launcher hears we
+    // are ready, so its HELLO can't arrive first.
+    if (handoff_fd >= 0) {
+        if (srv.running && srv.loop.add(handoff_fd, handoff_fd, false)) {
+            set_nonblock(handoff_fd);
+            set_cloexec(handoff_fd);
+            server_add_client(srv, handoff_fd);
+        } else {
+            close(handoff_fd);
+        }
+    }
+    report_ready(&ready_fd, err);
+
+    // Event loop: every fd stays registered with srv.loop for its lifetime
+    while (srv.running) {
+        // No periodic keepalive: a client that exits or whose connection
+        // drops shows up as hangup/EOF, and hung peers are caught by
+        // negotiated pings. Without client timers, the wait is unbounded.
+        int nev = srv.loop.wait(server_poll_timeout(srv));
+        if (nev < 0 && errno != EINTR) break;
+        int64_t woke = now_us();
+        srv.stats.wakeups++;
+
+        for (int k = 0; k < nev; k++) {
+            const EventLoop::Event &ev = srv.loop.events[k];
+            if (ev.token == TOKEN_WAKE) {
+                char drain[64];
+                while (read(srv.wake_pipe[0], drain, sizeof(drain)) > 0) {}
+            } else if (ev.token == TOKEN_LISTEN) {
+                server_accept_clients(srv);
+            } else if (ev.token <= TOKEN_PTY) {
+                Session *s = server_find_pty(srv, ev.token);
+                if (s && !s->ended && ev.readable) server_read_pty(srv, *s);
+            } else if (ev.readable) {
+                // Client input. Writability needs no handling here: all
+                // pending output is flushed below.
+                ClientConn *c = server_find_client(srv, ev.token);
+                if (c && !c->dead) server_read_client(srv, *c);
+            }
         }
+        server_reap_children(srv);
+        server_end_sessions(srv);
+        server_check_timeouts(srv);
+        server_apply_resizes(srv);
+        server_resume_reads(srv);
+        server_flush_journals(srv);
+
+        // Drain pending output: clients that just became writable, plus
+        // everything queued during this iteration (usually fits right away).
+        // Redraws go first so their unsent tail registers for writability.
+        server_redraw_clients(srv);
+        server_flush_clients(srv);
+        server_reap_clients(srv);
+        srv.stats.max_iteration_us = std::max(srv.stats.max_iteration_us,
+                                              (uint64_t)(now_us() - woke));
     }
 
-    // [FIX #7] Send EXIT with correct exit code
-    uint8_t ec = (uint8_t)srv.child_exit_code;
-    server_broadcast(srv, MSG_EXIT, &ec, 1);
+    // Shutting down (signal or an error): end whatever is still running and
+    // give the final EXITs a moment to go out
+    for (size_t i = 0; i < srv.sessions.size(); i++)
+        srv.sessions[i]->ended = true;
+    for (;;) {
+        server_end_sessions(srv);
+        if (srv.sessions.empty()) break;
+        usleep(10000);
+    }
+    server_drain_clients(srv, 1000);
 
     // Cleanup
     for (int i = 0; i < srv.num_clients; i++)
-        close(srv.client_fds[i]);
+        close(srv.clients[i].fd);
+    srv.loop.destroy();
     close(listen_fd);
-    close(pty_master);
-    delete srv.scrollback;
-    srv.scrollback = NULL;
-    cleanup_session_files(name);
+    if (srv.wake_pipe[0] >= 0) {
+        close(srv.wake_pipe[0]);
+        close(srv.wake_pipe[1]);
+        srv.wake_pipe[0] = srv.wake_pipe[1] = -1;
+    }
+    if (multi) unlink(spath.c_str());
+    else cleanup_session_files(name);
     g_server = NULL;
 
-    return srv.child_exit_code;
+    return srv.exit_code;
+}
+
+// How a daemon ends: _exit, as a fork of the client it must not run the
+// client's exit handlers. The instrumented build of make fast
+// (-DGHOSTLY_PGO_GENERATE) writes out its profile first.
+#if defined(GHOSTLY_PGO_GENERATE)
+extern "C" void __gcov_dump(void);
+#endif
+__attribute__((noreturn)) static void daemon_exit(int rc) {
+#if defined(GHOSTLY_PGO_GENERATE)
+    __gcov_dump();
+#endif
+    _exit(rc);
+}
+
+// Double-fork into a daemon with stdio on /dev/null. Returns 0 in the
+// daemon, which reports its startup on *ready_fd (see report_ready()). The
+// launching process gets 1 as soon as the daemon is ready, or -1 (with the
+// daemon's error printed) if it failed. A daemon that hasn't reported within
+// DAEMON_START_TIMEOUT_MS is killed, so a failed start leaves nothing
+// behind. With handoff, each side also gets one end of a connected
+// socketpair in *handoff: the daemon adopts its end as a client, so the
+// launcher can attach without connecting.
+static int daemonize(int *ready_fd, int *handoff) {
+    int pfd[2];
+    if (pipe(pfd) < 0) { perror("pipe"); return -1; }
+    set_cloexec(pfd[0]);
+    set_cloexec(pfd[1]);
+    int sv[2] = {-1, -1};
+    if (handoff && socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0) {
+        set_cloexec(sv[0]);
+        set_cloexec(sv[1]);
+    }
+
+    pid_t p1 = fork();
+    if (p1 < 0) {
+        perror("fork");
+        close(pfd[0]);
+        close(pfd[1]);
+        if (sv[0] >= 0) { close(sv[0]); close(sv[1]); }
+        return -1;
+    }
+    if (p1 > 0) {
+        // Parent: wait for the daemon's report, after its pid from the
+        // first child. EOF without one means it died on the way.
+        close(pfd[1]);
+        if (sv[1] >= 0) close(sv[1]);
+        waitpid(p1, NULL, 0);
+        std::string msg;
+        int64_t deadline = now_ms() + DAEMON_START_TIMEOUT_MS;
+        for (;;) {
+            int left = (int)(deadline - now_ms());
+            struct pollfd p = {pfd[0], POLLIN, 0};
+            if (left <= 0 || (poll(&p, 1, left) < 0 && errno != EINTR)) break;
+            char buf[256];
+            ssize_t n = read(pfd[0], buf, sizeof(buf));
+            if (n > 0) msg.append(buf, n);
+            else if (n == 0 || errno != EINTR) break;
+        }
+        close(pfd[0]);
+        pid_t daemon_pid = 0;
+        if (msg.size() >= sizeof(daemon_pid)) {
+            memcpy(&daemon_pid, msg.data(), sizeof(daemon_pid));
+            msg.erase(0, sizeof(daemon_pid));
+        }
+        if (msg.empty() && daemon_pid > 0 && process_alive(daemon_pid)) {
+            // Still starting, or hung: not a session anyone can use
+            kill(daemon_pid, SIGKILL);
+            fprintf(stderr, "Session daemon did not start within %ds (killed)\n",
+                    DAEMON_START_TIMEOUT_MS / 1000);
+            if (sv[0] >= 0) close(sv[0]);
+            return -1;
+        }
+        if (msg.empty() || msg[0] != '\0') {
+            if (msg.size() > 1) fprintf(stderr, "%s\n", msg.c_str() + 1);
+            else fprintf(stderr, "Session daemon failed to start\n");
+            if (sv[0] >= 0) close(sv[0]);
+            return -1;
+        }
+        if (handoff) *handoff = sv[0];
+        return 1;
+    }
+
+    // First child
+    close(pfd[0]);
+    if (sv[0] >= 0) close(sv[0]);
+    setsid();
+    pid_t p2 = fork();
+    if (p2 < 0) _exit(1);
+    if (p2 > 0) {
+        write_all(pfd[1], &p2, sizeof(p2));
+        _exit(0);
+    }
+
+    // Daemon: redirect stdio
+    int devnull = open("/dev/null", O_RDWR);
+    if (devnull >= 0) {
+        dup2(devnull, STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        if (devnull > 2) close(devnull);
+    }
+    *ready_fd = pfd[1];
+    if (handoff) *handoff = sv[1];
+    return 0;
+}
+
+// How the launching process reaches a session it just created: its end of
+// the socketpair handed over by a new daemon (-1 if none), and whether the
+// session lives in the per-UID server
+struct Handoff {
+    int fd;
+    bool in_server;
+
+    Handoff() : fd(-1), in_server(false) {}
+};
+
+// Connect to a unix socket; -1 if it's missing or nobody is listening
+static int connect_unix(const std::string &spath) {
+    if (!socket_path_fits(spath)) {
+        fprintf(stderr, "Socket path too long: %s\n", spath.c_str());
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, spath.c_str(), sizeof(addr.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+// One request/reply exchange with the daemon on spath. Returns the REPLY
+// status (0 = ok) with its text in *reply; -1 if nobody is listening
+// (errno from connect), -2 if it didn't answer.
+static int socket_request(const std::string &spath, MsgType type,
+                          const void *data, uint32_t len, std::string *reply) {
+    int fd = connect_unix(spath);
+    if (fd < 0) return -1;
+    // A wedged server shouldn't hang `list`
+    struct timeval tv = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    int status = -2;
+    MsgType rtype;
+    uint8_t *rdata = NULL;
+    uint32_t rlen = 0;
+    if (send_msg(fd, type, data, len) && recv_msg(fd, &rtype, &rdata, &rlen) &&
+        rtype == MSG_REPLY && rlen >= 1) {
+        status = rdata[0];
+        if (reply) reply->assign((const char *)rdata + 1, rlen - 1);
+    }
+    free(rdata);
+    close(fd);
+    return status;
+}
+
+static int server_request(MsgType type, const void *data, uint32_t len, std::string *reply) {
+    return socket_request(server_socket_path(), type, data, len, reply);
+}
+
+static bool server_has_session(const std::string &name) {
+    std::string text;
+    if (server_request(MSG_QUERY, NULL, 0, &text) != 0) return false;
+    std::string prefix = name + "\t";
+    for (size_t pos = 0; pos < text.size();) {
+        if (text.compare(pos, prefix.size(), prefix) == 0) return true;
+        size_t nl = text.find('\n', pos);
+        if (nl == std::string::npos) break;
+        pos = nl + 1;
+    }
+    return false;
+}
+
+// create --server: ask the per-UID server for the session, or become the
+// server (with it as the first session) if none is running
+static int create_in_server(const std::string &name, const std::string &cmd,
+                            const SessionOptions &opts, Handoff *handoff) {
+    if (handoff) handoff->in_server = true;
+    char cwd_buf[4096];
+    std::string cwd = getcwd(cwd_buf, sizeof(cwd_buf)) ? cwd_buf : "";
+    std::string req;
+    req += (char)(opts.overflow | (opts.resize << CREATE_RESIZE_SHIFT) | CREATE_FLAG_ENV |
+                  (opts.journal ? CREATE_FLAG_JOURNAL : 0) | (opts.pausable ? CREATE_FLAG_PAUSABLE : 0) |
+                  (opts.io_thread ? CREATE_FLAG_IO_THREAD : 0));
+    for (int k = 3; k >= 0; k--) req += (char)((opts.scrollback_size >> (8 * k)) & 0xFF);
+    req += (char)name.size();
+    req += name;
+    req += (char)((cwd.size() >> 8) & 0xFF);
+    req += (char)(cwd.size() & 0xFF);
+    req += cwd;
+    // The session gets ours (SSH_AUTH_SOCK, DISPLAY, TERM...), not that of
+    // whoever started the server
+    std::string env;
+    for (char **e = environ; *e; e++) {
+        env += *e;
+        env += '\0';
+    }
+    for (int k = 3; k >= 0; k--) req += (char)((env.size() >> (8 * k)) & 0xFF);
+    req += env;
+    req += cmd;
+
+    // No server yet (or a stale socket left by one that crashed): start it,
+    // one launcher at a time. The others wait for the lock and then find
+    // it, rather than unlinking its socket and starting their own.
+    int lock_fd = -1;
+    for (;;) {
+        std::string reply;
+        int status = server_request(MSG_CREATE, req.data(), (uint32_t)req.size(), &reply);
+        if (status >= 0 || status == -2 || (errno != ENOENT && errno != ECONNREFUSED)) {
+            if (lock_fd >= 0) close(lock_fd);
+            if (status == 0) return 0;
+            if (status > 0)
+                fprintf(stderr, "Cannot create session '%s': %s\n", name.c_str(), reply.c_str());
+            else
+                fprintf(stderr, "Per-UID server is not responding: %s\n", server_socket_path().c_str());
+            return 1;
+        }
+        if (lock_fd >= 0) break;
+        lock_fd = open(server_lock_path().c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        while (lock_fd >= 0 && flock(lock_fd, LOCK_EX) < 0 && errno == EINTR) {}
+        if (lock_fd < 0) {
+            perror("server.lock");
+            return 1;
+        }
+    }
+    unlink(server_socket_path().c_str());
+    int ready_fd = -1;
+    int r = daemonize(&ready_fd, handoff ? &handoff->fd : NULL);
+    // The lock is the launcher's until the server listens (or has failed);
+    // the daemon lets go of the copy it inherited
+    close(lock_fd);
+    if (r != 0) return r < 0 ? 1 : 0;
+    daemon_exit(run_server(true, name, cmd, opts, ready_fd, handoff ? handoff->fd : -1));
 }
 
-static int cmd_create(const std::string &name, const std::string &cmd) {
+// Returns once the session is ready. With handoff, fills it in for an
+// immediate attach (see cmd_open()).
+static int cmd_create(const std::string &name, const std::string &cmd,
+                      const SessionOptions &opts, Handoff *handoff = NULL) {
     // [FIX #1] Validate session name
     if (!valid_session_name(name)) {
         fprintf(stderr, "Invalid session name '%s': use alphanumeric, dash, underscore, dot (max %d chars)\n",
@@ -763,40 +5006,305 @@ static int cmd_create(const std::string &name, const std::string &cmd) {
         // Stale, clean up
         cleanup_session_files(name);
     }
+    if (server_has_session(name)) {
+        fprintf(stderr, "Session '%s' already exists (in the per-UID server)\n", name.c_str());
+        return 1;
+    }
+
+    if (opts.server) return create_in_server(name, cmd, opts, handoff);
+
+    // Daemonize: double-fork
+    int ready_fd = -1;
+    int r = daemonize(&ready_fd, handoff ? &handoff->fd : NULL);
+    if (r != 0) return r < 0 ? 1 : 0;
+    daemon_exit(run_server(false, name, cmd, opts, ready_fd, handoff ? handoff->fd : -1));
+}
+
+// ============================================================================
+// 8. Client: connect, raw mode, poll() loop, detach key, SIGWINCH
+// ============================================================================
+
+// Predicted local echo (attach --predict): never, when the measured round
+// trip to the daemon is slow, or always
+enum PredictMode { PREDICT_NEVER, PREDICT_ADAPTIVE, PREDICT_ALWAYS };
+
+// Client-side settings for attach/open
+struct AttachOptions {
+    uint8_t hello_flags;  // HELLO_FLAG_*
+    int ping_interval;    // seconds, 0 = no pings
+    bool coalesce;        // gather bursts of input (--no-coalesce: off)
+    PredictMode predict;
+    std::string resume;   // --resume POS: "ID:OFFSET", or this terminal's position
+                          // file; empty = replay as usual
+
+    AttachOptions()
+        : hello_flags(0), ping_interval(0), coalesce(true), predict(PREDICT_ADAPTIVE) {}
+};
+
+// Input arriving in a burst (a paste, a held key, a program typing in the
+// terminal) is gathered for up to INPUT_COALESCE_US after each read, so it
+// leaves as a few large DATA frames rather than one per read. A read counts
+// as part of a burst if it follows the previous one within INPUT_BURST_US;
+// the first one after a pause -- a typed key -- goes out at once.
+static const int INPUT_COALESCE_US = 500;
+static const int INPUT_BURST_US = 2000;
+
+// Read more stdin into buf (have bytes so far, room for cap) while it keeps
+// arriving within the coalescing window. Returns the new length.
+static size_t read_input_burst(uint8_t *buf, size_t have, size_t cap, int64_t *last_read) {
+    int64_t now = now_us();
+    bool burst = now - *last_read < INPUT_BURST_US;
+    *last_read = now;
+    if (!burst) return have;
+    while (have < cap) {
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(STDIN_FILENO, &rfds);
+        struct timeval tv = {0, INPUT_COALESCE_US};
+        if (select(STDIN_FILENO + 1, &rfds, NULL, NULL, &tv) <= 0) break;
+        ssize_t n = read(STDIN_FILENO, buf + have, cap - have);
+        if (n <= 0) break;  // EOF/error: the next poll() sees it again
+        have += n;
+    }
+    *last_read = now_us();
+    return have;
+}
+
+// Receive buffer of an attached client: a single read can take in a whole
+// burst of output
+static const size_t ATTACH_RX_BUFFER = 256 * 1024;
+
+// Terminal output received in one wakeup, written to stdout with a single
+// writev() instead of a write per frame
+struct StdoutBatch {
+    static const int MAX_PARTS = 64;
+    // Write out at this size even if more is waiting, to keep input responsive
+    static const size_t MAX_BYTES = 1024 * 1024;
+    struct iovec iov[MAX_PARTS];
+    std::vector<uint8_t> unpacked[MAX_PARTS];  // decompressed DATA_Z payloads, reused
+    int n;
+    size_t bytes;
+
+    StdoutBatch() : n(0), bytes(0) {}
+
+    // One part is kept for add_text() after the frames
+    bool full() const { return n >= MAX_PARTS - 1 || bytes >= MAX_BYTES; }
+
+    // Not copied: a FrameReader payload, valid until its next fill()
+    void add(const uint8_t *data, uint32_t len) {
+        push((void *)data, len);
+    }
+
+    // Where the next DATA_Z payload is decompressed; then add_unpacked()
+    std::vector<uint8_t> &unpack_slot() { return unpacked[n]; }
+
+    void add_unpacked() {
+        push(unpacked[n].data(), unpacked[n].size());
+    }
+
+    // Not copied: text must stay put until write()
+    void add_text(const std::string &text) {
+        push((void *)text.data(), text.size());
+    }
+
+    bool write(int fd) {
+        bool ok = n == 0 || write_allv(fd, iov, n);
+        n = 0;
+        bytes = 0;
+        return ok;
+    }
+
+private:
+    void push(void *data, size_t len) {
+        iov[n].iov_base = data;
+        iov[n].iov_len = len;
+        n++;
+        bytes += len;
+    }
+};
+
+// Adaptive prediction turns on above this smoothed round trip and off again
+// below the lower one (us). It is measured with a tagged PING at most every
+// PREDICT_PROBE_MS, and only while the user is typing.
+static const int64_t PREDICT_RTT_ON_US = 30000;
+static const int64_t PREDICT_RTT_OFF_US = 20000;
+static const int PREDICT_PROBE_MS = 2000;
+static const uint8_t PREDICT_PROBE_TAG = 'E';
+
+// Predicted local echo, so typing over a slow link doesn't wait a round
+// trip per key: printable keys are drawn at once, underlined, and checked
+// against the session's output once it arrives. The client keeps its own
+// Screen model, fed with everything the session sends, to know where the
+// cursor is and what each guessed cell really holds. DATA frames are
+// numbered on both ends (HELLO_FLAG_ECHO_ACK); when the daemon acknowledges
+// a frame its echo is due, so a guess still not on the screen was wrong (a
+// password prompt, a key bound to something else). Wrong and stale guesses
+// are repainted from the model, and a wrong one stops prediction until the
+// next Enter. Nothing is guessed after other input (Enter, arrows, ^C) until
+// it is acknowledged, nor on the alternate screen, mid escape sequence, or
+// in the last column.
+struct LocalEcho {
+    struct Guess {
+        uint32_t seq;  // DATA frame that carried it
+        int x;
+        uint8_t ch;
+    };
+
+    PredictMode mode;
+    VtParser vt;
+    Screen model;
+    bool acks;           // the daemon sends ECHO_ACK
+    uint32_t sent_seq;   // DATA frames sent
+    uint32_t acked_seq;
+    uint32_t barrier;    // nothing is guessed until this frame is acknowledged
+    bool suspended;      // a guess was wrong: none until the next Enter
+    int64_t srtt_us;     // smoothed round trip, -1 = not measured yet
+    bool slow;           // adaptive: srtt is above the threshold
+    int64_t probe_at;    // tagged PING outstanding since (us), 0 = none
+    int64_t last_probe;
+    uint8_t probe[9];
+    std::vector<Guess> guesses;  // drawn, unconfirmed: one row, left to right
+    int guess_y;
+    bool hidden;         // guesses erased, to be redrawn by reconcile()
+
+    void init(PredictMode m, int cols, int rows) {
+        mode = m;
+        model.init(cols, rows);
+        acks = false;
+        sent_seq = acked_seq = barrier = 0;
+        suspended = false;
+        srtt_us = -1;
+        slow = false;
+        probe_at = last_probe = 0;
+        guess_y = 0;
+        hidden = false;
+    }
+
+    bool tracking() const { return mode != PREDICT_NEVER; }
+
+    // Output from the session, as written to the terminal
+    void feed(const uint8_t *p, size_t n) {
+        if (tracking()) vt.feed(p, n, model);
+    }
+
+    bool predicting() const {
+        if (!acks || suspended || (int32_t)(acked_seq - barrier) < 0) return false;
+        if (mode != PREDICT_ALWAYS && !slow) return false;
+        const Grid &g = *model.g;
+        return !model.alt_active() && !model.origin && !model.insert && !model.cursor_hidden &&
+               model.gl == 0 && model.g0 == 'B' && model.u_need == 0 && !vt.in_sequence() &&
+               !g.wrap_pending;
+    }
+
+    // A DATA frame about to be sent. Appends the guesses to draw for it.
+    void on_input(const uint8_t *p, uint32_t n, std::string &draw) {
+        if (!tracking()) return;
+        uint32_t seq = ++sent_seq;
+        const Grid &g = *model.g;
+        bool drew = false;
+        for (uint32_t i = 0; i < n; i++) {
+            uint8_t b = p[i];
+            if (b == '\r' || b == '\n') suspended = false;
+            if (b >= 0x20 && b < 0x7f && predicting()) {
+                if (guesses.empty()) guess_y = g.cy;
+                int x = guesses.empty() ? g.cx : guesses.back().x + 1;
+                if (x < g.cols - 1) {
+                    Guess q = {seq, x, b};
+                    guesses.push_back(q);
+                    if (!drew) draw += "\033[4m";
+                    draw += (char)b;
+                    drew = true;
+                    continue;
+                }
+            }
+            barrier = seq;
+        }
+        if (drew) model.restore_pen(draw);
+    }
+
+    // Before the session's output is written over the guesses: put back
+    // what the model says is under them, and the cursor where it really is
+    void hide(std::string &out) {
+        if (guesses.empty() || hidden) return;
+        model.repaint(out, guess_y, guesses.front().x, guesses.back().x + 1);
+        hidden = true;
+    }
+
+    // An empty ECHO_ACK: the daemon can't vouch for the model (the session
+    // is at another size) until it sends a redraw and acknowledges again
+    void on_ack(const uint8_t *p, uint32_t len) {
+        if (len == 0) acks = false;
+        if (len != 4) return;
+        acks = true;
+        acked_seq = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
 
-    // Daemonize: double-fork
-    pid_t p1 = fork();
-    if (p1 < 0) { perror("fork"); return 1; }
-    if (p1 > 0) {
-        // Parent: wait briefly for socket to appear
-        for (int i = 0; i < 20; i++) {
-            usleep(50000);
-            if (file_exists(spath)) return 0;
+    // After output and acknowledgements have been fed and written: drop the
+    // guesses the session echoed, and wrong or stale ones; redraw the rest
+    void reconcile(std::string &out) {
+        if (guesses.empty()) return;
+        if (!acks) {
+            hide(out);
+            guesses.clear();
+            hidden = false;
+            return;
         }
-        return 0;
+        const Grid &g = *model.g;
+        size_t echoed = 0;
+        if (!model.alt_active() && g.cy == guess_y) {
+            while (echoed < guesses.size() && g.cx > guesses[echoed].x &&
+                   g.row(guess_y)[guesses[echoed].x].cp == guesses[echoed].ch)
+                echoed++;
+        }
+        guesses.erase(guesses.begin(), guesses.begin() + echoed);
+        if (!guesses.empty()) {
+            bool answered = (int32_t)(acked_seq - guesses[0].seq) >= 0;
+            bool moved = model.alt_active() || g.cy != guess_y || g.cx != guesses[0].x;
+            if (answered && !moved) suspended = true;
+            if (answered || moved) {
+                hide(out);
+                guesses.clear();
+            }
+        }
+        if (!guesses.empty() && hidden) {
+            out += "\033[4m";
+            for (size_t i = 0; i < guesses.size(); i++) out += (char)guesses[i].ch;
+            model.restore_pen(out);
+        }
+        hidden = false;
     }
 
-    // First child
-    setsid();
-    pid_t p2 = fork();
-    if (p2 < 0) _exit(1);
-    if (p2 > 0) _exit(0);
-
-    // Daemon: redirect stdio
-    int devnull = open("/dev/null", O_RDWR);
-    if (devnull >= 0) {
-        dup2(devnull, STDIN_FILENO);
-        dup2(devnull, STDOUT_FILENO);
-        dup2(devnull, STDERR_FILENO);
-        if (devnull > 2) close(devnull);
+    void resize(int cols, int rows, std::string &out) {
+        if (!tracking()) return;
+        hide(out);
+        guesses.clear();
+        hidden = false;
+        model.resize(cols, rows);
+        // Until the daemon redraws at the new size
+        acks = false;
     }
 
-    _exit(run_server(name, cmd));
-}
+    // Adaptive mode: a PING payload to measure the round trip with, when one
+    // is due (NULL otherwise)
+    const uint8_t *probe_due() {
+        if (mode != PREDICT_ADAPTIVE) return NULL;
+        int64_t now = now_us();
+        if (last_probe && now - last_probe < (int64_t)PREDICT_PROBE_MS * 1000) return NULL;
+        probe_at = last_probe = now;
+        probe[0] = PREDICT_PROBE_TAG;
+        for (int k = 0; k < 8; k++) probe[1 + k] = (uint8_t)((uint64_t)now >> (56 - 8 * k));
+        return probe;
+    }
 
-// ============================================================================
-// 7. Client: connect, raw mode, poll() loop, detach key, SIGWINCH
-// ============================================================================
+    void on_pong(const uint8_t *p, uint32_t len) {
+        if (len != sizeof(probe) || memcmp(p, probe, len) != 0) return;
+        int64_t rtt = now_us() - probe_at;
+        srtt_us = srtt_us < 0 ? rtt : (7 * srtt_us + rtt) / 8;
+        if (srtt_us > PREDICT_RTT_ON_US) slow = true;
+        else if (srtt_us < PREDICT_RTT_OFF_US) slow = false;
+        probe_at = 0;
+    }
+};
 
 static volatile sig_atomic_t got_winch = 0;
 
@@ -804,41 +5312,114 @@ static void client_sigwinch(int) {
     got_winch = 1;
 }
 
-static void send_window_size(int sock_fd) {
+// The terminal went away (SSH connection lost): leave the loop normally,
+// so state such as the --resume position is saved
+static volatile sig_atomic_t got_hangup = 0;
+
+static void client_sighup(int) {
+    got_hangup = 1;
+}
+
+// attach --resume: how far into the session's output stream this terminal
+// has got. Set by MSG_SYNC and advanced by the output written after it; a
+// batch only counts once it has been written to the terminal. The caller
+// hands it to the next attach of the same terminal, so that one is
+// replayed just the output it missed: as ID:OFFSET, printed on the way
+// out, or in a file of the terminal's own.
+struct StreamPosition {
+    bool known;
+    uint64_t id;       // the session's stream id
+    uint64_t offset;
+    // The batch being received: its last SYNC, and output since then
+    bool batch_sync;
+    uint64_t batch_id, batch_offset;
+    uint64_t batch_bytes;
+
+    StreamPosition() : known(false), id(0), offset(0) { discard(); }
+
+    void on_sync(const uint8_t *p, uint32_t len) {
+        if (len != 16) return;
+        batch_id = batch_offset = 0;
+        for (int k = 0; k < 8; k++) {
+            batch_id = (batch_id << 8) | p[k];
+            batch_offset = (batch_offset << 8) | p[8 + k];
+        }
+        batch_sync = true;
+        batch_bytes = 0;
+    }
+
+    void on_output(size_t n) { batch_bytes += n; }
+
+    // The batch reached the terminal
+    void commit() {
+        if (batch_sync) {
+            known = true;
+            id = batch_id;
+            offset = batch_offset;
+        }
+        if (known) offset += batch_bytes;
+        discard();
+    }
+
+    void discard() {
+        batch_sync = false;
+        batch_id = batch_offset = batch_bytes = 0;
+    }
+
+    // "ID:OFFSET". False if pos isn't one (then it names a file).
+    bool parse(const std::string &pos) {
+        unsigned long long i, o;
+        char end;
+        if (sscanf(pos.c_str(), "%llu:%llu%c", &i, &o, &end) != 2) return false;
+        id = i;
+        offset = o;
+        return true;
+    }
+
+    void load(const std::string &path) {
+        FILE *f = fopen(path.c_str(), "r");
+        if (!f) return;
+        unsigned long long i, o;
+        if (fscanf(f, "%llu %llu", &i, &o) == 2) {
+            // Only sent in the HELLO: counting starts at the daemon's SYNC
+            id = i;
+            offset = o;
+        }
+        fclose(f);
+    }
+
+    // Left alone if no SYNC came: the loaded position still holds
+    void save(const std::string &path) const {
+        if (!known) return;
+        FILE *f = fopen(path.c_str(), "w");
+        if (!f) return;
+        fprintf(f, "%llu %llu\n", (unsigned long long)id, (unsigned long long)offset);
+        fclose(f);
+    }
+};
+
+// Tell the daemon the window's new size, and resize the local screen model
+// along with it (taking down any predicted echo)
+static void queue_window_size(FrameBatch &out, uint8_t buf[4], LocalEcho &echo) {
     struct winsize ws;
     if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) < 0) return;
-    uint8_t buf[4];
     buf[0] = (ws.ws_col >> 8) & 0xFF;
     buf[1] = ws.ws_col & 0xFF;
     buf[2] = (ws.ws_row >> 8) & 0xFF;
     buf[3] = ws.ws_row & 0xFF;
-    send_msg(sock_fd, MSG_WINCH, buf, 4);
+    out.add(MSG_WINCH, buf, 4);
+    std::string fix;
+    echo.resize(ws.ws_col, ws.ws_row, fix);
+    if (!fix.empty()) write_all(STDOUT_FILENO, fix.data(), fix.size());
 }
 
 static int connect_to_session(const std::string &name) {
-    std::string spath = socket_path(name);
-
-    if (!socket_path_fits(spath)) {
-        fprintf(stderr, "Socket path too long: %s\n", spath.c_str());
-        return -1;
-    }
-
-    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (fd < 0) return -1;
-
-    struct sockaddr_un addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, spath.c_str(), sizeof(addr.sun_path) - 1);
-
-    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        close(fd);
-        return -1;
-    }
-    return fd;
+    return connect_unix(socket_path(name));
 }
 
-static int cmd_attach(const std::string &name, bool no_replay = false) {
+// Attach to session name, or to the one just created (see Handoff)
+static int cmd_attach(const std::string &name, const AttachOptions &aopts = AttachOptions(),
+                      const Handoff &handoff = Handoff()) {
     // [FIX #1] Validate session name
     if (!valid_session_name(name)) {
         fprintf(stderr, "Invalid session name '%s'\n", name.c_str());
@@ -848,24 +5429,30 @@ static int cmd_attach(const std::string &name, bool no_replay = false) {
     // [FIX #4] Ignore SIGPIPE so writes to dead socket don't kill us
     signal(SIGPIPE, SIG_IGN);
 
-    // Better error messages for attach failures
-    std::string spath = socket_path(name);
-    if (!file_exists(spath)) {
-        fprintf(stderr, "Session '%s' does not exist.\n", name.c_str());
-        fprintf(stderr, "Use 'ghostly-session open %s' to create it, or 'ghostly-session list' to see active sessions.\n", name.c_str());
-        return 1;
-    }
-    pid_t dpid = read_pid_file(pid_path(name));
-    if (dpid > 0 && !process_alive(dpid)) {
-        fprintf(stderr, "Session '%s' has a stale socket (daemon pid %d is dead). Cleaning up.\n", name.c_str(), (int)dpid);
-        cleanup_session_files(name);
-        return 1;
+    int sock_fd = handoff.fd;
+    bool in_server = handoff.in_server;
+    if (sock_fd < 0 && !in_server) {
+        // Better error messages for attach failures
+        std::string spath = socket_path(name);
+        in_server = !file_exists(spath) && server_has_session(name);
+        if (!in_server && !file_exists(spath)) {
+            fprintf(stderr, "Session '%s' does not exist.\n", name.c_str());
+            fprintf(stderr, "Use 'ghostly-session open %s' to create it, or 'ghostly-session list' to see active sessions.\n", name.c_str());
+            return 1;
+        }
+        pid_t dpid = in_server ? 0 : read_pid_file(pid_path(name));
+        if (dpid > 0 && !process_alive(dpid)) {
+            fprintf(stderr, "Session '%s' has a stale socket (daemon pid %d is dead). Cleaning up.\n", name.c_str(), (int)dpid);
+            cleanup_session_files(name);
+            return 1;
+        }
     }
-
-    int sock_fd = connect_to_session(name);
     if (sock_fd < 0) {
-        fprintf(stderr, "Cannot connect to session '%s': socket exists but connection refused.\n", name.c_str());
-        return 1;
+        sock_fd = in_server ? connect_unix(server_socket_path()) : connect_to_session(name);
+        if (sock_fd < 0) {
+            fprintf(stderr, "Cannot connect to session '%s': socket exists but connection refused.\n", name.c_str());
+            return 1;
+        }
     }
 
     // Send HELLO with window size + optional flags byte
@@ -875,13 +5462,49 @@ static int cmd_attach(const std::string &name, bool no_replay = false) {
         ws.ws_col = 80;
         ws.ws_row = 24;
     }
-    uint8_t hello[5];
+    // The ping interval bytes are only sent when pings are wanted: daemons
+    // older than PING reject a HELLO longer than 5 bytes. The per-UID
+    // server also needs the session name, and --resume adds the stream
+    // position after it.
+    uint8_t hello[8 + MAX_NAME_LEN + 16];
+    uint32_t hello_len = aopts.ping_interval > 0 ? 7 : 5;
     hello[0] = (ws.ws_col >> 8) & 0xFF;
     hello[1] = ws.ws_col & 0xFF;
     hello[2] = (ws.ws_row >> 8) & 0xFF;
     hello[3] = ws.ws_row & 0xFF;
-    hello[4] = no_replay ? HELLO_FLAG_NO_REPLAY : 0;
-    if (!send_msg(sock_fd, MSG_HELLO, hello, 5)) {
+    // A viewer sends nothing but the detach key: no input to predict, and
+    // its window size is not the session's. Without a full replay the
+    // screen model would start out blank, not as the session's screen.
+    bool read_only = (aopts.hello_flags & HELLO_FLAG_READ_ONLY) != 0;
+    bool partial = (aopts.hello_flags & HELLO_FLAG_NO_REPLAY) || !aopts.resume.empty();
+    LocalEcho echo;
+    echo.init(read_only || partial ? PREDICT_NEVER : aopts.predict, ws.ws_col, ws.ws_row);
+    hello[4] = aopts.hello_flags | (echo.tracking() ? HELLO_FLAG_ECHO_ACK : 0);
+    hello[5] = (aopts.ping_interval >> 8) & 0xFF;
+    hello[6] = aopts.ping_interval & 0xFF;
+    if (in_server) {
+        hello[7] = (uint8_t)name.size();
+        memcpy(hello + 8, name.data(), name.size());
+        hello_len = 8 + (uint32_t)name.size();
+    }
+    StreamPosition pos;
+    bool resume_file = false;
+    if (!aopts.resume.empty()) {
+        hello[4] |= HELLO_FLAG_RESUME;
+        if (!in_server) {
+            hello[7] = 0;
+            hello_len = 8;
+        }
+        // A file that doesn't exist yet: no position, the usual replay
+        resume_file = !pos.parse(aopts.resume);
+        if (resume_file) pos.load(aopts.resume);
+        for (int k = 0; k < 8; k++) {
+            hello[hello_len + k] = (uint8_t)(pos.id >> (56 - 8 * k));
+            hello[hello_len + 8 + k] = (uint8_t)(pos.offset >> (56 - 8 * k));
+        }
+        hello_len += 16;
+    }
+    if (!send_msg(sock_fd, MSG_HELLO, hello, hello_len)) {
         fprintf(stderr, "Failed to send HELLO to session '%s'\n", name.c_str());
         close(sock_fd);
         return 1;
@@ -891,9 +5514,31 @@ static int cmd_attach(const std::string &name, bool no_replay = false) {
     atexit(atexit_restore);
     term_raw();
     signal(SIGWINCH, client_sigwinch);
+    signal(SIGHUP, client_sighup);
 
     int exit_code = 0;
     bool running = true;
+    bool ended = false;  // the session exited
+
+    // Frames produced in one iteration (WINCH, DATA, DETACH) go out together
+    FrameBatch out;
+    uint8_t winch_buf[4];
+    uint8_t buf[BUF_SIZE];
+    bool detached = false;
+    int64_t last_input = 0;
+    StdoutBatch screen;
+    // The daemon's frames are parsed where they were read: nothing is
+    // allocated per frame
+    FrameReader rx;
+    rx.reset();
+    rx.buf.resize(ATTACH_RX_BUFFER);
+    std::string typed;        // predicted echo of the input just sent
+    std::string unhide, fix;  // LocalEcho repairs around a batch of output
+    // Liveness, mirroring the server: ping a daemon we haven't heard from for
+    // a ping interval, give up after two
+    int ping_ms = aopts.ping_interval * 1000;
+    int64_t last_rx = now_ms();
+    bool ping_out = false;
 
     while (running) {
         struct pollfd fds[2];
@@ -902,12 +5547,18 @@ static int cmd_attach(const std::string &name, bool no_replay = false) {
         fds[1].fd = sock_fd;
         fds[1].events = POLLIN;
 
-        int ret = poll(fds, 2, 500);
+        // Sleep until input, output or a signal, unless a ping timer is due
+        int timeout = -1;
+        if (ping_ms > 0)
+            timeout = (int)std::max((int64_t)0, last_rx + (ping_out ? 2 : 1) * ping_ms - now_ms());
+        int ret = poll(fds, 2, timeout);
+        if (got_hangup) break;
         if (ret < 0) {
             if (errno == EINTR) {
                 if (got_winch) {
                     got_winch = 0;
-                    send_window_size(sock_fd);
+                    if (!read_only) queue_window_size(out, winch_buf, echo);
+                    if (!out.send(sock_fd)) running = false;
                 }
                 continue;
             }
@@ -917,31 +5568,40 @@ static int cmd_attach(const std::string &name, bool no_replay = false) {
         // Handle SIGWINCH between polls
         if (got_winch) {
             got_winch = 0;
-            send_window_size(sock_fd);
+            if (!read_only) queue_window_size(out, winch_buf, echo);
+        }
+
+        if (ping_ms > 0 && now_ms() - last_rx >= ping_ms) {
+            if (ping_out && now_ms() - last_rx >= 2 * ping_ms) {
+                term_restore();
+                fprintf(stderr, "\r\n[session '%s' not responding, disconnecting]\r\n", name.c_str());
+                exit_code = 1;
+                break;
+            }
+            if (!ping_out) {
+                out.add(MSG_PING, NULL, 0);
+                ping_out = true;
+            }
         }
 
         // Stdin → server
         if (fds[0].revents & POLLIN) {
-            uint8_t buf[BUF_SIZE];
             ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
             if (n > 0) {
-                // Check for detach key
-                bool detached = false;
-                for (ssize_t i = 0; i < n; i++) {
-                    if (buf[i] == DETACH_KEY) {
-                        send_msg(sock_fd, MSG_DETACH, NULL, 0);
-                        running = false;
-                        detached = true;
-                        // Restore before printing
-                        term_restore();
-                        fprintf(stderr, "\r\n[detached from '%s']\r\n", name.c_str());
-                        break;
-                    }
+                if (aopts.coalesce) n = read_input_burst(buf, n, sizeof(buf), &last_input);
+                // Whatever was typed before the detach key still goes out
+                const uint8_t *key = (const uint8_t *)memchr(buf, DETACH_KEY, n);
+                uint32_t fwd = key ? (uint32_t)(key - buf) : (uint32_t)n;
+                if (fwd > 0 && !read_only) {
+                    out.add(MSG_DATA, buf, fwd);
+                    echo.on_input(buf, fwd, typed);
+                    const uint8_t *probe = echo.probe_due();
+                    if (probe) out.add(MSG_PING, probe, sizeof(echo.probe));
                 }
-                if (!detached && running) {
-                    if (!send_msg(sock_fd, MSG_DATA, buf, (uint32_t)n)) {
-                        running = false;
-                    }
+                if (key) {
+                    out.add(MSG_DETACH, NULL, 0);
+                    running = false;
+                    detached = true;
                 }
             } else if (n == 0) {
                 running = false;
@@ -957,34 +5617,113 @@ static int cmd_attach(const std::string &name, bool no_replay = false) {
             running = false;
         }
 
-        // Server → stdout
-        if (running && (fds[1].revents & POLLIN)) {
-            MsgType type;
-            uint8_t *data = NULL;
-            uint32_t len = 0;
+        // Everything queued above leaves in one writev()
+        if (!out.empty() && !out.send(sock_fd)) running = false;
+        if (!typed.empty()) {
+            if (!detached) write_all(STDOUT_FILENO, typed.data(), typed.size());
+            typed.clear();
+        }
+        if (detached) {
+            // Restore before printing
+            term_restore();
+            fprintf(stderr, "\r\n[detached from '%s']\r\n", name.c_str());
+            break;
+        }
 
-            if (!recv_msg(sock_fd, &type, &data, &len)) {
-                running = false;
-                continue;
+        // Server → stdout: whatever one read brought, parsed in place and
+        // written out in one writev() per StdoutBatch
+        if (running && (fds[1].revents & POLLIN)) {
+            ssize_t got = rx.fill(sock_fd);
+            if (got > 0) {
+                last_rx = now_ms();
+                ping_out = false;
             }
-
-            switch (type) {
-            case MSG_DATA:
-                if (len > 0) {
-                    if (!write_all(STDOUT_FILENO, data, len)) {
-                        // Stdout broken (SSH pipe closed)
+            bool refused = false;
+            std::string reason;
+            bool more = true;
+            while (running && more) {
+                more = false;
+                unhide.clear();
+                fix.clear();
+                echo.hide(unhide);
+                if (!unhide.empty()) screen.add_text(unhide);
+                MsgType type;
+                const uint8_t *data;
+                uint32_t len;
+                bool bad;
+                while (running && rx.next(&type, &data, &len, &bad)) {
+                    switch (type) {
+                    case MSG_DATA:
+                        if (len > 0) {
+                            echo.feed(data, len);
+                            pos.on_output(len);
+                            screen.add(data, len);
+                        }
+                        break;
+                    case MSG_DATA_Z: {
+                        std::vector<uint8_t> &unpacked = screen.unpack_slot();
+                        if (!decompress_data(data, len, unpacked)) {
+                            fprintf(stderr, "\r\n[corrupt compressed frame from '%s']\r\n", name.c_str());
+                            running = false;
+                        } else {
+                            if (!unpacked.empty()) echo.feed(&unpacked[0], unpacked.size());
+                            pos.on_output(unpacked.size());
+                            screen.add_unpacked();
+                        }
+                        break;
+                    }
+                    case MSG_ECHO_ACK:
+                        echo.on_ack(data, len);
+                        break;
+                    case MSG_PONG:
+                        echo.on_pong(data, len);
+                        break;
+                    case MSG_EXIT:
+                        if (len >= 1) exit_code = data[0];
+                        ended = true;
                         running = false;
+                        break;
+                    case MSG_SYNC:
+                        pos.on_sync(data, len);
+                        break;
+                    case MSG_REPLY:
+                        // The server turned the attach down (the session just ended)
+                        refused = true;
+                        if (len > 1) reason.assign((const char *)data + 1, len - 1);
+                        exit_code = 1;
+                        running = false;
+                        break;
+                    case MSG_PING:
+                        // Answer right away (not batched: out was sent above)
+                        if (!send_msg(sock_fd, MSG_PONG, data, len)) running = false;
+                        break;
+                    default:
+                        break;
+                    }
+                    // The rest of what arrived goes in the next batch
+                    if (screen.full()) {
+                        more = true;
+                        break;
                     }
                 }
-                break;
-            case MSG_EXIT:
-                if (len >= 1) exit_code = data[0];
-                running = false;
-                break;
-            default:
-                break;
+                if (bad) running = false;
+                echo.reconcile(fix);
+                if (!fix.empty()) screen.add_text(fix);
+
+                // Stdout broken (SSH pipe closed)
+                if (screen.write(STDOUT_FILENO)) {
+                    pos.commit();
+                } else {
+                    pos.discard();
+                    running = false;
+                }
+            }
+            // EOF or error, once every frame that came before it is out
+            if (got < 0) running = false;
+            if (refused) {
+                term_restore();
+                fprintf(stderr, "\r\n[cannot attach to '%s': %s]\r\n", name.c_str(), reason.c_str());
             }
-            if (data) free(data);
         }
         if (fds[1].revents & (POLLHUP | POLLERR)) {
             running = false;
@@ -993,15 +5732,22 @@ static int cmd_attach(const std::string &name, bool no_replay = false) {
 
     term_restore();
     close(sock_fd);
+    if (resume_file) {
+        if (ended) unlink(aopts.resume.c_str());
+        else pos.save(aopts.resume);
+    } else if (!aopts.resume.empty() && !ended && pos.known) {
+        fprintf(stderr, "[resume with --resume %llu:%llu]\n", (unsigned long long)pos.id,
+                (unsigned long long)pos.offset);
+    }
     return exit_code;
 }
 
 // ============================================================================
-// 8. open command: create-or-attach
+// 9. open command: create-or-attach
 // ============================================================================
 
 static int cmd_open(const std::string &name, const std::string &cmd,
-                    bool no_replay = false) {
+                    const SessionOptions &opts, const AttachOptions &aopts = AttachOptions()) {
     // [FIX #1] Validate session name
     if (!valid_session_name(name)) {
         fprintf(stderr, "Invalid session name '%s': use alphanumeric, dash, underscore, dot (max %d chars)\n",
@@ -1014,22 +5760,183 @@ static int cmd_open(const std::string &name, const std::string &cmd,
     if (file_exists(spath)) {
         pid_t pid = read_pid_file(pid_path(name));
         if (pid > 0 && process_alive(pid)) {
-            return cmd_attach(name, no_replay);
+            return cmd_attach(name, aopts);
         }
         // Stale
         cleanup_session_files(name);
     }
+    if (server_has_session(name)) return cmd_attach(name, aopts);
 
-    // Create and then attach
-    int rc = cmd_create(name, cmd);
+    // Create and then attach: cmd_create returns once the daemon is ready,
+    // usually with a connection to it already in hand
+    Handoff handoff;
+    int rc = cmd_create(name, cmd, opts, &handoff);
     if (rc != 0) return rc;
-    // Small delay for daemon startup
-    usleep(100000);
-    return cmd_attach(name, no_replay);
+    return cmd_attach(name, aopts, handoff);
+}
+
+// ============================================================================
+// 10. mux command: many sessions over one stdin/stdout stream
+// ============================================================================
+
+// Channels one mux can carry at once
+static const size_t MAX_MUX_CHANNELS = 256;
+
+// One attached session of a mux
+struct MuxChannel {
+    uint16_t id;
+    int fd;          // connection to the session's daemon, -1 once closed
+    FrameReader in;
+};
+
+// Connect ch to session name and attach with hello, the HELLO payload as
+// for a session's own socket. A session without one is looked for in the
+// per-UID server, whose HELLO also names it (if it isn't there either, the
+// server's REPLY says so).
+static bool mux_open(MuxChannel &ch, const std::string &name, const uint8_t *hello, uint32_t len) {
+    if (len < 4) return false;
+    std::string spath = socket_path(name);
+    bool in_server = !file_exists(spath);
+    ch.fd = connect_unix(in_server ? server_socket_path() : spath);
+    if (ch.fd < 0) return false;
+    set_cloexec(ch.fd);
+    if (!in_server) return send_msg(ch.fd, MSG_HELLO, hello, len);
+    // [cols rows][flags][ping u16], the name, then what followed the
+    // (empty) name in the original: the resume position
+    uint8_t msg[8 + MAX_NAME_LEN + 16];
+    memset(msg, 0, 7);
+    memcpy(msg, hello, std::min(len, (uint32_t)7));
+    msg[7] = (uint8_t)name.size();
+    memcpy(msg + 8, name.data(), name.size());
+    uint32_t n = 8 + (uint32_t)name.size();
+    uint32_t rest = len >= 8 ? 8 + hello[7] : len;
+    if (rest < len) {
+        uint32_t extra = std::min(len - rest, (uint32_t)16);
+        memcpy(msg + n, hello + rest, extra);
+        n += extra;
+    }
+    return send_msg(ch.fd, MSG_HELLO, msg, n);
+}
+
+// Queue a frame for the mux client, sending the batch first if it is full
+static bool mux_queue(FrameBatch &out, uint16_t id, MsgType type, const void *data, uint32_t len) {
+    if (out.full() && !out.send(STDOUT_FILENO)) return false;
+    out.add_mux(id, type, data, len);
+    return true;
+}
+
+// mux: attach to any number of sessions over stdin/stdout, so a client
+// needs one SSH channel per host rather than an `attach` (and a connection)
+// per session. Every frame is the session protocol's own, wrapped in a
+// MSG_MUX frame with its channel. The client opens a channel by sending a
+// HELLO on it as [name len u8][name][HELLO payload]; after that frames
+// pass through both ways unchanged. When a session's connection closes
+// (after DETACH, EXIT or a refusal), mux sends DETACH on its channel, and
+// the id can be used again.
+static int cmd_mux() {
+    signal(SIGPIPE, SIG_IGN);
+    static const char refused[] = "\1cannot connect to the session";
+    FrameReader ctl;  // the client's frames, from stdin
+    ctl.reset();
+    std::vector<MuxChannel> chans;
+    std::vector<struct pollfd> fds;
+    FrameBatch out;   // to the client
+    bool ok = true;
+
+    while (ok) {
+        fds.resize(1 + chans.size());
+        fds[0].fd = STDIN_FILENO;
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < chans.size(); i++) {
+            fds[1 + i].fd = chans[i].fd;
+            fds[1 + i].events = POLLIN;
+        }
+        if (poll(&fds[0], fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        // Sessions -> client. Payloads point into each channel's reader,
+        // so closed channels are only dropped once the batch is out.
+        for (size_t i = 0; ok && i < chans.size(); i++) {
+            if (!(fds[1 + i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            MuxChannel &ch = chans[i];
+            ssize_t n = ch.in.fill(ch.fd);
+            MsgType type;
+            const uint8_t *data;
+            uint32_t len;
+            bool bad = false;
+            while (ok && ch.in.next(&type, &data, &len, &bad))
+                ok = mux_queue(out, ch.id, type, data, len);
+            if (ok && (n < 0 || bad)) {
+                ok = mux_queue(out, ch.id, MSG_DETACH, NULL, 0);
+                close(ch.fd);
+                ch.fd = -1;
+            }
+        }
+        if (ok && !out.empty()) ok = out.send(STDOUT_FILENO);
+        for (size_t i = chans.size(); i-- > 0;) {
+            if (chans[i].fd >= 0) continue;
+            std::swap(chans[i], chans.back());
+            chans.pop_back();
+        }
+
+        // Client -> sessions
+        if (ok && (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            ssize_t n = ctl.fill(STDIN_FILENO);
+            MsgType type;
+            const uint8_t *data;
+            uint32_t len;
+            bool bad = false;
+            while (ok && ctl.next(&type, &data, &len, &bad)) {
+                if (type != MSG_MUX || len < 3) {
+                    bad = true;
+                    break;
+                }
+                uint16_t id = ((uint16_t)data[0] << 8) | data[1];
+                MsgType inner = (MsgType)data[2];
+                const uint8_t *p = data + 3;
+                uint32_t plen = len - 3;
+                MuxChannel *ch = NULL;
+                for (size_t i = 0; i < chans.size() && !ch; i++)
+                    if (chans[i].id == id) ch = &chans[i];
+                if (ch) {
+                    // A failed write shows up as EOF on the read side
+                    send_msg(ch->fd, inner, p, plen);
+                } else if (inner == MSG_HELLO) {
+                    MuxChannel c;
+                    c.id = id;
+                    c.fd = -1;
+                    c.in.reset();
+                    std::string name;
+                    if (plen >= 1 && 1 + (uint32_t)p[0] <= plen) name.assign((const char *)p + 1, p[0]);
+                    if (chans.size() < MAX_MUX_CHANNELS && valid_session_name(name) &&
+                        mux_open(c, name, p + 1 + p[0], plen - 1 - p[0])) {
+                        chans.push_back(c);
+                    } else {
+                        if (c.fd >= 0) close(c.fd);
+                        ok = mux_queue(out, id, MSG_REPLY, refused, sizeof(refused) - 1) &&
+                             mux_queue(out, id, MSG_DETACH, NULL, 0);
+                    }
+                }
+                // Anything else for a channel that isn't open: dropped
+            }
+            if (bad || n < 0) break;  // protocol violation, or the client left
+        }
+        if (ok && !out.empty()) ok = out.send(STDOUT_FILENO);
+    }
+
+    // Detach from every session still attached, as `attach` would
+    for (size_t i = 0; i < chans.size(); i++) {
+        if (chans[i].fd < 0) continue;
+        send_msg(chans[i].fd, MSG_DETACH, NULL, 0);
+        close(chans[i].fd);
+    }
+    return 0;
 }
 
 // ============================================================================
-// 9. list command: enumerate sockets, stale detection, JSON output
+// 11. list command: enumerate sockets, stale detection, JSON output
 // ============================================================================
 
 struct SessionInfo {
@@ -1037,18 +5944,124 @@ struct SessionInfo {
     pid_t pid;
     int clients;
     time_t created;
+    time_t last_activity;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
     std::string command;
-    bool alive;
+    bool in_server;  // hosted by the per-UID server
+};
+
+// Parse a QUERY reply: "name \t pid \t clients \t created \t last activity
+// \t bytes in \t bytes out \t cmd" per line
+static void parse_query_reply(const std::string &text, bool in_server,
+                              std::vector<SessionInfo> &out) {
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t nl = text.find('\n', pos);
+        if (nl == std::string::npos) nl = text.size();
+        std::string line = text.substr(pos, nl - pos);
+        pos = nl + 1;
+        std::vector<std::string> f;
+        size_t start = 0;
+        for (int k = 0; k < 7; k++) {
+            size_t tab = line.find('\t', start);
+            if (tab == std::string::npos) break;
+            f.push_back(line.substr(start, tab - start));
+            start = tab + 1;
+        }
+        if (f.size() != 7 || !valid_session_name(f[0])) continue;
+        SessionInfo si;
+        si.name = f[0];
+        si.pid = (pid_t)atoi(f[1].c_str());
+        si.clients = atoi(f[2].c_str());
+        si.created = (time_t)atol(f[3].c_str());
+        si.last_activity = (time_t)atol(f[4].c_str());
+        si.bytes_in = strtoull(f[5].c_str(), NULL, 10);
+        si.bytes_out = strtoull(f[6].c_str(), NULL, 10);
+        si.command = line.substr(start);
+        si.in_server = in_server;
+        out.push_back(si);
+    }
+}
+
+// A daemon from before QUERY drops the request; its pid and info files
+// still describe it
+static SessionInfo legacy_session_info(const std::string &name) {
+    SessionInfo si;
+    si.name = name;
+    si.pid = read_pid_file(pid_path(name));
+    si.clients = 0;
+    si.created = 0;
+    si.last_activity = 0;
+    si.bytes_in = 0;
+    si.bytes_out = 0;
+    si.command = "bash";
+    si.in_server = false;
+    FILE *f = fopen(info_path(name).c_str(), "r");
+    if (f) {
+        char line[512];
+        while (fgets(line, sizeof(line), f)) {
+            if (strncmp(line, "clients=", 8) == 0)
+                si.clients = atoi(line + 8);
+            else if (strncmp(line, "created=", 8) == 0)
+                si.created = (time_t)atol(line + 8);
+            else if (strncmp(line, "cmd=", 4) == 0) {
+                si.command = line + 4;
+                // trim newline
+                while (!si.command.empty() && (si.command.back() == '\n' || si.command.back() == '\r'))
+                    si.command.pop_back();
+            }
+        }
+        fclose(f);
+    }
+    return si;
+}
+
+// A QUERY sent to one daemon, waiting for its REPLY (enumerate_sessions)
+struct PendingQuery {
+    std::string name;  // standalone session; empty for the per-UID server
+    int fd;
+    std::string in;    // the reply frame as received so far
+    bool done;         // EOF, error, or the whole frame is in
+
+    // The REPLY text if it came in whole and with status 0
+    bool reply(std::string *text) const {
+        if (in.size() < 6 || (uint8_t)in[0] != MSG_REPLY || in[5] != 0) return false;
+        text->assign(in, 6, std::string::npos);
+        return true;
+    }
 };
 
+// Receive what has arrived for q; marks it done at EOF or once the frame
+// announced by the header is complete
+static void pending_query_read(PendingQuery &q) {
+    char buf[16384];
+    for (;;) {
+        ssize_t n = read(q.fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return;
+        if (n <= 0) break;
+        q.in.append(buf, n);
+        if (q.in.size() < 5) continue;
+        uint32_t len = ((uint32_t)(uint8_t)q.in[1] << 24) | ((uint32_t)(uint8_t)q.in[2] << 16) |
+                       ((uint32_t)(uint8_t)q.in[3] << 8) | (uint8_t)q.in[4];
+        if (len > MAX_FRAME_LEN || q.in.size() >= 5 + (size_t)len) break;
+    }
+    q.done = true;
+}
+
+// Every live session: a QUERY to each standalone socket found in the socket
+// directory, and one for all sessions of the per-UID server. They are all
+// sent first and answered in parallel, so a wedged daemon holds the listing
+// up by LIST_QUERY_TIMEOUT_MS in all, not by a timeout each. A socket nobody
+// listens on is stale and cleaned up, unless the daemon in its pid file is
+// alive: that one has bound its socket but is still starting.
 static std::vector<SessionInfo> enumerate_sessions() {
     std::vector<SessionInfo> result;
-    std::string dir = socket_dir();
-    DIR *d = opendir(dir.c_str());
-    if (!d) return result;
-
+    std::vector<PendingQuery> queries;
+    DIR *d = opendir(socket_dir().c_str());
     struct dirent *ent;
-    while ((ent = readdir(d)) != NULL) {
+    while (d && (ent = readdir(d)) != NULL) {
         std::string fname = ent->d_name;
         // Look for .sock files
         size_t pos = fname.rfind(".sock");
@@ -1059,42 +6072,63 @@ static std::vector<SessionInfo> enumerate_sessions() {
         // Skip invalid names (shouldn't exist, but be safe)
         if (!valid_session_name(name)) continue;
 
-        SessionInfo si;
-        si.name = name;
-        si.pid = read_pid_file(pid_path(name));
-        si.clients = 0;
-        si.created = 0;
-        si.command = "bash";
-        si.alive = (si.pid > 0 && process_alive(si.pid));
-
-        // Parse info file
-        FILE *f = fopen(info_path(name).c_str(), "r");
-        if (f) {
-            char line[512];
-            while (fgets(line, sizeof(line), f)) {
-                if (strncmp(line, "clients=", 8) == 0)
-                    si.clients = atoi(line + 8);
-                else if (strncmp(line, "created=", 8) == 0)
-                    si.created = (time_t)atol(line + 8);
-                else if (strncmp(line, "cmd=", 4) == 0) {
-                    si.command = line + 4;
-                    // trim newline
-                    while (!si.command.empty() && (si.command.back() == '\n' || si.command.back() == '\r'))
-                        si.command.pop_back();
-                }
-            }
-            fclose(f);
+        PendingQuery q;
+        q.name = name;
+        q.fd = connect_unix(socket_path(name));
+        q.done = false;
+        if (q.fd >= 0 && send_msg(q.fd, MSG_QUERY, NULL, 0)) {
+            set_nonblock(q.fd);
+            queries.push_back(q);
+            continue;
         }
+        int err = errno;
+        if (q.fd >= 0) close(q.fd);
+        pid_t pid = read_pid_file(pid_path(name));
+        if ((err == ECONNREFUSED || err == ENOENT) && !(pid > 0 && process_alive(pid)))
+            cleanup_session_files(name);  // auto-clean stale session
+        else
+            result.push_back(legacy_session_info(name));
+    }
+    if (d) closedir(d);
+    PendingQuery sq;
+    sq.fd = connect_unix(server_socket_path());
+    sq.done = false;
+    if (sq.fd >= 0 && send_msg(sq.fd, MSG_QUERY, NULL, 0)) {
+        set_nonblock(sq.fd);
+        queries.push_back(sq);
+    } else if (sq.fd >= 0) {
+        close(sq.fd);
+    }
 
-        if (!si.alive) {
-            // Auto-clean stale session
-            cleanup_session_files(name);
-            continue;
+    int64_t deadline = now_ms() + LIST_QUERY_TIMEOUT_MS;
+    std::vector<struct pollfd> pfds;
+    std::vector<size_t> waiting;
+    for (;;) {
+        pfds.clear();
+        waiting.clear();
+        for (size_t i = 0; i < queries.size(); i++) {
+            if (queries[i].done) continue;
+            struct pollfd p = {queries[i].fd, POLLIN, 0};
+            pfds.push_back(p);
+            waiting.push_back(i);
         }
+        int left = (int)(deadline - now_ms());
+        if (pfds.empty() || left <= 0) break;
+        int n = poll(&pfds[0], pfds.size(), left);
+        if (n < 0 && errno != EINTR) break;
+        for (size_t k = 0; n > 0 && k < pfds.size(); k++)
+            if (pfds[k].revents) pending_query_read(queries[waiting[k]]);
+    }
 
-        result.push_back(si);
+    for (size_t i = 0; i < queries.size(); i++) {
+        const PendingQuery &q = queries[i];
+        close(q.fd);
+        std::string text;
+        if (q.reply(&text))
+            parse_query_reply(text, q.name.empty(), result);
+        else if (!q.name.empty())
+            result.push_back(legacy_session_info(q.name));  // from before QUERY, or wedged
     }
-    closedir(d);
     return result;
 }
 
@@ -1130,24 +6164,33 @@ static std::string format_time(time_t t) {
     return buf;
 }
 
+static std::string session_json(const SessionInfo &s, time_t now) {
+    long uptime = (s.created > 0) ? (long)(now - s.created) : 0;
+    char head[256], tail[256];
+    snprintf(head, sizeof(head), "\",\"clients\":%d,\"created\":%ld,\"uptime\":%ld,\"command\":\"",
+             s.clients, (long)s.created, uptime);
+    snprintf(tail, sizeof(tail), "\",\"pid\":%d,\"server\":%s,"
+             "\"last_activity\":%ld,\"bytes_in\":%llu,\"bytes_out\":%llu}",
+             (int)s.pid, s.in_server ? "true" : "false", (long)s.last_activity,
+             (unsigned long long)s.bytes_in, (unsigned long long)s.bytes_out);
+    return "{\"name\":\"" + json_escape(s.name) + head + json_escape(s.command) + tail;
+}
+
+static void print_sessions_json(const std::vector<SessionInfo> &sessions, time_t now) {
+    printf("{\"sessions\":[");
+    for (size_t i = 0; i < sessions.size(); i++) {
+        if (i > 0) printf(",");
+        printf("%s", session_json(sessions[i], now).c_str());
+    }
+    printf("]}\n");
+}
+
 static int cmd_list(bool json) {
     auto sessions = enumerate_sessions();
     time_t now = time(NULL);
 
     if (json) {
-        printf("{\"sessions\":[");
-        for (size_t i = 0; i < sessions.size(); i++) {
-            if (i > 0) printf(",");
-            long uptime = (sessions[i].created > 0) ? (long)(now - sessions[i].created) : 0;
-            printf("{\"name\":\"%s\",\"clients\":%d,\"created\":%ld,\"uptime\":%ld,\"command\":\"%s\",\"pid\":%d}",
-                   json_escape(sessions[i].name).c_str(),
-                   sessions[i].clients,
-                   (long)sessions[i].created,
-                   uptime,
-                   json_escape(sessions[i].command).c_str(),
-                   (int)sessions[i].pid);
-        }
-        printf("]}\n");
+        print_sessions_json(sessions, now);
     } else {
         if (sessions.empty()) {
             printf("No active sessions.\n");
@@ -1165,27 +6208,170 @@ static int cmd_list(bool json) {
     return 0;
 }
 
-// ============================================================================
-// 10. info command: system info (load, disk, conda, SLURM)
-// ============================================================================
+// Changes in the socket dir that may concern sessions: a socket created,
+// removed or touched (session_touch). fd is pollable; -1 where there is no
+// notification, and list --watch falls back to its interval.
+struct DirWatch {
+    int fd;
+#ifdef GHOSTLY_DIR_KQUEUE
+    int dir_fd;
+#endif
 
-static int cmd_info(bool json) {
-    // User
-    const char *user = getenv("USER");
-    if (!user) user = "unknown";
+    DirWatch() : fd(-1) {
+#ifdef GHOSTLY_DIR_KQUEUE
+        dir_fd = -1;
+#endif
+    }
+
+    ~DirWatch() {
+        if (fd >= 0) close(fd);
+#ifdef GHOSTLY_DIR_KQUEUE
+        if (dir_fd >= 0) close(dir_fd);
+#endif
+    }
+
+    bool open(const std::string &dir) {
+#if defined(GHOSTLY_INOTIFY)
+        fd = inotify_init();
+        if (fd < 0) return false;
+        set_nonblock(fd);
+        set_cloexec(fd);
+        if (inotify_add_watch(fd, dir.c_str(), IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+            close(fd);
+            fd = -1;
+        }
+#elif defined(GHOSTLY_DIR_KQUEUE)
+        // Entries added or removed only: kqueue doesn't report a touched
+        // socket, so client counts are picked up by the interval
+        dir_fd = ::open(dir.c_str(), O_RDONLY);
+        fd = kqueue();
+        if (dir_fd >= 0 && fd >= 0) {
+            set_cloexec(dir_fd);
+            set_cloexec(fd);
+            struct kevent ev;
+            EV_SET(&ev, dir_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0, NULL);
+            if (kevent(fd, &ev, 1, NULL, 0, NULL) == 0) return true;
+        }
+        if (fd >= 0) close(fd);
+        fd = -1;
+#else
+        (void)dir;
+#endif
+        return fd >= 0;
+    }
+
+    // Read what has been reported; true if any of it is about a session
+    bool drain() {
+        bool relevant = false;
+#if defined(GHOSTLY_INOTIFY)
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + n;) {
+                const struct inotify_event *ev = (const struct inotify_event *)p;
+                p += sizeof(struct inotify_event) + ev->len;
+                // info.cache and scrollback files change too
+                size_t len = ev->len ? strlen(ev->name) : 0;
+                if ((ev->mask & IN_Q_OVERFLOW) || (len > 5 && strcmp(ev->name + len - 5, ".sock") == 0) ||
+                    strcmp(ev->len ? ev->name : "", "server.ctl") == 0)
+                    relevant = true;
+            }
+        }
+#elif defined(GHOSTLY_DIR_KQUEUE)
+        struct kevent ev;
+        struct timespec zero = {0, 0};
+        while (kevent(fd, NULL, 0, &ev, 1, &zero) > 0) relevant = true;
+#endif
+        return relevant;
+    }
+};
+
+static bool same_session(const SessionInfo &a, const SessionInfo &b) {
+    return a.name == b.name && a.pid == b.pid && a.in_server == b.in_server;
+}
+
+// One JSON line per difference between two listings: a session added (in
+// full, as in list --json), removed, or with a new client count
+static bool print_session_deltas(const std::vector<SessionInfo> &old_list,
+                                 const std::vector<SessionInfo> &new_list, time_t now) {
+    std::string text;
+    for (size_t i = 0; i < old_list.size(); i++) {
+        bool kept = false;
+        for (size_t k = 0; k < new_list.size() && !kept; k++) kept = same_session(old_list[i], new_list[k]);
+        if (!kept) text += "{\"event\":\"removed\",\"name\":\"" + json_escape(old_list[i].name) + "\"}\n";
+    }
+    for (size_t k = 0; k < new_list.size(); k++) {
+        const SessionInfo *was = NULL;
+        for (size_t i = 0; i < old_list.size() && !was; i++)
+            if (same_session(old_list[i], new_list[k])) was = &old_list[i];
+        if (!was) {
+            text += "{\"event\":\"added\",\"session\":" + session_json(new_list[k], now) + "}\n";
+        } else if (was->clients != new_list[k].clients) {
+            char tail[32];
+            snprintf(tail, sizeof(tail), "\",\"clients\":%d}\n", new_list[k].clients);
+            text += "{\"event\":\"changed\",\"name\":\"" + json_escape(new_list[k].name) + tail;
+        }
+    }
+    if (text.empty()) return true;
+    return fwrite(text.data(), 1, text.size(), stdout) == text.size() && fflush(stdout) == 0;
+}
+
+// list --watch: the list --json object now, then a line per session that
+// appears, disappears or changes client count, until stdout goes away. The
+// socket dir is watched (daemons touch their socket when clients come and
+// go), so an idle host costs nothing between changes; everything is also
+// listed again every interval seconds.
+static int cmd_list_watch(int interval) {
+    signal(SIGPIPE, SIG_IGN);
+    ensure_socket_dir();
+    DirWatch watch;
+    watch.open(socket_dir());
+    std::vector<SessionInfo> last = enumerate_sessions();
+    print_sessions_json(last, time(NULL));
+    if (fflush(stdout) != 0) return 0;
+
+    int64_t rescan_at = now_ms() + interval * 1000LL;
+    int64_t settle_at = 0;  // a change was reported: list again then
+    for (;;) {
+        int64_t due = settle_at ? std::min(settle_at, rescan_at) : rescan_at;
+        int timeout = (int)std::max((int64_t)0, due - now_ms());
+        // Sleep, but notice the reader hanging up even when nothing changes
+        struct pollfd pfd[2] = {{STDOUT_FILENO, 0, 0}, {watch.fd, POLLIN, 0}};
+        int n = poll(pfd, watch.fd >= 0 ? 2 : 1, timeout);
+        if (n > 0 && (pfd[0].revents & (POLLERR | POLLHUP))) return 0;
+        if (n > 0 && watch.fd >= 0 && (pfd[1].revents & POLLIN) && watch.drain() && !settle_at)
+            settle_at = now_ms() + LIST_WATCH_SETTLE_MS;
+        int64_t now = now_ms();
+        if ((settle_at && now >= settle_at) || now >= rescan_at) {
+            std::vector<SessionInfo> cur = enumerate_sessions();
+            if (!print_session_deltas(last, cur, time(NULL))) return 0;
+            last.swap(cur);
+            settle_at = 0;
+            rescan_at = now + interval * 1000LL;
+        }
+    }
+}
+
+// ============================================================================
+// 12. info command: system info (load, disk, conda, SLURM)
+// ============================================================================
 
-    // Conda
-    const char *conda = getenv("CONDA_DEFAULT_ENV");
-    if (!conda) conda = "none";
+// Probes that are cheap (load, conda) are read on every call. Disk usage and
+// the SLURM job count are cached in the socket dir, each with its own TTL:
+// squeue can take seconds on a loaded slurmctld, so a stale value is served
+// immediately and refreshed by a detached child for the next caller.
 
-    // Load average
+static std::string probe_load() {
     double loadavg[3] = {0, 0, 0};
     char load_str[64] = "N/A";
     if (getloadavg(loadavg, 3) >= 1) {
         snprintf(load_str, sizeof(load_str), "%.2f", loadavg[0]);
     }
+    return load_str;
+}
 
-    // Disk usage of home dir
+// Disk usage of home dir
+static std::string probe_disk() {
     char disk_str[64] = "N/A";
 #ifdef __APPLE__
     struct statfs sfs;
@@ -1210,70 +6396,242 @@ static int cmd_info(bool json) {
         }
     }
 #endif
+    return disk_str;
+}
 
-    // [FIX #9] SLURM jobs — avoid shell injection from $USER
+// [FIX #9] SLURM jobs — avoid shell injection from $USER
+static std::string probe_slurm(const char *user) {
     char slurm_str[64] = "N/A";
-    {
-        // Build command safely: check for squeue, use getenv directly
-        const char *slurm_user = user; // already from getenv("USER")
-        // Validate user string doesn't contain shell metacharacters
-        bool user_safe = true;
-        for (const char *p = slurm_user; *p; p++) {
-            char c = *p;
-            if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
-                  (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.')) {
-                user_safe = false;
-                break;
-            }
+    // Validate user string doesn't contain shell metacharacters
+    for (const char *p = user; *p; p++) {
+        char c = *p;
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+              (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.'))
+            return slurm_str;
+    }
+    char squeue_cmd[256];
+    snprintf(squeue_cmd, sizeof(squeue_cmd),
+             "command -v squeue >/dev/null 2>&1 && squeue -u '%s' -h 2>/dev/null | wc -l",
+             user);
+    FILE *fp = popen(squeue_cmd, "r");
+    if (fp) {
+        char buf[64];
+        if (fgets(buf, sizeof(buf), fp)) {
+            char *p = buf;
+            while (*p == ' ') p++;
+            char *end = p + strlen(p) - 1;
+            while (end > p && (*end == '\n' || *end == ' ')) *end-- = '\0';
+            if (*p) snprintf(slurm_str, sizeof(slurm_str), "%s", p);
         }
-        if (user_safe) {
-            char squeue_cmd[256];
-            snprintf(squeue_cmd, sizeof(squeue_cmd),
-                     "command -v squeue >/dev/null 2>&1 && squeue -u '%s' -h 2>/dev/null | wc -l",
-                     slurm_user);
-            FILE *fp = popen(squeue_cmd, "r");
-            if (fp) {
-                char buf[64];
-                if (fgets(buf, sizeof(buf), fp)) {
-                    char *p = buf;
-                    while (*p == ' ') p++;
-                    char *end = p + strlen(p) - 1;
-                    while (end > p && (*end == '\n' || *end == ' ')) *end-- = '\0';
-                    if (*p) snprintf(slurm_str, sizeof(slurm_str), "%s", p);
-                }
-                pclose(fp);
+        pclose(fp);
+    }
+    return slurm_str;
+}
+
+// Cached probe results, in <socket dir>/info.cache as "key updated value"
+// lines. updated = 0: never probed.
+struct InfoCache {
+    std::string disk;
+    time_t disk_at;
+    std::string slurm;
+    time_t slurm_at;
+
+    InfoCache() : disk_at(0), slurm_at(0) {}
+
+    static std::string path() { return socket_dir() + "/info.cache"; }
+
+    void load() {
+        FILE *f = fopen(path().c_str(), "r");
+        if (!f) return;
+        char line[256], key[32], value[128];
+        long at;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "%31s %ld %127s", key, &at, value) != 3) continue;
+            if (strcmp(key, "disk") == 0) { disk = value; disk_at = at; }
+            else if (strcmp(key, "slurm") == 0) { slurm = value; slurm_at = at; }
+        }
+        fclose(f);
+    }
+
+    // Readers never see a partial file: write a temporary, then rename
+    void save() const {
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), ".%ld", (long)getpid());
+        std::string tmp = path() + suffix;
+        FILE *f = fopen(tmp.c_str(), "w");
+        if (!f) return;
+        if (disk_at) fprintf(f, "disk %ld %s\n", (long)disk_at, disk.c_str());
+        if (slurm_at) fprintf(f, "slurm %ld %s\n", (long)slurm_at, slurm.c_str());
+        if (fclose(f) == 0) rename(tmp.c_str(), path().c_str());
+        else unlink(tmp.c_str());
+    }
+
+    bool disk_stale(time_t now) const { return now - disk_at >= INFO_DISK_TTL; }
+    bool slurm_stale(time_t now) const { return now - slurm_at >= INFO_SLURM_TTL; }
+};
+
+// Refresh the stale probes in a detached child, so the caller can answer
+// from the cache right away. A lock file keeps concurrent callers from
+// starting one refresher each.
+static void info_refresh_async(const char *user) {
+    std::string lock = socket_dir() + "/info.lock";
+    int fd = open(lock.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        // Lock held; take it over only if its refresher is long gone
+        struct stat st;
+        if (stat(lock.c_str(), &st) != 0 || time(NULL) - st.st_mtime < INFO_REFRESH_LOCK_MAX)
+            return;
+        unlink(lock.c_str());
+        fd = open(lock.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) return;
+    }
+    close(fd);
+
+    pid_t p1 = fork();
+    if (p1 < 0) {
+        unlink(lock.c_str());
+        return;
+    }
+    if (p1 > 0) {
+        waitpid(p1, NULL, 0);
+        return;
+    }
+    // Double-fork so nobody has to wait for the probe
+    setsid();
+    if (fork() != 0) _exit(0);
+    int devnull = open("/dev/null", O_RDWR);
+    if (devnull >= 0) {
+        dup2(devnull, STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        if (devnull > 2) close(devnull);
+    }
+    InfoCache cache;
+    cache.load();
+    time_t now = time(NULL);
+    if (cache.disk_stale(now)) {
+        cache.disk = probe_disk();
+        cache.disk_at = time(NULL);
+    }
+    if (cache.slurm_stale(now)) {
+        cache.slurm = probe_slurm(user);
+        cache.slurm_at = time(NULL);
+    }
+    cache.save();
+    unlink(lock.c_str());
+    _exit(0);
+}
+
+struct SystemInfo {
+    std::string user;
+    std::string conda;
+    std::string load;
+    std::string disk;
+    std::string slurm;
+    time_t slurm_at;  // when the SLURM count was probed
+    int sessions;
+};
+
+// Gather system info. Cached values are used while fresh, and served stale
+// (with a refresh started in the background) after that. Only a cold cache
+// makes the caller wait for the probes.
+static void collect_info(SystemInfo &si) {
+    const char *user = getenv("USER");
+    if (!user) user = "unknown";
+    const char *conda = getenv("CONDA_DEFAULT_ENV");
+    if (!conda) conda = "none";
+    si.user = user;
+    si.conda = conda;
+    si.load = probe_load();
+
+    InfoCache cache;
+    if (ensure_socket_dir()) {
+        cache.load();
+        time_t now = time(NULL);
+        bool cold = !cache.disk_at || !cache.slurm_at;
+        if (cold) {
+            if (!cache.disk_at) {
+                cache.disk = probe_disk();
+                cache.disk_at = now;
+            }
+            if (!cache.slurm_at) {
+                cache.slurm = probe_slurm(user);
+                cache.slurm_at = time(NULL);
             }
+            cache.save();
+        } else if (cache.disk_stale(now) || cache.slurm_stale(now)) {
+            info_refresh_async(user);
         }
+    } else {
+        cache.disk = probe_disk();
+        cache.slurm = probe_slurm(user);
+        cache.slurm_at = time(NULL);
     }
+    si.disk = cache.disk;
+    si.slurm = cache.slurm;
+    si.slurm_at = cache.slurm_at;
 
     // Session count
-    auto sessions = enumerate_sessions();
-    int session_count = (int)sessions.size();
+    si.sessions = (int)enumerate_sessions().size();
+}
+
+static std::string info_json(const SystemInfo &si) {
+    char buf[1024];
+    snprintf(buf, sizeof(buf),
+             "{\"user\":\"%s\",\"conda\":\"%s\",\"load\":\"%s\",\"disk\":\"%s\","
+             "\"slurm_jobs\":\"%s\",\"slurm_updated\":%ld,\"sessions\":%d,\"backend\":\"ghostly\"}",
+             json_escape(si.user).c_str(),
+             json_escape(si.conda).c_str(),
+             json_escape(si.load).c_str(),
+             json_escape(si.disk).c_str(),
+             json_escape(si.slurm).c_str(),
+             (long)si.slurm_at,
+             si.sessions);
+    return buf;
+}
+
+static int cmd_info(bool json) {
+    SystemInfo si;
+    collect_info(si);
 
     if (json) {
-        printf("{\"user\":\"%s\",\"conda\":\"%s\",\"load\":\"%s\",\"disk\":\"%s\","
-               "\"slurm_jobs\":\"%s\",\"sessions\":%d,\"backend\":\"ghostly\"}\n",
-               json_escape(user).c_str(),
-               json_escape(conda).c_str(),
-               json_escape(load_str).c_str(),
-               json_escape(disk_str).c_str(),
-               json_escape(slurm_str).c_str(),
-               session_count);
+        printf("%s\n", info_json(si).c_str());
     } else {
         // KEY:VALUE format for backward compatibility
-        printf("USER:%s\n", user);
-        printf("CONDA:%s\n", conda);
-        printf("LOAD:%s\n", load_str);
-        printf("DISK:%s\n", disk_str);
-        printf("JOBS:%s\n", slurm_str);
+        printf("USER:%s\n", si.user.c_str());
+        printf("CONDA:%s\n", si.conda.c_str());
+        printf("LOAD:%s\n", si.load.c_str());
+        printf("DISK:%s\n", si.disk.c_str());
+        printf("JOBS:%s\n", si.slurm.c_str());
         printf("MUX:ghostly\n");
-        printf("SESSIONS:%d\n", session_count);
+        printf("SESSIONS:%d\n", si.sessions);
     }
     return 0;
 }
 
+// info --watch: one JSON line now, then another whenever a value changes
+// (checked every interval seconds), until stdout goes away. One long-lived
+// SSH channel instead of an exec per refresh.
+static int cmd_info_watch(int interval) {
+    signal(SIGPIPE, SIG_IGN);
+    std::string last;
+    for (;;) {
+        SystemInfo si;
+        collect_info(si);
+        std::string line = info_json(si);
+        if (line != last) {
+            if (printf("%s\n", line.c_str()) < 0 || fflush(stdout) != 0) return 0;
+            last = line;
+        }
+        // Sleep, but notice the reader hanging up even when nothing changes
+        struct pollfd pfd = {STDOUT_FILENO, 0, 0};
+        if (poll(&pfd, 1, interval * 1000) > 0 && (pfd.revents & (POLLERR | POLLHUP)))
+            return 0;
+    }
+}
+
 // ============================================================================
-// 11. kill command
+// 13. kill command
 // ============================================================================
 
 static int cmd_kill(const std::string &name) {
@@ -1285,6 +6643,12 @@ static int cmd_kill(const std::string &name) {
 
     pid_t pid = read_pid_file(pid_path(name));
     if (pid <= 0 || !process_alive(pid)) {
+        // Not standalone: maybe a session of the per-UID server. It stops
+        // the child before replying.
+        if (server_request(MSG_KILL, name.data(), (uint32_t)name.size(), NULL) == 0) {
+            printf("Session '%s' killed.\n", name.c_str());
+            return 0;
+        }
         // Try to clean stale files anyway
         cleanup_session_files(name);
         fprintf(stderr, "Session '%s' not found or already dead.\n", name.c_str());
@@ -1311,7 +6675,526 @@ static int cmd_kill(const std::string &name) {
 }
 
 // ============================================================================
-// 12. Argument parsing & main
+// 14. stats command: the daemon's counters, over its socket
+// ============================================================================
+
+static std::vector<std::string> split_tabs(const std::string &line) {
+    std::vector<std::string> f;
+    size_t start = 0;
+    for (;;) {
+        size_t tab = line.find('\t', start);
+        f.push_back(line.substr(start, tab == std::string::npos ? std::string::npos : tab - start));
+        if (tab == std::string::npos) return f;
+        start = tab + 1;
+    }
+}
+
+static int cmd_stats(const std::string &name, bool json) {
+    if (!valid_session_name(name)) {
+        fprintf(stderr, "Invalid session name '%s'\n", name.c_str());
+        return 1;
+    }
+    std::string spath = socket_path(name);
+    bool in_server = !file_exists(spath);
+    std::string reply;
+    int st = socket_request(in_server ? server_socket_path() : spath, MSG_STATS,
+                            name.data(), (uint32_t)name.size(), &reply);
+    if (st == -1 || (st == 1 && in_server)) {
+        fprintf(stderr, "Session '%s' does not exist.\n", name.c_str());
+        return 1;
+    }
+    if (st != 0) {
+        fprintf(stderr, "Session '%s' did not answer (daemon older than stats?)\n", name.c_str());
+        return 1;
+    }
+
+    // Counters are "key \t value"; sessions and clients have their own lines
+    std::vector<std::vector<std::string> > counters, sessions, clients;
+    size_t pos = 0;
+    while (pos < reply.size()) {
+        size_t nl = reply.find('\n', pos);
+        if (nl == std::string::npos) nl = reply.size();
+        std::vector<std::string> f = split_tabs(reply.substr(pos, nl - pos));
+        pos = nl + 1;
+        if (f[0] == "session" && f.size() == 5) sessions.push_back(f);
+        else if (f[0] == "client" && f.size() == 8) clients.push_back(f);
+        else if (f.size() == 2) counters.push_back(f);
+    }
+
+    if (json) {
+        std::string out = "{\"name\":\"" + json_escape(name) + "\",\"server\":" +
+                          (in_server ? "true" : "false") + ",\"counters\":{";
+        for (size_t i = 0; i < counters.size(); i++) {
+            if (i) out += ",";
+            out += "\"" + json_escape(counters[i][0]) + "\":" + counters[i][1];
+        }
+        out += "},\"sessions\":[";
+        for (size_t i = 0; i < sessions.size(); i++) {
+            const std::vector<std::string> &f = sessions[i];
+            if (i) out += ",";
+            out += "{\"name\":\"" + json_escape(f[1]) + "\",\"clients\":" + f[2] +
+                   ",\"bytes_in\":" + f[3] + ",\"bytes_out\":" + f[4] + "}";
+        }
+        out += "],\"clients\":[";
+        for (size_t i = 0; i < clients.size(); i++) {
+            const std::vector<std::string> &f = clients[i];
+            if (i) out += ",";
+            out += "{\"fd\":" + f[1] + ",\"session\":\"" + json_escape(f[2]) +
+                   "\",\"bytes_sent\":" + f[3] + ",\"queued\":" + f[4] +
+                   ",\"frames_in\":" + f[5] + ",\"frames_out\":" + f[6] +
+                   ",\"connected\":" + f[7] + "}";
+        }
+        out += "]}";
+        printf("%s\n", out.c_str());
+        return 0;
+    }
+
+    printf("Session '%s'%s\n", name.c_str(), in_server ? " (per-UID server)" : "");
+    for (size_t i = 0; i < counters.size(); i++)
+        printf("  %-18s %s\n", counters[i][0].c_str(), counters[i][1].c_str());
+    for (size_t i = 0; i < sessions.size(); i++) {
+        const std::vector<std::string> &f = sessions[i];
+        printf("  %-18s clients %s, bytes in %s, bytes out %s\n", ("session " + f[1]).c_str(),
+               f[2].c_str(), f[3].c_str(), f[4].c_str());
+    }
+    if (!clients.empty()) {
+        printf("Clients:\n");
+        printf("  %-5s %14s %10s %10s %10s %8s\n", "fd", "bytes sent", "queued",
+               "frames in", "frames out", "age");
+        for (size_t i = 0; i < clients.size(); i++) {
+            const std::vector<std::string> &f = clients[i];
+            printf("  %-5s %14s %10s %10s %10s %7ss\n", f[1].c_str(), f[3].c_str(),
+                   f[4].c_str(), f[5].c_str(), f[6].c_str(), f[7].c_str());
+        }
+    }
+    return 0;
+}
+
+// ============================================================================
+// 15. log command: read a session's journal, no daemon needed
+// ============================================================================
+
+// --since: a Unix time, "YYYY-MM-DD[ HH:MM[:SS]]" (local time), or an age
+// with a unit: 90s, 15m, 2h, 1d
+static bool parse_since(const char *s, time_t *out) {
+    char *end = NULL;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (errno == 0 && end != s && v >= 0) {
+        int unit = 0;
+        if (*end == '\0') {
+            *out = (time_t)v;
+            return true;
+        }
+        if (end[1] == '\0') {
+            switch (*end) {
+            case 's': unit = 1; break;
+            case 'm': unit = 60; break;
+            case 'h': unit = 3600; break;
+            case 'd': unit = 86400; break;
+            default: break;
+            }
+        }
+        if (unit) {
+            *out = time(NULL) - (time_t)(v * unit);
+            return true;
+        }
+    }
+    static const char *formats[] = {"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d"};
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *rest = strptime(s, formats[i], &tm);
+        if (rest && *rest == '\0') {
+            tm.tm_isdst = -1;
+            *out = mktime(&tm);
+            return true;
+        }
+    }
+    return false;
+}
+
+// VtParser handler: the text of journaled output, escape sequences dropped,
+// printed line by line (only lines matching re, if set). A carriage return
+// followed by more text starts the line over, as on the terminal, so a
+// progress bar leaves its last state.
+struct LogText {
+    static const bool wants_text = true;
+    static const size_t MAX_LINE = 64 * 1024;
+    const regex_t *re;
+    std::string line;
+    bool cr;  // carriage return since the last text
+
+    explicit LogText(const regex_t *r) : re(r), cr(false) {}
+
+    void on_print(const uint8_t *p, size_t n) {
+        if (cr) line.clear();
+        cr = false;
+        if (line.size() < MAX_LINE) line.append((const char *)p, std::min(n, MAX_LINE - line.size()));
+    }
+    void on_execute(uint8_t c) {
+        if (c == '\n') end_line();
+        else if (c == '\r') cr = true;
+        else if (c == '\t') on_print(&c, 1);
+        else if (c == '\b' && !line.empty()) line.erase(line.size() - 1);
+    }
+    void on_esc(const VtParser &, uint8_t) {}
+    void on_csi(const VtParser &, uint8_t) {}
+    void on_modes(const VtParser &, const VtModes &, size_t, size_t, bool) {}
+
+    void end_line() {
+        if (!re || regexec(re, line.c_str(), 0, NULL, 0) == 0) {
+            fwrite(line.data(), 1, line.size(), stdout);
+            fputc('\n', stdout);
+        }
+        line.clear();
+        cr = false;
+    }
+};
+
+// Print the journal of session name from the first output at or after
+// since (0 = all of it): as text, or (raw) the bytes as they were written
+static int cmd_log(const std::string &name, time_t since, const char *pattern, bool raw) {
+    if (!valid_session_name(name)) {
+        fprintf(stderr, "Invalid session name '%s'\n", name.c_str());
+        return 1;
+    }
+    std::string dir = journal_dir(name);
+    std::vector<uint32_t> segs = Journal::segments(dir);
+    if (segs.empty()) {
+        fprintf(stderr, "No journal for session '%s' (create it with --journal)\n", name.c_str());
+        return 1;
+    }
+    regex_t re;
+    if (pattern) {
+        int rc = regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB);
+        if (rc != 0) {
+            char msg[256];
+            regerror(rc, &re, msg, sizeof(msg));
+            fprintf(stderr, "Invalid --grep pattern: %s\n", msg);
+            return 1;
+        }
+    }
+
+    // Where to start: the first index entry at or after since, in a
+    // segment that still exists
+    uint32_t start_seg = segs[0];
+    uint64_t start_off = 0;
+    if (since > 0) {
+        bool found = false;
+        FILE *f = fopen((dir + "/index").c_str(), "r");
+        if (f) {
+            char line[128];
+            long t;
+            unsigned n;
+            unsigned long long off;
+            while (!found && fgets(line, sizeof(line), f)) {
+                if (sscanf(line, "%ld %u %llu", &t, &n, &off) != 3 || t < since || n < segs[0])
+                    continue;
+                start_seg = n;
+                start_off = off;
+                found = true;
+            }
+            fclose(f);
+        }
+        if (!found) start_seg = segs.back() + 1;  // nothing that recent
+    }
+
+    VtParser vt;
+    LogText text(pattern ? &re : NULL);
+    for (size_t i = 0; i < segs.size(); i++) {
+        if (segs[i] < start_seg) continue;
+        uint64_t from = segs[i] == start_seg ? start_off : 0;
+        int fd = open(Journal::segment_path(dir, segs[i]).c_str(), O_RDONLY);
+        if (fd < 0) continue;  // pruned meanwhile
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (uint64_t)st.st_size > from) {
+            size_t size = (size_t)st.st_size;
+            void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+                madvise(map, size, MADV_SEQUENTIAL);
+#endif
+                const uint8_t *p = (const uint8_t *)map + from;
+                if (raw) fwrite(p, 1, size - from, stdout);
+                else vt.feed(p, size - from, text);
+                munmap(map, size);
+            }
+        }
+        close(fd);
+    }
+    if (!raw && !text.line.empty()) text.end_line();
+    if (pattern) regfree(&re);
+    return fflush(stdout) == 0 ? 0 : 1;
+}
+
+// ============================================================================
+// 16. bench command: throughput, echo latency, reattach time, daemon CPU
+// ============================================================================
+
+// The benchmark session's shell puts its PTY in raw mode with echo on,
+// announces itself, waits for one byte, floods the given number of bytes and
+// then idles. Keystrokes are echoed by the tty itself, so the echo latency
+// is the daemon's round trip with no program in the loop.
+static const char BENCH_READY[] = "GHOSTLY-BENCH-READY";
+static const char BENCH_END[] = "GHOSTLY-BENCH-END";
+static const char BENCH_REATTACH[] = "GHOSTLY-BENCH-REATTACHED";
+static const int BENCH_REATTACHES = 5;
+
+struct BenchOptions {
+    int clients;   // headless clients receiving the flood
+    int mb;        // flood size
+    int samples;   // keystroke round trips
+    bool json;
+
+    BenchOptions() : clients(1), mb(64), samples(200), json(false) {}
+};
+
+// A headless client: output is counted and scanned for one marker, never
+// displayed
+struct BenchClient {
+    int fd;
+    FrameReader in;
+    uint64_t bytes;     // DATA payload received
+    std::string tail;   // end of the output so far, for markers split across frames
+    std::string want;   // marker being waited for
+    bool found;
+    bool eof;
+
+    BenchClient() : fd(-1), bytes(0), found(false), eof(false) { in.reset(); }
+
+    void expect(const char *marker) {
+        want = marker;
+        found = false;
+        tail.clear();
+    }
+
+    void feed(const uint8_t *p, uint32_t len) {
+        bytes += len;
+        if (found || want.empty()) return;
+        // Only the bytes a split marker could span are joined up
+        size_t keep = want.size() - 1;
+        tail.append((const char *)p, std::min((size_t)len, keep));
+        if (tail.find(want) != std::string::npos ||
+            std::search(p, p + len, want.begin(), want.end()) != p + len) {
+            found = true;
+            return;
+        }
+        if (len >= keep) tail.assign((const char *)p + len - keep, keep);
+        else if (tail.size() > keep) tail.erase(0, tail.size() - keep);
+    }
+};
+
+// CPU time (user + system) used so far by pid, in ms; -1 where it can't be
+// read (no /proc)
+static double process_cpu_ms(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    // Fields after the command name, which may itself contain spaces
+    const char *p = strrchr(buf, ')');
+    unsigned long utime = 0, stime = 0;
+    if (!p || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                     &utime, &stime) != 2)
+        return -1;
+    return (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+}
+
+static bool bench_connect(BenchClient &c, const std::string &name, bool in_server) {
+    c.fd = in_server ? connect_unix(server_socket_path()) : connect_to_session(name);
+    if (c.fd < 0) return false;
+    uint8_t hello[8 + MAX_NAME_LEN];
+    uint32_t hello_len = 5;
+    hello[0] = 0;
+    hello[1] = 200;  // 200x50 window
+    hello[2] = 0;
+    hello[3] = 50;
+    hello[4] = 0;    // full replay
+    if (in_server) {
+        hello[5] = hello[6] = 0;
+        hello[7] = (uint8_t)name.size();
+        memcpy(hello + 8, name.data(), name.size());
+        hello_len = 8 + (uint32_t)name.size();
+    }
+    if (!send_msg(c.fd, MSG_HELLO, hello, hello_len)) return false;
+    set_nonblock(c.fd);
+    return true;
+}
+
+static void bench_close(BenchClient &c) {
+    if (c.fd >= 0) close(c.fd);
+    c.fd = -1;
+}
+
+// Read from every client until each has seen its marker. False on timeout
+// or if a client's connection ends first.
+static bool bench_wait(std::vector<BenchClient> &cl, int timeout_ms) {
+    int64_t deadline = now_ms() + timeout_ms;
+    std::vector<struct pollfd> fds(cl.size());
+    for (;;) {
+        bool done = true;
+        for (size_t i = 0; i < cl.size(); i++) {
+            if (cl[i].eof) return false;
+            if (!cl[i].found) done = false;
+            fds[i].fd = cl[i].fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (done) return true;
+        int left = (int)(deadline - now_ms());
+        if (left <= 0) return false;
+        if (poll(&fds[0], fds.size(), left) < 0 && errno != EINTR) return false;
+        for (size_t i = 0; i < cl.size(); i++) {
+            if (!fds[i].revents) continue;
+            BenchClient &c = cl[i];
+            ssize_t n = c.in.fill(c.fd);
+            MsgType type;
+            const uint8_t *data;
+            uint32_t len;
+            bool bad;
+            while (c.in.next(&type, &data, &len, &bad)) {
+                if (type == MSG_DATA) c.feed(data, len);
+                else if (type == MSG_EXIT) c.eof = true;
+            }
+            if (n < 0 || bad) c.eof = true;
+        }
+    }
+}
+
+static bool bench_type(BenchClient &c, const char *keys) {
+    return send_msg(c.fd, MSG_DATA, keys, (uint32_t)strlen(keys));
+}
+
+static int cmd_bench(const BenchOptions &bopts, const SessionOptions &opts) {
+    signal(SIGPIPE, SIG_IGN);
+    char name[32];
+    snprintf(name, sizeof(name), "bench-%d", (int)getpid());
+    char cmd[256];
+    snprintf(cmd, sizeof(cmd),
+             "stty raw echo; printf %s; head -c 1 >/dev/null; "
+             "yes 'ghostly-session bench: synthetic output line' | head -c %llu; "
+             "printf %s; exec cat >/dev/null",
+             BENCH_READY, (unsigned long long)bopts.mb * 1024 * 1024, BENCH_END);
+    // Quiet: the report (maybe JSON) is all that goes to stdout
+    int saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull >= 0) {
+        dup2(devnull, STDOUT_FILENO);
+        close(devnull);
+    }
+    int rc = cmd_create(name, cmd, opts);
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    if (rc != 0) return rc;
+
+    pid_t dpid = 0;
+    std::vector<SessionInfo> sessions = enumerate_sessions();
+    for (size_t i = 0; i < sessions.size(); i++)
+        if (sessions[i].name == name) dpid = sessions[i].pid;
+
+    const char *err = NULL;
+    std::vector<BenchClient> cl(bopts.clients);
+    std::vector<double> lat;
+    double mbps = 0, cpu_per_mb = -1, reattach_ms = 0;
+    uint64_t replay_bytes = 0;
+    for (size_t i = 0; i < cl.size() && !err; i++) {
+        if (!bench_connect(cl[i], name, opts.server)) err = "cannot connect to the benchmark session";
+        cl[i].expect(BENCH_READY);
+    }
+    // Login shells can take a while
+    if (!err && !bench_wait(cl, 30000)) err = "benchmark session did not start";
+
+    // Throughput: until every client has the whole flood
+    if (!err) {
+        for (size_t i = 0; i < cl.size(); i++) cl[i].expect(BENCH_END);
+        double cpu0 = dpid > 0 ? process_cpu_ms(dpid) : -1;
+        int64_t t0 = now_us();
+        if (!bench_type(cl[0], "g") || !bench_wait(cl, 60000 + bopts.mb * 1000))
+            err = "flood did not arrive";
+        double secs = (now_us() - t0) / 1e6;
+        double cpu1 = dpid > 0 ? process_cpu_ms(dpid) : -1;
+        mbps = bopts.mb / std::max(secs, 1e-6);
+        if (cpu0 >= 0 && cpu1 >= 0) cpu_per_mb = (cpu1 - cpu0) / bopts.mb;
+    }
+
+    // Echo latency: a keystroke from the first client, until every client
+    // has the echo
+    for (int k = 0; k < bopts.samples && !err; k++) {
+        for (size_t i = 0; i < cl.size(); i++) cl[i].expect("x");
+        int64_t t0 = now_us();
+        if (!bench_type(cl[0], "x") || !bench_wait(cl, 5000)) err = "keystroke was not echoed";
+        lat.push_back((now_us() - t0) / 1000.0);
+    }
+
+    // Reattach: connect, get the full scrollback, and see a keystroke typed
+    // right after the HELLO come back behind it
+    std::vector<double> reattach;
+    for (int k = 0; k < BENCH_REATTACHES && !err; k++) {
+        std::vector<BenchClient> one(1);
+        int64_t t0 = now_us();
+        if (!bench_connect(one[0], name, opts.server)) err = "cannot reconnect";
+        one[0].expect(BENCH_REATTACH);
+        if (!err && (!bench_type(one[0], BENCH_REATTACH) || !bench_wait(one, 10000)))
+            err = "reattach did not complete";
+        reattach.push_back((now_us() - t0) / 1000.0);
+        replay_bytes = one[0].bytes - strlen(BENCH_REATTACH);
+        bench_close(one[0]);
+        // Keep the other clients' queues drained
+        for (size_t i = 0; i < cl.size(); i++) cl[i].expect(BENCH_REATTACH);
+        if (!err && !bench_wait(cl, 5000)) err = "clients stopped receiving";
+    }
+
+    for (size_t i = 0; i < cl.size(); i++) bench_close(cl[i]);
+    if (opts.server) {
+        server_request(MSG_KILL, name, (uint32_t)strlen(name), NULL);
+    } else if (dpid > 0) {
+        // The daemon cleans up after itself; wait for it, so the session
+        // is gone when bench returns
+        kill(dpid, SIGTERM);
+        for (int i = 0; i < 50 && process_alive(dpid); i++) usleep(50000);
+    }
+    if (err) {
+        fprintf(stderr, "bench: %s\n", err);
+        return 1;
+    }
+
+    std::sort(lat.begin(), lat.end());
+    std::sort(reattach.begin(), reattach.end());
+    double p50 = lat[lat.size() / 2];
+    double p99 = lat[std::min(lat.size() - 1, lat.size() * 99 / 100)];
+    reattach_ms = reattach[reattach.size() / 2];
+    char cpu[32] = "null";
+    if (cpu_per_mb >= 0) snprintf(cpu, sizeof(cpu), "%.2f", cpu_per_mb);
+
+    if (bopts.json) {
+        printf("{\"version\":\"%s\",\"server\":%s,\"clients\":%d,\"mb\":%d,\"samples\":%d,"
+               "\"scrollback\":%llu,\"throughput_mbps\":%.1f,\"latency_p50_ms\":%.3f,"
+               "\"latency_p99_ms\":%.3f,\"reattach_ms\":%.2f,\"replay_bytes\":%llu,"
+               "\"cpu_ms_per_mb\":%s}\n",
+               GHOSTLY_VERSION, opts.server ? "true" : "false", bopts.clients, bopts.mb,
+               bopts.samples, (unsigned long long)opts.scrollback_size, mbps, p50, p99,
+               reattach_ms, (unsigned long long)replay_bytes, cpu);
+    } else {
+        printf("ghostly-session %s bench: %d client(s), %dMB flood%s\n", GHOSTLY_VERSION,
+               bopts.clients, bopts.mb, opts.server ? ", per-UID server" : "");
+        printf("  throughput    %.1f MB/s\n", mbps);
+        printf("  echo latency  p50 %.3f ms, p99 %.3f ms (%d samples)\n", p50, p99, bopts.samples);
+        printf("  reattach      %.2f ms with %llu bytes of scrollback\n", reattach_ms,
+               (unsigned long long)replay_bytes);
+        if (cpu_per_mb >= 0) printf("  daemon CPU    %.2f ms/MB\n", cpu_per_mb);
+        else printf("  daemon CPU    n/a\n");
+    }
+    return 0;
+}
+
+// ============================================================================
+// 17. Argument parsing & main
 // ============================================================================
 
 static void print_usage() {
@@ -1319,22 +7202,200 @@ static void print_usage() {
         "ghostly-session %s - remote session manager\n"
         "\n"
         "Usage:\n"
-        "  ghostly-session create <name> [-- cmd...]   Create session (daemonizes)\n"
-        "  ghostly-session attach <name> [--no-replay] Attach to session\n"
-        "  ghostly-session open <name> [-- cmd...]     Create-or-attach\n"
+        "  ghostly-session create <name> [opts] [-- cmd...]  Create session (daemonizes)\n"
+        "  ghostly-session attach <name> [attach opts]       Attach to session\n"
+        "  ghostly-session open <name> [opts] [-- cmd...]    Create-or-attach\n"
+        "  ghostly-session mux                         Attach to many sessions over\n"
+        "                                              stdin/stdout (for apps)\n"
         "  ghostly-session list [--json]               List sessions\n"
+        "  ghostly-session list --watch [SECS]         Stream JSON on change (rescan\n"
+        "                                              every 30s)\n"
         "  ghostly-session info [--json]               System info\n"
+        "  ghostly-session info --watch [SECS]         Stream JSON on change (default 5s)\n"
         "  ghostly-session kill <name>                 Kill session\n"
+        "  ghostly-session stats <name> [--json]       Daemon counters for a session\n"
+        "  ghostly-session log <name> [log opts]       Print a session's journal\n"
+        "  ghostly-session bench [bench opts] [opts]   Benchmark a throwaway session\n"
         "  ghostly-session version                     Version info\n"
         "\n"
-        "Options:\n"
+        "Attach options (attach/open):\n"
         "  --no-replay   Skip scrollback replay on attach (fast reattach)\n"
+        "  --screen      Redraw only the current screen on attach, no history\n"
+        "  --compress    Ask for compressed output (for a forwarded socket)\n"
+        "  --display-rate  When output outpaces the link, skip to the current\n"
+        "                screen (redrawn up to 10x/s) instead of catching up\n"
+        "  --ping SECS   Ping the session when it has been silent this long and\n"
+        "                disconnect if it stays silent (default: off)\n"
+        "  --no-coalesce Send every read of input at once, never gathering a\n"
+        "                burst of it for up to 0.5ms\n"
+        "  --predict adaptive|always|never  Show typed characters before the\n"
+        "                session echoes them: when the round trip is over 30ms\n"
+        "                (default), always, or never. Off with --no-replay\n"
+        "                and --resume, which leave the screen unknown\n"
+        "  --resume POS  Replay only the output this terminal missed, if still in\n"
+        "                scrollback. POS is ID:OFFSET as printed when an earlier\n"
+        "                --resume attach ended (0:0 for none yet), or a file of\n"
+        "                this terminal's own that keeps it between attaches\n"
+        "  --read-only   Watch without typing: only the detach key is read, and\n"
+        "                the session keeps its window size\n"
+        "\n"
+        "Session options (create/open):\n"
+        "  --on-overflow drop|resync   Slow client with a full output queue is\n"
+        "                              disconnected, or has its screen redrawn\n"
+        "                              (default: resync)\n"
+        "  --scrollback SIZE           Scrollback kept for replay, e.g. 16M\n"
+        "                              (default: 128K; above 4M it is file-backed)\n"
+        "  --server                    Host the session in the per-UID server, one\n"
+        "                              daemon for many sessions (started on demand)\n"
+        "  --resize latest|smallest|largest  Window size when clients differ: that\n"
+        "                              of the last one to type or resize\n"
+        "                              (default), or the smallest/largest\n"
+        "  --journal                   Also append the output to a journal on disk,\n"
+        "                              kept after the session for 'log'\n"
+        "  --pausable                  While detached, stop the program once its\n"
+        "                              output would overwrite the scrollback\n"
+        "  --io-thread                 Read the program's output on a thread of its\n"
+        "                              own, so slow clients don't hold it up\n"
+        "\n"
+        "Log options:\n"
+        "  --since T     Start at a time: Unix time, YYYY-MM-DD[ HH:MM[:SS]], or\n"
+        "                an age (90s, 15m, 2h, 1d)\n"
+        "  --grep PAT    Only lines matching an extended regex\n"
+        "  --raw         The output bytes as written, escape sequences and all\n"
+        "\n"
+        "Bench options:\n"
+        "  --clients N   Headless clients attached during the flood (default: 1)\n"
+        "  --mb N        Size of the output flood in MB (default: 64)\n"
+        "  --samples N   Keystroke echo round trips timed (default: 200)\n"
+        "  --json        Machine-readable result\n"
         "\n"
         "Session names: alphanumeric, dash, underscore, dot (max %d chars)\n"
         "Detach key: Ctrl+\\ (0x1C)\n",
         GHOSTLY_VERSION, MAX_NAME_LEN);
 }
 
+// Parse a session option at argv[*i] (create/open). Advances *i past any
+// value. Returns 1 if consumed, 0 if not a session option, -1 on a bad value.
+static int parse_session_option(int argc, char **argv, int *i, SessionOptions &opts) {
+    const char *arg = argv[*i];
+    if (strcmp(arg, "--on-overflow") == 0) {
+        if (*i + 1 >= argc) {
+            fprintf(stderr, "--on-overflow requires a value (drop|resync)\n");
+            return -1;
+        }
+        const char *v = argv[++*i];
+        if (strcmp(v, "drop") == 0) opts.overflow = OVERFLOW_DROP;
+        else if (strcmp(v, "resync") == 0) opts.overflow = OVERFLOW_RESYNC;
+        else {
+            fprintf(stderr, "Invalid --on-overflow value '%s' (use drop|resync)\n", v);
+            return -1;
+        }
+        return 1;
+    }
+    if (strcmp(arg, "--resize") == 0) {
+        const char *v = (*i + 1 < argc) ? argv[++*i] : "";
+        if (strcmp(v, "latest") == 0) opts.resize = RESIZE_LATEST;
+        else if (strcmp(v, "smallest") == 0) opts.resize = RESIZE_SMALLEST;
+        else if (strcmp(v, "largest") == 0) opts.resize = RESIZE_LARGEST;
+        else {
+            fprintf(stderr, "--resize must be latest, smallest or largest\n");
+            return -1;
+        }
+        return 1;
+    }
+    if (strcmp(arg, "--scrollback") == 0) {
+        size_t size = 0;
+        if (*i + 1 >= argc || !parse_size(argv[++*i], &size) ||
+            size < SCROLLBACK_MIN || size > SCROLLBACK_MAX) {
+            fprintf(stderr, "--scrollback requires a size between 16K and 1G (e.g. 16M)\n");
+            return -1;
+        }
+        opts.scrollback_size = round_up_pow2(size);
+        return 1;
+    }
+    if (strcmp(arg, "--server") == 0) {
+        opts.server = true;
+        return 1;
+    }
+    if (strcmp(arg, "--journal") == 0) {
+        opts.journal = true;
+        return 1;
+    }
+    if (strcmp(arg, "--pausable") == 0) {
+        opts.pausable = true;
+        return 1;
+    }
+    if (strcmp(arg, "--io-thread") == 0) {
+        opts.io_thread = true;
+        return 1;
+    }
+    return 0;
+}
+
+// Parse an attach option at argv[*i] (attach/open), like parse_session_option
+static int parse_attach_option(int argc, char **argv, int *i, AttachOptions &aopts) {
+    const char *arg = argv[*i];
+    if (strcmp(arg, "--no-replay") == 0) aopts.hello_flags |= HELLO_FLAG_NO_REPLAY;
+    else if (strcmp(arg, "--screen") == 0) aopts.hello_flags |= HELLO_FLAG_SCREEN;
+    else if (strcmp(arg, "--compress") == 0) aopts.hello_flags |= HELLO_FLAG_COMPRESS;
+    else if (strcmp(arg, "--display-rate") == 0) aopts.hello_flags |= HELLO_FLAG_DISPLAY_RATE;
+    else if (strcmp(arg, "--read-only") == 0) aopts.hello_flags |= HELLO_FLAG_READ_ONLY;
+    else if (strcmp(arg, "--no-coalesce") == 0) aopts.coalesce = false;
+    else if (strcmp(arg, "--resume") == 0) {
+        if (*i + 1 >= argc || !argv[*i + 1][0]) {
+            fprintf(stderr, "--resume requires a position (ID:OFFSET) or a file\n");
+            return -1;
+        }
+        aopts.resume = argv[++*i];
+    }
+    else if (strcmp(arg, "--predict") == 0) {
+        const char *v = (*i + 1 < argc) ? argv[++*i] : "";
+        if (strcmp(v, "adaptive") == 0) aopts.predict = PREDICT_ADAPTIVE;
+        else if (strcmp(v, "always") == 0) aopts.predict = PREDICT_ALWAYS;
+        else if (strcmp(v, "never") == 0) aopts.predict = PREDICT_NEVER;
+        else {
+            fprintf(stderr, "--predict must be adaptive, always or never\n");
+            return -1;
+        }
+    }
+    else if (strcmp(arg, "--ping") == 0) {
+        char *end = NULL;
+        long v = (*i + 1 < argc) ? strtol(argv[++*i], &end, 10) : 0;
+        if (!end || *end != '\0' || v < PING_INTERVAL_MIN || v > PING_INTERVAL_MAX) {
+            fprintf(stderr, "--ping requires an interval in seconds (%d-%d)\n",
+                    PING_INTERVAL_MIN, PING_INTERVAL_MAX);
+            return -1;
+        }
+        aopts.ping_interval = (int)v;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Parse a bench option at argv[*i], like parse_session_option
+static int parse_bench_option(int argc, char **argv, int *i, BenchOptions &bopts) {
+    const char *arg = argv[*i];
+    int *target = NULL;
+    long max = 0;
+    if (strcmp(arg, "--json") == 0) {
+        bopts.json = true;
+        return 1;
+    }
+    if (strcmp(arg, "--clients") == 0) { target = &bopts.clients; max = MAX_CLIENTS; }
+    else if (strcmp(arg, "--mb") == 0) { target = &bopts.mb; max = 65536; }
+    else if (strcmp(arg, "--samples") == 0) { target = &bopts.samples; max = 100000; }
+    else return 0;
+    char *end = NULL;
+    long v = (*i + 1 < argc) ? strtol(argv[++*i], &end, 10) : 0;
+    if (!end || *end != '\0' || v < 1 || v > max) {
+        fprintf(stderr, "%s requires a number between 1 and %ld\n", arg, max);
+        return -1;
+    }
+    *target = (int)v;
+    return 1;
+}
+
 // Collect arguments after "--" as a command string
 static std::string collect_cmd(int argc, char **argv, int start) {
     std::string cmd;
@@ -1355,54 +7416,91 @@ int main(int argc, char **argv) {
 
     if (subcmd == "create") {
         if (argc < 3) {
-            fprintf(stderr, "Usage: ghostly-session create <name> [-- cmd...]\n");
+            fprintf(stderr, "Usage: ghostly-session create <name> [opts] [-- cmd...]\n");
             return 1;
         }
         std::string name = argv[2];
         std::string cmd;
-        // Find "--" separator
+        SessionOptions opts;
+        // Options, then "--" separator
         for (int i = 3; i < argc; i++) {
             if (strcmp(argv[i], "--") == 0) {
                 cmd = collect_cmd(argc, argv, i + 1);
                 break;
             }
+            if (parse_session_option(argc, argv, &i, opts) < 0) return 1;
+        }
+        return cmd_create(name, cmd, opts);
+
+    } else if (subcmd == "mux") {
+        if (argc > 2) {
+            fprintf(stderr, "Usage: ghostly-session mux  (framed protocol on stdin/stdout, see README)\n");
+            return 1;
         }
-        return cmd_create(name, cmd);
+        return cmd_mux();
 
     } else if (subcmd == "attach") {
         if (argc < 3) {
-            fprintf(stderr, "Usage: ghostly-session attach <name> [--no-replay]\n");
+            fprintf(stderr, "Usage: ghostly-session attach <name> [--no-replay|--screen] [--compress] [--display-rate] [--ping SECS] [--no-coalesce] [--predict MODE] [--resume POS] [--read-only]\n");
             return 1;
         }
-        bool no_replay = false;
+        AttachOptions aopts;
         for (int i = 3; i < argc; i++) {
-            if (strcmp(argv[i], "--no-replay") == 0) no_replay = true;
+            if (parse_attach_option(argc, argv, &i, aopts) < 0) return 1;
         }
-        return cmd_attach(argv[2], no_replay);
+        return cmd_attach(argv[2], aopts);
 
     } else if (subcmd == "open") {
         if (argc < 3) {
-            fprintf(stderr, "Usage: ghostly-session open <name> [--no-replay] [-- cmd...]\n");
+            fprintf(stderr, "Usage: ghostly-session open <name> [attach opts] [opts] [-- cmd...]\n");
             return 1;
         }
         std::string name = argv[2];
         std::string cmd;
-        bool no_replay = false;
+        SessionOptions opts;
+        AttachOptions aopts;
         for (int i = 3; i < argc; i++) {
-            if (strcmp(argv[i], "--no-replay") == 0) {
-                no_replay = true;
-            } else if (strcmp(argv[i], "--") == 0) {
+            if (strcmp(argv[i], "--") == 0) {
                 cmd = collect_cmd(argc, argv, i + 1);
                 break;
             }
+            int r = parse_attach_option(argc, argv, &i, aopts);
+            if (r == 0) r = parse_session_option(argc, argv, &i, opts);
+            if (r < 0) return 1;
         }
-        return cmd_open(name, cmd, no_replay);
+        return cmd_open(name, cmd, opts, aopts);
 
     } else if (subcmd == "list") {
+        if (argc >= 3 && strcmp(argv[2], "--watch") == 0) {
+            int interval = LIST_WATCH_INTERVAL;
+            if (argc >= 4) {
+                char *end = NULL;
+                long v = strtol(argv[3], &end, 10);
+                if (*end != '\0' || v < 1 || v > 3600) {
+                    fprintf(stderr, "list --watch takes an interval in seconds (1-3600)\n");
+                    return 1;
+                }
+                interval = (int)v;
+            }
+            return cmd_list_watch(interval);
+        }
         bool json = (argc >= 3 && strcmp(argv[2], "--json") == 0);
         return cmd_list(json);
 
     } else if (subcmd == "info") {
+        if (argc >= 3 && strcmp(argv[2], "--watch") == 0) {
+            int interval = INFO_WATCH_INTERVAL;
+            if (argc >= 4) {
+                char *end = NULL;
+                long v = strtol(argv[3], &end, 10);
+                if (*end != '\0' || v < 1 || v > 3600) {
+                    fprintf(stderr, "info --watch takes an interval in seconds (1-3600)\n");
+                    return 1;
+                }
+                interval = (int)v;
+            }
+            return cmd_info_watch(interval);
+        }
         bool json = (argc >= 3 && strcmp(argv[2], "--json") == 0);
         return cmd_info(json);
 
@@ -1413,6 +7511,57 @@ int main(int argc, char **argv) {
         }
         return cmd_kill(argv[2]);
 
+    } else if (subcmd == "stats") {
+        if (argc < 3) {
+            fprintf(stderr, "Usage: ghostly-session stats <name> [--json]\n");
+            return 1;
+        }
+        bool json = (argc >= 4 && strcmp(argv[3], "--json") == 0);
+        return cmd_stats(argv[2], json);
+
+    } else if (subcmd == "log") {
+        if (argc < 3) {
+            fprintf(stderr, "Usage: ghostly-session log <name> [--since T] [--grep PATTERN] [--raw]\n");
+            return 1;
+        }
+        time_t since = 0;
+        const char *pattern = NULL;
+        bool raw = false;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--since") == 0 && i + 1 < argc) {
+                if (!parse_since(argv[++i], &since)) {
+                    fprintf(stderr, "--since takes a Unix time, YYYY-MM-DD[ HH:MM[:SS]] or an age (90s, 15m, 2h, 1d)\n");
+                    return 1;
+                }
+            } else if (strcmp(argv[i], "--grep") == 0 && i + 1 < argc) {
+                pattern = argv[++i];
+            } else if (strcmp(argv[i], "--raw") == 0) {
+                raw = true;
+            } else {
+                fprintf(stderr, "Unknown log option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        if (raw && pattern) {
+            fprintf(stderr, "--grep works on text, not with --raw\n");
+            return 1;
+        }
+        return cmd_log(argv[2], since, pattern, raw);
+
+    } else if (subcmd == "bench") {
+        BenchOptions bopts;
+        SessionOptions opts;
+        for (int i = 2; i < argc; i++) {
+            int r = parse_bench_option(argc, argv, &i, bopts);
+            if (r == 0) r = parse_session_option(argc, argv, &i, opts);
+            if (r == 0) {
+                fprintf(stderr, "Unknown bench option: %s\n", argv[i]);
+                return 1;
+            }
+            if (r < 0) return 1;
+        }
+        return cmd_bench(bopts, opts);
+
     } else if (subcmd == "version" || subcmd == "--version" || subcmd == "-v") {
         printf("ghostly-session %s\n", GHOSTLY_VERSION);
         return 0;
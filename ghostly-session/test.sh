@@ -10,6 +10,11 @@ PASS=0
 FAIL=0
 CLEANUP_SESSIONS=()
 
+# Sessions run $SHELL -l: keep the user's profile, which may take seconds to
+# load (conda...), out of the timing of the tests
+TEST_HOME=$(mktemp -d)
+export HOME="$TEST_HOME"
+
 red()   { printf "\033[31m%s\033[0m\n" "$*"; }
 green() { printf "\033[32m%s\033[0m\n" "$*"; }
 bold()  { printf "\033[1m%s\033[0m\n" "$*"; }
@@ -21,6 +26,7 @@ cleanup() {
     for name in "${CLEANUP_SESSIONS[@]}"; do
         "$BIN" kill "$name" >/dev/null 2>&1 || true
     done
+    rm -rf "$TEST_HOME"
 }
 trap cleanup EXIT
 
@@ -245,6 +251,43 @@ else
     echo "  SKIP: could not find PID file for stale test"
 fi
 
+# Sockets of live processes: three that never answer QUERY, and one bound
+# but not listening yet (a daemon starting up). The listing waits for the
+# silent ones together, and doesn't take the starting one for stale.
+WEDGED="test-wedged-$$"
+track "$WEDGED-1"
+track "$WEDGED-2"
+track "$WEDGED-3"
+track "$WEDGED-4"
+out=$(python3 - "$BIN" "$SOCK_DIR" "$WEDGED" <<'EOF'
+import os, socket, subprocess, sys, time
+binary, sock_dir, name = sys.argv[1:]
+socks = []
+for k in range(1, 5):
+    path = '%s/%s-%d' % (sock_dir, name, k)
+    s = socket.socket(socket.AF_UNIX)
+    s.bind(path + '.sock')
+    if k < 4:
+        s.listen(4)
+    socks.append(s)
+    with open(path + '.pid', 'w') as f:
+        f.write('%d\n' % os.getpid())
+start = time.time()
+out = subprocess.run([binary, 'list'], capture_output=True, text=True).stdout
+took = time.time() - start
+print(sum(('%s-%d' % (name, k)) in out for k in range(1, 5)), took < 3,
+      os.path.exists('%s/%s-4.sock' % (sock_dir, name)))
+EOF
+)
+if [ "$out" = "4 True True" ]; then
+    pass "list queries daemons in parallel and spares a starting one"
+else
+    fail "list with wedged or starting daemons: $out"
+fi
+for k in 1 2 3 4; do
+    rm -f "$SOCK_DIR/$WEDGED-$k.sock" "$SOCK_DIR/$WEDGED-$k.pid"
+done
+
 # ---------- 12. attach to nonexistent ----------
 bold "12. Attach to nonexistent"
 
@@ -272,6 +315,1444 @@ else
     pass "unknown command rejected"
 fi
 
+# ---------- 15. session options ----------
+bold "15. Session options"
+
+SESSION4="test-opts-$$"
+track "$SESSION4"
+
+if "$BIN" create "$SESSION4" --scrollback 16M --on-overflow drop >/dev/null 2>&1; then
+    pass "create accepts --scrollback and --on-overflow"
+else
+    fail "create rejected valid session options"
+fi
+"$BIN" kill "$SESSION4" >/dev/null 2>&1 || true
+
+for opt in "--scrollback abc" "--scrollback 1" "--scrollback 4G" "--scrollback 17179869185G" "--on-overflow maybe"; do
+    # shellcheck disable=SC2086
+    if "$BIN" create "$SESSION4" $opt >/dev/null 2>&1; then
+        fail "accepted invalid option: $opt"
+        "$BIN" kill "$SESSION4" >/dev/null 2>&1 || true
+    else
+        pass "rejected invalid option: $opt"
+    fi
+done
+
+# A client that never reads must not hold up the others: its queue hits
+# the limit and the overflow policy deals with it, while a reading client
+# gets 8MB of output straight through
+for policy in resync drop; do
+    "$BIN" create "$SESSION4" --on-overflow "$policy" -- "stty raw -echo; head -c 1 >/dev/null; yes 0123456789 | head -c 8388608; printf FLOOD-END; exec cat >/dev/null" >/dev/null 2>&1
+    out=$(python3 - "/tmp/ghostly-$(id -u)/$SESSION4.sock" <<'EOF'
+import socket, struct, sys, time
+def connect():
+    s = socket.socket(socket.AF_UNIX)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+    s.connect(sys.argv[1])
+    s.sendall(struct.pack('>BIHHB', 5, 5, 80, 24, 0x01))
+    return s
+stalled = connect()
+reader = connect()
+time.sleep(0.2)
+start = time.time()
+reader.sendall(struct.pack('>BI', 1, 1) + b'x')
+reader.settimeout(0.5)
+buf = b''
+while time.time() - start < 10 and b'FLOOD-END' not in buf:
+    try:
+        d = reader.recv(1 << 20)
+        if not d:
+            break
+        buf = buf[-16:] + d
+    except socket.timeout:
+        pass
+took = time.time() - start
+print('%s %.1f' % ('ok' if b'FLOOD-END' in buf and took < 5 else 'slow', took))
+EOF
+)
+    counter=$([ "$policy" = resync ] && echo resyncs || echo clients_dropped)
+    n=$("$BIN" stats "$SESSION4" | awk -v k="$counter" '$1 == k { print $2 }')
+    if [[ "$out" == ok* ]] && [ -n "$n" ] && [ "$n" -gt 0 ]; then
+        pass "a stalled client doesn't hold up the others ($policy: ${out#ok }s, $counter $n)"
+    else
+        fail "stalled client with $policy: $out, $counter '$n'"
+    fi
+    "$BIN" kill "$SESSION4" >/dev/null 2>&1 || true
+done
+
+# A replay is read from the ring as the socket takes it: a client that never
+# reads doesn't get a 64MB scrollback copied into the daemon's memory, while
+# one that reads gets all of it
+"$BIN" create "$SESSION4" --scrollback 64M -- "yes | head -c 67108864; printf FILL-END; exec sleep 60" >/dev/null 2>&1
+for _ in $(seq 1 300); do
+    n=$("$BIN" stats "$SESSION4" 2>/dev/null | awk '$1 == "pty_bytes" { print $2 }')
+    [ -n "$n" ] && [ "$n" -ge 100663304 ] && break
+    sleep 0.1
+done
+pid=$("$BIN" stats "$SESSION4" 2>/dev/null | awk '$1 == "pid" { print $2 }')
+out=$(python3 - "/tmp/ghostly-$(id -u)/$SESSION4.sock" "$pid" <<'EOF'
+import socket, struct, sys, time
+def rss():
+    for line in open('/proc/%s/status' % sys.argv[2]):
+        if line.startswith('VmRSS:'):
+            return int(line.split()[1]) // 1024
+before = rss()
+stalled = socket.socket(socket.AF_UNIX)
+stalled.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+stalled.connect(sys.argv[1])
+stalled.sendall(struct.pack('>BIHHB', 5, 5, 80, 24, 0))
+reader = socket.socket(socket.AF_UNIX)
+reader.connect(sys.argv[1])
+reader.sendall(struct.pack('>BIHHB', 5, 5, 80, 24, 0))
+reader.settimeout(0.5)
+buf = b''
+got = 0
+tail = b''
+start = time.time()
+while time.time() - start < 20 and not tail.endswith(b'FILL-END'):
+    try:
+        d = reader.recv(1 << 20)
+    except socket.timeout:
+        continue
+    if not d:
+        break
+    buf += d
+    while len(buf) >= 5:
+        t, n = struct.unpack('>BI', buf[:5])
+        if len(buf) < 5 + n:
+            break
+        if t == 0x01:
+            got += n
+            tail = (tail + buf[5:5 + n])[-16:]
+        buf = buf[5 + n:]
+time.sleep(0.5)
+grew = rss() - before
+ok = got == 67108864 and tail.endswith(b'FILL-END') and grew < 16
+print('%s %d %d' % ('ok' if ok else 'bad', got, grew))
+EOF
+)
+if [[ "$out" == ok* ]]; then
+    read -r _ got grew <<<"$out"
+    pass "a stalled client's replay isn't copied (RSS +${grew}MB), a reader gets all ${got} bytes"
+else
+    fail "replay of a 64MB scrollback: $out (ok bytes MB-grown)"
+fi
+"$BIN" kill "$SESSION4" >/dev/null 2>&1 || true
+
+# ---------- 16. screen redraw ----------
+bold "16. Screen redraw"
+
+SESSION5="test-screen-$$"
+track "$SESSION5"
+
+"$BIN" create "$SESSION5" -- "printf '\\033[?1049h\\033[2J\\033[3;5HTUI-SCREEN'; sleep 30" >/dev/null 2>&1
+# Attach with HELLO_FLAG_SCREEN; the redraw should re-enter the alternate
+# screen and paint the text at row 3, column 5
+if python3 - "/tmp/ghostly-$(id -u)/$SESSION5.sock" <<'EOF'
+import socket, struct, sys, time
+deadline = time.time() + 8
+while time.time() < deadline:
+    s = socket.socket(socket.AF_UNIX)
+    s.connect(sys.argv[1])
+    s.sendall(struct.pack('>BIHHB', 5, 5, 80, 24, 0x02))
+    s.settimeout(0.5)
+    buf = b''
+    try:
+        while True:
+            d = s.recv(65536)
+            if not d: break
+            buf += d
+    except socket.timeout:
+        pass
+    s.close()
+    if b'\x1b[?1049h' in buf and b'\x1b[3H    TUI-SCREEN' in buf:
+        sys.exit(0)
+    time.sleep(0.5)
+sys.exit(1)
+EOF
+then
+    pass "alternate screen redrawn from screen model"
+else
+    fail "screen redraw missing alternate screen content"
+fi
+"$BIN" kill "$SESSION5" >/dev/null 2>&1 || true
+
+# ESC[?1049h and ESC[?1049l each split across two PTY reads (a client is
+# attached, so the halves are read as they come): a plain attach must still
+# find the alternate screen active and get it redrawn, then not once it has
+# been left, and the TUI's text never goes into scrollback
+"$BIN" create "$SESSION5" -- "stty raw -echo; head -c 1 >/dev/null; printf '\\033[?10'; sleep 0.5; printf '49hALT-SCREEN'; head -c 1 >/dev/null; printf '\\033[?104'; sleep 0.5; printf '9lMAIN-SCREEN'; exec cat >/dev/null" >/dev/null 2>&1
+out=$(python3 - "/tmp/ghostly-$(id -u)/$SESSION5.sock" <<'EOF'
+import socket, struct, sys, time
+def frame(t, p=b''):
+    return struct.pack('>BI', t, len(p)) + p
+def attach(flags):
+    s = socket.socket(socket.AF_UNIX)
+    s.connect(sys.argv[1])
+    s.sendall(frame(5, struct.pack('>HHB', 80, 24, flags)))
+    return s
+def read_until(s, marker, secs):
+    buf, end = b'', time.time() + secs
+    s.settimeout(0.2)
+    while time.time() < end and (marker is None or marker not in buf):
+        try:
+            d = s.recv(65536)
+            if not d: break
+            buf += d
+        except socket.timeout:
+            pass
+    return buf
+def replay():
+    s = attach(0)
+    buf = read_until(s, None, 0.5)
+    s.close()
+    redrawn = b'\x1b[!p' in buf
+    return '%s/%s' % (redrawn and b'\x1b[?1049h' in buf.split(b'\x1b[!p')[-1],
+                      b'ALT-SCREEN' in buf.split(b'\x1b[!p')[0])
+w = attach(0x01)
+time.sleep(0.2)
+w.sendall(frame(1, b'x'))
+read_until(w, b'ALT-SCREEN', 5)
+inside = replay()
+w.sendall(frame(1, b'x'))
+read_until(w, b'MAIN-SCREEN', 5)
+print(inside, replay())
+EOF
+)
+if [ "$out" = "True/False False/False" ]; then
+    pass "alternate screen tracked across split escape sequences"
+else
+    fail "split ESC[?1049h/l: $out"
+fi
+"$BIN" kill "$SESSION5" >/dev/null 2>&1 || true
+
+# ---------- 17. compressed attach ----------
+bold "17. Compressed attach"
+
+SESSION6="test-compress-$$"
+track "$SESSION6"
+
+if command -v script >/dev/null 2>&1; then
+    "$BIN" create "$SESSION6" -- "for i in \$(seq 1 2000); do echo row-\$i repeated; done; sleep 30" >/dev/null 2>&1
+    rows=0
+    for _ in 1 2 3 4 5 6 7 8; do
+        sleep 1
+        rows=$(timeout 2 script -q /dev/null -c "$BIN attach $SESSION6 --compress" </dev/null 2>/dev/null | grep -ac "repeated" || true)
+        [ "$rows" -ge 2000 ] && break
+    done
+    if [ "$rows" -ge 2000 ]; then
+        pass "attach --compress replays all output"
+    else
+        fail "attach --compress replayed $rows of 2000 lines"
+    fi
+    "$BIN" kill "$SESSION6" >/dev/null 2>&1 || true
+else
+    echo "  SKIP: 'script' command not available for TTY tests"
+fi
+
+# ---------- 18. display-rate attach ----------
+bold "18. Display-rate attach"
+
+SESSION7="test-rate-$$"
+track "$SESSION7"
+
+"$BIN" create "$SESSION7" -- "bash --norc" >/dev/null 2>&1
+sleep 0.3
+# A slow reader with HELLO_FLAG_DISPLAY_RATE: a 20MB flood should be skipped
+# over, and the screen after it still arrive
+if python3 - "/tmp/ghostly-$(id -u)/$SESSION7.sock" <<'EOF'
+import socket, struct, sys, time
+s = socket.socket(socket.AF_UNIX)
+s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+s.connect(sys.argv[1])
+s.sendall(struct.pack('>BIHHB', 5, 5, 80, 24, 0x08))
+cmd = b"stty -echo; yes flood | head -c 20000000; echo; echo FLOOD-''DONE\r"
+s.sendall(struct.pack('>BI', 1, len(cmd)) + cmd)
+s.settimeout(5)
+total, tail, deadline = 0, b'', time.time() + 30
+while time.time() < deadline:
+    try:
+        d = s.recv(16384)
+    except socket.timeout:
+        break
+    if not d: break
+    total += len(d)
+    tail = (tail + d)[-8192:]
+    if b'FLOOD-DONE' in tail: break
+    time.sleep(0.01)
+sys.exit(0 if b'FLOOD-DONE' in tail and total < 5000000 else 1)
+EOF
+then
+    pass "display-rate client skips a flood and sees the final screen"
+else
+    fail "display-rate client did not catch up"
+fi
+"$BIN" kill "$SESSION7" >/dev/null 2>&1 || true
+
+# ---------- 19. ping / pong ----------
+bold "19. Ping"
+
+SESSION8="test-ping-$$"
+track "$SESSION8"
+
+"$BIN" create "$SESSION8" -- "bash --norc" >/dev/null 2>&1
+sleep 0.3
+# HELLO with a 1s ping interval: the daemon answers our PING, pings us once
+# we've been silent for 1s, and drops us after 2s without a reply
+if python3 - "/tmp/ghostly-$(id -u)/$SESSION8.sock" <<'EOF'
+import socket, struct, sys, time
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+s.sendall(struct.pack('>BIHHBH', 5, 7, 80, 24, 0, 1))
+s.sendall(struct.pack('>BI', 7, 4) + b'ping')
+s.settimeout(5)
+buf, start = b'', time.time()
+while True:
+    try:
+        d = s.recv(65536)
+    except socket.timeout:
+        sys.exit(1)
+    if not d: break
+    buf += d
+frames, pos = [], 0
+while pos + 5 <= len(buf):
+    t, l = struct.unpack('>BI', buf[pos:pos + 5])
+    frames.append((t, buf[pos + 5:pos + 5 + l]))
+    pos += 5 + l
+ok = (8, b'ping') in frames and any(t == 7 for t, _ in frames)
+sys.exit(0 if ok and 1.5 < time.time() - start < 4 else 1)
+EOF
+then
+    pass "PING answered, silent client pinged and dropped"
+else
+    fail "ping liveness not working"
+fi
+"$BIN" kill "$SESSION8" >/dev/null 2>&1 || true
+
+if "$BIN" attach "$SESSION8" --ping 0 >/dev/null 2>&1; then
+    fail "accepted invalid --ping 0"
+else
+    pass "rejected invalid --ping 0"
+fi
+
+# ---------- 20. per-UID server ----------
+bold "20. Per-UID server"
+
+SRV_A="test-srv-a-$$"
+SRV_B="test-srv-b-$$"
+SRV_C="test-srv-c-$$"
+track "$SRV_A"
+track "$SRV_B"
+track "$SRV_C"
+SRV_ENV=$(mktemp)
+
+# Started together: one starts the server, the other waits for it and
+# joins. Each session gets its own creator's environment.
+GHOSTLY_TEST_ENV=one "$BIN" create "$SRV_A" --server -- "echo \$GHOSTLY_TEST_ENV > $SRV_ENV; sleep 30" >/dev/null 2>&1 &
+GHOSTLY_TEST_ENV=two "$BIN" create "$SRV_B" --server -- "bash --norc" >/dev/null 2>&1 &
+wait
+if "$BIN" list --json 2>/dev/null | python3 -c '
+import json, sys
+a, b = sys.argv[1:]
+s = {x["name"]: x for x in json.load(sys.stdin)["sessions"]}
+ok = a in s and b in s and s[a]["server"] and s[a]["pid"] == s[b]["pid"]
+sys.exit(0 if ok else 1)' "$SRV_A" "$SRV_B"; then
+    pass "two sessions hosted by one server process"
+else
+    fail "server sessions missing from list"
+fi
+
+if "$BIN" create "$SRV_A" >/dev/null 2>&1; then
+    fail "standalone create reused a server session name"
+else
+    pass "rejected standalone duplicate of a server session"
+fi
+
+# Attach by name through the control socket (HELLO carries the name)
+if python3 - "/tmp/ghostly-$(id -u)/server.ctl" "$SRV_B" <<'EOF'
+import socket, struct, sys, time
+path, name = sys.argv[1], sys.argv[2].encode()
+deadline = time.time() + 8
+s = socket.socket(socket.AF_UNIX)
+s.connect(path)
+s.sendall(struct.pack('>BIHHBHB', 5, 8 + len(name), 80, 24, 0, 0, len(name)) + name)
+line = b'echo SRV-$((6*7))-$GHOSTLY_TEST_ENV\r'
+s.sendall(struct.pack('>BI', 1, len(line)) + line)
+s.settimeout(0.5)
+buf = b''
+while time.time() < deadline and b'SRV-42-two' not in buf:
+    try:
+        d = s.recv(65536)
+        if not d: break
+        buf += d
+    except socket.timeout:
+        pass
+sys.exit(0 if b'SRV-42-two' in buf else 1)
+EOF
+then
+    pass "attached to a server session by name"
+else
+    fail "no output from server session"
+fi
+sleep 0.2
+if [ "$(cat "$SRV_ENV")" = "one" ]; then
+    pass "server sessions get their creator's environment"
+else
+    fail "server session environment: $(cat "$SRV_ENV")"
+fi
+rm -f "$SRV_ENV"
+
+# A child that ignores SIGHUP and SIGTERM takes 150ms to stop; the server
+# keeps serving its other sessions meanwhile
+"$BIN" create "$SRV_C" --server -- "exec python3 -c 'import signal, time
+signal.signal(signal.SIGHUP, signal.SIG_IGN)
+signal.signal(signal.SIGTERM, signal.SIG_IGN)
+time.sleep(60)'" >/dev/null 2>&1
+sleep 0.5
+"$BIN" kill "$SRV_C" >/dev/null 2>&1
+slowest=$("$BIN" stats "$SRV_B" | awk '$1 == "max_iteration_us" { print $2 }')
+if ! "$BIN" list 2>&1 | grep -q "$SRV_C" && [ -n "$slowest" ] && [ "$slowest" -lt 100000 ]; then
+    pass "stopping a stubborn child doesn't block the server (${slowest}us)"
+else
+    fail "stubborn child: longest iteration ${slowest}us"
+fi
+
+"$BIN" kill "$SRV_A" >/dev/null 2>&1 || true
+out=$("$BIN" list 2>&1)
+if echo "$out" | grep -q "$SRV_B" && ! echo "$out" | grep -q "$SRV_A"; then
+    pass "killing one server session leaves the others"
+else
+    fail "server kill affected the wrong sessions"
+fi
+"$BIN" kill "$SRV_B" >/dev/null 2>&1 || true
+
+# ---------- 21. live session metadata ----------
+bold "21. Live session metadata"
+
+SESSION8="test-query-$$"
+track "$SESSION8"
+
+"$BIN" create "$SESSION8" -- "printf QUERY-OUTPUT; sleep 30" >/dev/null 2>&1
+ok=0
+for _ in $(seq 1 40); do
+    if "$BIN" list --json 2>/dev/null | python3 -c '
+import json, sys
+s = [x for x in json.load(sys.stdin)["sessions"] if x["name"] == sys.argv[1]]
+sys.exit(0 if s and s[0]["bytes_out"] >= 12 and s[0]["last_activity"] >= s[0]["created"] else 1)' "$SESSION8"; then
+        ok=1
+        break
+    fi
+    sleep 0.2
+done
+if [ "$ok" = 1 ]; then
+    pass "list reports output bytes from the running daemon"
+else
+    fail "list --json missing live metadata"
+fi
+if [ -e "/tmp/ghostly-$(id -u)/$SESSION8.info" ]; then
+    fail "daemon still writes an info file"
+else
+    pass "no info file written"
+fi
+"$BIN" kill "$SESSION8" >/dev/null 2>&1 || true
+
+# ---------- 22. cached system info ----------
+bold "22. Cached system info"
+
+# A fake, slow squeue: the first (cold) info waits for it, later ones are
+# answered from the cache while a stale value is refreshed in the background
+FAKE_BIN=$(mktemp -d)
+cat > "$FAKE_BIN/squeue" <<'EOF'
+#!/bin/sh
+sleep 1
+printf 'job1\njob2\n'
+EOF
+chmod +x "$FAKE_BIN/squeue"
+CACHE="/tmp/ghostly-$(id -u)/info.cache"
+rm -f "$CACHE"
+
+out=$(PATH="$FAKE_BIN:$PATH" USER=ghostlytest "$BIN" info 2>&1)
+if echo "$out" | grep -q "^JOBS:2$"; then
+    pass "cold info probes SLURM"
+else
+    fail "cold info JOBS wrong: $(echo "$out" | grep JOBS)"
+fi
+
+# Age the cached SLURM value past its TTL
+sed -i.bak 's/^slurm [0-9]* /slurm 1 /' "$CACHE" && rm -f "$CACHE.bak"
+printf '#!/bin/sh\nsleep 1\nprintf "j\\n"\n' > "$FAKE_BIN/squeue"
+start=$(date +%s%N)
+out=$(PATH="$FAKE_BIN:$PATH" USER=ghostlytest "$BIN" info --json 2>&1)
+elapsed_ms=$(( ($(date +%s%N) - start) / 1000000 ))
+if [ "$elapsed_ms" -lt 800 ] && echo "$out" | grep -q '"slurm_jobs":"2","slurm_updated":1,'; then
+    pass "stale value served immediately (${elapsed_ms}ms)"
+else
+    fail "stale info took ${elapsed_ms}ms: $out"
+fi
+ok=0
+for _ in $(seq 1 30); do
+    if grep -q "^slurm [0-9]* 1$" "$CACHE" 2>/dev/null; then ok=1; break; fi
+    sleep 0.2
+done
+if [ "$ok" = 1 ]; then
+    pass "background refresh updated the cache"
+else
+    fail "cache not refreshed: $(cat "$CACHE" 2>/dev/null)"
+fi
+
+line=$(timeout 5 "$BIN" info --watch 1 | head -1 || true)
+if echo "$line" | python3 -c 'import json,sys; sys.exit(0 if "slurm_jobs" in json.load(sys.stdin) else 1)' 2>/dev/null; then
+    pass "info --watch streams JSON and exits with its reader"
+else
+    fail "info --watch output: $line"
+fi
+rm -rf "$FAKE_BIN"
+rm -f "$CACHE"  # don't leave the fake job count behind
+
+# ---------- 23. startup handshake ----------
+bold "23. Startup handshake"
+
+# create returns once the daemon listens: no sleep before using the socket
+S23="test-ready-$$"
+track "$S23"
+"$BIN" create "$S23" -- "sleep 30"
+if [ -S "/tmp/ghostly-$(id -u)/$S23.sock" ] && "$BIN" list | grep -q "$S23"; then
+    pass "socket ready when create returns"
+else
+    fail "socket not ready right after create"
+fi
+
+# open attaches through the socketpair the new daemon hands over, so the
+# first output arrives without any startup delay
+S23B="test-handoff-$$"
+track "$S23B"
+out=$(python3 - "$BIN" "$S23B" <<'EOF'
+import os, pty, select, sys, time
+start = time.time()
+pid, fd = pty.fork()
+if pid == 0:
+    os.execv(sys.argv[1], [sys.argv[1], "open", sys.argv[2], "--", "sh", "-c", "'echo HANDOFF-OK; sleep 5'"])
+buf = b""
+while time.time() - start < 10 and b"HANDOFF-OK" not in buf:
+    r, _, _ = select.select([fd], [], [], 0.1)
+    if r:
+        try:
+            buf += os.read(fd, 4096)
+        except OSError:
+            break
+print("ok" if b"HANDOFF-OK" in buf else "missing")
+os.write(fd, b"\x1c")
+time.sleep(0.2)
+EOF
+)
+if [ "$out" = ok ]; then
+    pass "open attaches via handed-over socket"
+else
+    fail "open handoff: $out"
+fi
+
+# ---------- 24. stats ----------
+bold "24. Stats"
+
+S24="test-stats-$$"
+track "$S24"
+"$BIN" create "$S24" -- "bash --norc" >/dev/null 2>&1
+out=$(python3 - "/tmp/ghostly-$(id -u)/$S24.sock" "$BIN" "$S24" <<'EOF'
+import json, socket, struct, subprocess, sys, time
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+s.sendall(struct.pack('>BIHHB', 5, 5, 80, 24, 0))
+cmd = b"echo STATS-''OK\r"
+s.sendall(struct.pack('>BI', 1, len(cmd)) + cmd)
+s.settimeout(5)
+buf, deadline = b'', time.time() + 10
+while b'STATS-OK' not in buf and time.time() < deadline:
+    buf += s.recv(65536)
+r = json.loads(subprocess.check_output([sys.argv[2], 'stats', sys.argv[3], '--json']))
+c = r["counters"]
+ok = c["pty_bytes"] > 0 and c["frames_in"] >= 2 and c["bytes_sent"] > 0 and c["wakeups"] > 0
+ok = ok and len(r["clients"]) == 1 and r["clients"][0]["bytes_sent"] > 0
+ok = ok and r["sessions"][0]["bytes_in"] == len(cmd)
+print("ok" if ok else r)
+EOF
+)
+if [ "$out" = ok ]; then
+    pass "stats --json reports daemon and client counters"
+else
+    fail "stats: $out"
+fi
+if "$BIN" stats "no-such-session-$$" >/dev/null 2>&1; then
+    fail "stats on a missing session succeeded"
+else
+    pass "stats rejects a missing session"
+fi
+"$BIN" kill "$S24" >/dev/null 2>&1 || true
+
+# ---------- 25. bench subcommand ----------
+bold "25. Bench"
+
+out=$("$BIN" bench --mb 2 --clients 2 --samples 20 --json 2>&1 || true)
+if echo "$out" | python3 -c '
+import json, sys
+r = json.load(sys.stdin)
+ok = r["clients"] == 2 and r["throughput_mbps"] > 0 and 0 < r["latency_p50_ms"] <= r["latency_p99_ms"]
+ok = ok and r["replay_bytes"] > 0 and r["reattach_ms"] > 0
+sys.exit(0 if ok else 1)' 2>/dev/null; then
+    pass "bench --json reports throughput, latency and reattach"
+else
+    fail "bench output: $out"
+fi
+if "$BIN" list --json | grep -q '"bench-'; then
+    fail "bench left its session behind"
+else
+    pass "bench cleans up its session"
+fi
+
+# ---------- 26. client input and output batching ----------
+bold "26. Client batching"
+
+SESSION_B="test-batch-$$"
+track "$SESSION_B"
+BATCH_OUT=$(mktemp)
+
+# The shell reads a 256K paste, then floods 1MB back. attach runs on a real
+# PTY; the paste and the detach key go in one write, so the bytes typed just
+# before Ctrl+\ must still reach the session. (With a replay: READY may be
+# out before attach connects.)
+for flags in "" "--no-coalesce"; do
+    "$BIN" create "$SESSION_B" -- "stty raw -echo; printf READY; head -c 262149 > $BATCH_OUT; yes 0123456789 | head -c 1048576; printf DONE; exec cat >/dev/null" >/dev/null 2>&1
+    if python3 - "$BIN" "$SESSION_B" "$BATCH_OUT" $flags <<'EOF'
+import os, pty, select, sys, time
+binary, name, path = sys.argv[1:4]
+pid, fd = pty.fork()
+if pid == 0:
+    os.execv(binary, [binary, 'attach', name] + sys.argv[4:])
+def read_until(marker, timeout=10):
+    buf, end = b'', time.time() + timeout
+    while marker not in buf and time.time() < end:
+        if select.select([fd], [], [], 0.2)[0]:
+            try:
+                buf += os.read(fd, 65536)
+            except OSError:
+                break
+    return buf
+if b'READY' not in read_until(b'READY'):
+    sys.exit(1)
+paste = b'p' * 262144 + b'TAIL!'
+for i in range(0, len(paste), 4096):
+    os.write(fd, paste[i:i + 4096])
+out = read_until(b'DONE', 20)
+os.write(fd, b'\x1c')
+read_until(b'detached', 5)
+_, status = os.waitpid(pid, 0)
+ok = out.count(b'0123456789\n') == 95325 and b'DONE' in out
+with open(path, 'rb') as f:
+    ok = ok and f.read() == paste
+sys.exit(0 if ok and os.WEXITSTATUS(status) == 0 else 1)
+EOF
+    then
+        pass "paste and 1MB of output intact ${flags:-(coalescing)}"
+    else
+        fail "paste or output corrupted ${flags:-(coalescing)}"
+    fi
+    "$BIN" kill "$SESSION_B" >/dev/null 2>&1 || true
+done
+rm -f "$BATCH_OUT"
+
+# ---------- 27. predictive local echo ----------
+bold "27. Predictive echo"
+
+SESSION_P="test-predict-$$"
+track "$SESSION_P"
+PREDICT_OUT=$(mktemp)
+
+# Types "hi" into an attach on an 80x24 PTY and prints what the terminal got
+predict_attach() {
+    python3 - "$BIN" "$SESSION_P" "$@" <<'EOF'
+import fcntl, os, pty, select, struct, sys, termios, time
+binary, name = sys.argv[1:3]
+pid, fd = pty.fork()
+if pid == 0:
+    fcntl.ioctl(0, termios.TIOCSWINSZ, struct.pack('HHHH', 24, 80, 0, 0))
+    os.execv(binary, [binary, 'attach', name] + sys.argv[3:])
+if '--no-replay' in sys.argv:
+    # Held back until this arrives: without a replay READY must come live
+    os.write(fd, b'\r')
+def read_for(secs, marker=None):
+    buf, end = b'', time.time() + secs
+    while time.time() < end and (marker is None or marker not in buf):
+        if select.select([fd], [], [], 0.05)[0]:
+            try:
+                buf += os.read(fd, 65536)
+            except OSError:
+                break
+    return buf
+if b'READY' not in read_for(5, b'READY'):
+    sys.exit(1)
+os.write(fd, b'hi')
+out = read_for(0.5)
+os.write(fd, b'\x1c')
+read_for(2, b'detached')
+os.waitpid(pid, 0)
+sys.stdout.write(repr(out))
+EOF
+}
+
+# No echo from the session: the guess is drawn, then taken back once the
+# daemon acknowledges the input
+"$BIN" create "$SESSION_P" -- "stty raw -echo; printf READY; exec cat > $PREDICT_OUT" >/dev/null 2>&1
+out=$(predict_attach --predict always || true)
+if [[ "$out" == *'\x1b[4mhi'* && "$out" == *'H\x1b[0m  \x1b['* ]] && [ "$(cat "$PREDICT_OUT")" = "hi" ]; then
+    pass "wrong guess drawn, then erased"
+else
+    fail "wrong guess not handled: $out"
+fi
+"$BIN" kill "$SESSION_P" >/dev/null 2>&1 || true
+
+"$BIN" create "$SESSION_P" -- "stty raw echo; printf READY; exec cat >/dev/null" >/dev/null 2>&1
+out=$(predict_attach --predict always || true)
+if [[ "$out" == *'\x1b[4mhi'* && "$out" == *"hi'" ]]; then
+    pass "guess drawn and confirmed by the echo"
+else
+    fail "echoed guess not handled: $out"
+fi
+"$BIN" kill "$SESSION_P" >/dev/null 2>&1 || true
+
+"$BIN" create "$SESSION_P" -- "stty raw echo; printf READY; exec cat >/dev/null" >/dev/null 2>&1
+# The local socket is fast: adaptive mode leaves the echo to the session
+out=$(predict_attach || true)
+if [[ "$out" != *'\x1b[4m'* && "$out" == *'hi'* ]]; then
+    pass "adaptive prediction stays off on a fast link"
+else
+    fail "adaptive prediction on a local socket: $out"
+fi
+"$BIN" kill "$SESSION_P" >/dev/null 2>&1 || true
+rm -f "$PREDICT_OUT"
+
+"$BIN" create "$SESSION_P" -- "stty raw echo; head -c 1 >/dev/null; printf READY; exec cat >/dev/null" >/dev/null 2>&1
+# Without the replay the client's model of the screen would be blank
+out=$(predict_attach --no-replay --predict always || true)
+if [[ "$out" != *'\x1b[4m'* && "$out" == *'hi'* ]]; then
+    pass "no prediction after --no-replay"
+else
+    fail "predicted after --no-replay: $out"
+fi
+"$BIN" kill "$SESSION_P" >/dev/null 2>&1 || true
+
+# Raw clients asking for ECHO_ACK: one with a full replay at the session's
+# size gets acknowledgements, withdrawn (an empty ECHO_ACK) while a smaller
+# client shrinks the session and resumed once it leaves; one attached with
+# --no-replay never gets any. Prints the ECHO_ACK payload sizes each saw.
+"$BIN" create "$SESSION_P" --resize smallest -- "bash --norc" >/dev/null 2>&1
+out=$(python3 - "/tmp/ghostly-$(id -u)/$SESSION_P.sock" <<'EOF2'
+import select, socket, struct, sys, time
+def frame(t, p=b''):
+    return struct.pack('>BI', t, len(p)) + p
+def connect(cols, rows, flags):
+    s = socket.socket(socket.AF_UNIX)
+    s.connect(sys.argv[1])
+    s.sendall(frame(5, struct.pack('>HHB', cols, rows, flags)))
+    return s
+acks = {}
+bufs = {}
+def pump(socks, secs):
+    end = time.time() + secs
+    while time.time() < end:
+        for s in select.select(socks, [], [], 0.05)[0]:
+            bufs[s] = bufs.get(s, b'') + s.recv(65536)
+            while len(bufs[s]) >= 5:
+                t, n = struct.unpack('>BI', bufs[s][:5])
+                if len(bufs[s]) < 5 + n:
+                    break
+                if t == 0x0E:
+                    acks.setdefault(s, []).append(str(n))
+                bufs[s] = bufs[s][5 + n:]
+full = connect(100, 30, 0x10)
+pump([full], 0.3)
+small = connect(80, 24, 0x01)
+blind = connect(100, 30, 0x11)
+pump([full, small, blind], 0.5)
+small.close()
+pump([full, blind], 0.5)
+print(' '.join(acks.get(full, [])) + '/' + ' '.join(acks.get(blind, [])))
+EOF2
+)
+if [ "$out" = "4 0 4/" ]; then
+    pass "echo acknowledged only while the client's screen model is exact"
+else
+    fail "ECHO_ACK while the model is off: $out"
+fi
+"$BIN" kill "$SESSION_P" >/dev/null 2>&1 || true
+
+if "$BIN" attach "$SESSION_P" --predict sometimes >/dev/null 2>&1; then
+    fail "accepted invalid --predict mode"
+else
+    pass "rejected invalid --predict mode"
+fi
+
+# ---------- 28. resume from a stream offset ----------
+bold "28. Resume"
+
+SESSION_R="test-resume-$$"
+track "$SESSION_R"
+RESUME_FILE=$(mktemp -u)
+OTHER_FILE=$(mktemp -u)
+
+# Attach on a PTY until marker shows up, detach, and print how many times
+# each of the words after it was seen
+resume_attach() {
+    python3 - "$BIN" "$SESSION_R" "$@" <<'EOF'
+import fcntl, os, pty, select, struct, sys, termios, time
+binary, name, marker, words = sys.argv[1], sys.argv[2], sys.argv[3].encode(), sys.argv[4].split()
+pid, fd = pty.fork()
+if pid == 0:
+    fcntl.ioctl(0, termios.TIOCSWINSZ, struct.pack('HHHH', 24, 80, 0, 0))
+    os.execv(binary, [binary, 'attach', name] + sys.argv[5:])
+buf, end = b'', time.time() + 5
+while marker not in buf and time.time() < end:
+    if select.select([fd], [], [], 0.05)[0]:
+        buf += os.read(fd, 65536)
+while select.select([fd], [], [], 0.2)[0]:
+    buf += os.read(fd, 65536)
+os.write(fd, b'\x1c')
+end = time.time() + 2
+while time.time() < end and select.select([fd], [], [], 0.05)[0]:
+    try:
+        if not os.read(fd, 65536): break
+    except OSError:
+        break
+os.waitpid(pid, 0)
+print(' '.join(str(buf.count(w.encode())) for w in words))
+EOF
+}
+
+# Sends one byte of input to the session through a raw client
+resume_poke() {
+    python3 - "/tmp/ghostly-$(id -u)/$SESSION_R.sock" <<'EOF'
+import socket, struct, sys, time
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+s.sendall(struct.pack('>BIHHB', 5, 5, 80, 24, 1) + struct.pack('>BI', 1, 1) + b'x')
+time.sleep(0.3)
+s.sendall(struct.pack('>BI', 3, 0))
+EOF
+}
+
+"$BIN" create "$SESSION_R" --scrollback 16K -- "stty raw -echo; printf 'FIRST\n'; head -c 1 >/dev/null; printf 'SECOND\n'; head -c 1 >/dev/null; seq 1 20000; printf 'THIRD\n'; exec cat >/dev/null" >/dev/null 2>&1
+resume_attach FIRST "FIRST" --resume "$RESUME_FILE" >/dev/null
+resume_poke
+if [ "$(resume_attach SECOND "FIRST SECOND" --resume "$RESUME_FILE")" = "0 1" ] && [ -s "$RESUME_FILE" ]; then
+    pass "reattach replays only the missed output"
+else
+    fail "resume replayed more or less than what was missed"
+fi
+# (No prediction: its replay would end with a redraw, showing them again)
+if [ "$(resume_attach SECOND "FIRST SECOND" --predict never)" = "1 1" ]; then
+    pass "attach without --resume replays everything"
+else
+    fail "plain attach after resume"
+fi
+# Positions belong to a terminal: a new one has none, and gets everything
+if [ "$(resume_attach SECOND "FIRST SECOND" --resume "$OTHER_FILE")" = "1 1" ]; then
+    pass "a terminal without a position of its own gets the full replay"
+else
+    fail "resume position shared between terminals"
+fi
+# The same position given as ID:OFFSET: nothing was missed since
+pos=$(tr ' ' ':' < "$RESUME_FILE")
+if [ "$(resume_attach "" "FIRST SECOND" --resume "$pos")" = "0 0" ]; then
+    pass "resume from an ID:OFFSET position"
+else
+    fail "resume --resume $pos"
+fi
+# The missed output no longer fits the 16K scrollback: full replay
+resume_poke
+if [ "$(resume_attach THIRD "FIRST 19999 THIRD" --resume "$RESUME_FILE")" = "0 1 1" ]; then
+    pass "full replay when the missed output was overwritten"
+else
+    fail "resume with overwritten scrollback"
+fi
+if "$BIN" stats "$SESSION_R" | grep -q "resumes *2$"; then
+    pass "stats counts resumes"
+else
+    fail "stats resumes counter"
+fi
+"$BIN" kill "$SESSION_R" >/dev/null 2>&1 || true
+rm -f "$RESUME_FILE" "$OTHER_FILE"
+
+# ---------- 29. journal and log ----------
+bold "29. Journal"
+
+SESSION_J="test-journal-$$"
+track "$SESSION_J"
+JOURNAL_DIR="/tmp/ghostly-$(id -u)/$SESSION_J.journal"
+
+"$BIN" create "$SESSION_J" --journal -- "printf '\\033[31mJRED\\033[0m line\\nJPLAIN line\\nJBAR 1\\rJBAR 2\\rJBAR 3\\n'; sleep 30" >/dev/null 2>&1
+# Output is written out within a second of arriving
+for i in $(seq 1 50); do
+    "$BIN" log "$SESSION_J" 2>/dev/null | grep -q "JBAR" && break
+    sleep 0.1
+done
+out=$("$BIN" log "$SESSION_J" 2>/dev/null)
+if echo "$out" | grep -qx "JRED line" && ! echo "$out" | grep -q $'\033'; then
+    pass "log prints the output as text"
+else
+    fail "log text: $out"
+fi
+if echo "$out" | grep -qx "JBAR 3" && ! echo "$out" | grep -q "JBAR [12]"; then
+    pass "log keeps what a carriage return left"
+else
+    fail "log progress line: $out"
+fi
+out=$("$BIN" log "$SESSION_J" --grep '^JP.*ine$' 2>/dev/null)
+if [ "$out" = "JPLAIN line" ]; then
+    pass "log --grep keeps only matching lines"
+else
+    fail "log --grep: $out"
+fi
+out=$("$BIN" log "$SESSION_J" --since 1h 2>/dev/null | grep -c "^J")
+future=$("$BIN" log "$SESSION_J" --since 2099-01-01 2>/dev/null)
+if [ "$out" = "3" ] && [ -z "$future" ]; then
+    pass "log --since starts at a time"
+else
+    fail "log --since: $out / $future"
+fi
+if "$BIN" log "$SESSION_J" --raw 2>/dev/null | grep -q $'\033\\[31mJRED'; then
+    pass "log --raw keeps escape sequences"
+else
+    fail "log --raw"
+fi
+# The journal outlives a daemon killed without any cleanup
+dpid=$(cat "/tmp/ghostly-$(id -u)/$SESSION_J.pid" 2>/dev/null)
+[ -n "$dpid" ] && kill -9 "$dpid" 2>/dev/null
+sleep 0.2
+"$BIN" kill "$SESSION_J" >/dev/null 2>&1 || true
+if "$BIN" log "$SESSION_J" 2>/dev/null | grep -qx "JPLAIN line"; then
+    pass "journal survives the daemon"
+else
+    fail "journal lost with the daemon"
+fi
+rm -rf "$JOURNAL_DIR"
+# ~11MB: the journal moves on to new 4MB segments as it goes
+"$BIN" create "$SESSION_J" --journal -- "seq 1 1500000; echo ROT-''END" >/dev/null 2>&1
+for _ in $(seq 1 200); do
+    "$BIN" list | grep -q "$SESSION_J" || break
+    sleep 0.1
+done
+segs=$(ls "$JOURNAL_DIR" 2>/dev/null | grep -c '\.log$')
+last=$("$BIN" log "$SESSION_J" 2>/dev/null | tr -d '\r' | grep -v '^$' | tail -2 | tr '\n' ' ')
+if [ "$segs" -ge 3 ] && [ "$last" = "1500000 ROT-END " ]; then
+    pass "journal rotates segments ($segs) without losing output"
+else
+    fail "journal rotation: $segs segments, ends with '$last'"
+fi
+rm -rf "$JOURNAL_DIR"
+if "$BIN" log "$SESSION_J" >/dev/null 2>&1; then
+    fail "log without a journal succeeded"
+else
+    pass "log without a journal fails"
+fi
+
+# ---------- 30. many clients and read-only viewers ----------
+bold "30. Viewers"
+
+SESSION_V="test-viewers-$$"
+track "$SESSION_V"
+"$BIN" create "$SESSION_V" -- "bash --norc" >/dev/null 2>&1
+# 40 read-only viewers at 50x10 (more than the old 16-client table), each
+# typing a command, then one normal client at 80x24 asking for the window
+# size. Prints how many viewers saw the answer, and whether any viewer's
+# input ran.
+out=$(python3 - "/tmp/ghostly-$(id -u)/$SESSION_V.sock" <<'EOF2'
+import select, socket, struct, sys, time
+path = sys.argv[1]
+def frame(t, p=b''):
+    return struct.pack('>BI', t, len(p)) + p
+def connect(cols, rows, flags):
+    s = socket.socket(socket.AF_UNIX)
+    s.connect(path)
+    s.sendall(frame(5, struct.pack('>HHB', cols, rows, flags)))
+    return s
+viewers = [connect(50, 10, 0x41) for _ in range(40)]
+time.sleep(0.3)
+for v in viewers:
+    v.sendall(frame(1, b'echo VIEWER-$((6*7))-INPUT\n') + frame(2, struct.pack('>HH', 30, 5)))
+time.sleep(0.3)
+typist = connect(80, 24, 0x01)
+time.sleep(0.2)
+typist.sendall(frame(1, b'echo "SIZE-$(stty size)-END"\n'))
+seen = [b''] * len(viewers)
+end = time.time() + 3
+while time.time() < end and not all(b'SIZE-24 80-END' in x for x in seen):
+    r = select.select(viewers, [], [], 0.1)[0]
+    for v in r:
+        i = viewers.index(v)
+        seen[i] += v.recv(65536)
+print(sum(b'SIZE-24 80-END' in x for x in seen), any(b'VIEWER-42-INPUT' in x for x in seen))
+EOF2
+)
+if [ "$out" = "40 False" ]; then
+    pass "40 read-only viewers see output; their input and size are ignored"
+else
+    fail "viewers: $out"
+fi
+"$BIN" kill "$SESSION_V" >/dev/null 2>&1 || true
+
+# ---------- 31. window size arbitration ----------
+bold "31. Resize policy"
+
+SESSION_Z="test-resize-$$"
+track "$SESSION_Z"
+
+# Raw clients at each of the given COLSxROWS sizes; with "burst" first, the
+# last one then sends ten resizes from 90x25 to 99x34. The last one asks
+# for the size; prints what stty saw.
+resize_clients() {
+    python3 - "/tmp/ghostly-$(id -u)/$SESSION_Z.sock" "$@" <<'EOF2'
+import select, socket, struct, sys, time
+path, sizes = sys.argv[1], sys.argv[2:]
+burst = sizes[0] == 'burst'
+if burst: sizes = sizes[1:]
+def frame(t, p=b''):
+    return struct.pack('>BI', t, len(p)) + p
+clients = []
+for sz in sizes:
+    cols, rows = map(int, sz.split('x'))
+    s = socket.socket(socket.AF_UNIX)
+    s.connect(path)
+    s.sendall(frame(5, struct.pack('>HHB', cols, rows, 0x01)))
+    clients.append(s)
+    time.sleep(0.05)
+last = clients[-1]
+if burst:
+    for k in range(10):
+        last.sendall(frame(2, struct.pack('>HH', 90 + k, 25 + k)))
+time.sleep(0.3)
+last.sendall(frame(1, b'echo "SIZE-$(stty size)-END"\n'))
+buf, end = b'', time.time() + 3
+while b'-END' not in buf.replace(b'-END"', b'') and time.time() < end:
+    if select.select([last], [], [], 0.1)[0]:
+        buf += last.recv(65536)
+i = buf.rfind(b'SIZE-')
+print(buf[i + 5:buf.index(b'-END', i)].decode() if i >= 0 else 'none')
+EOF2
+}
+resizes() { "$BIN" stats "$SESSION_Z" | awk '$1 == "resizes" { print $2 }'; }
+
+"$BIN" create "$SESSION_Z" --resize smallest -- "bash --norc" >/dev/null 2>&1
+out=$(resize_clients 100x40 70x30 120x20)
+if [ "$out" = "20 70" ]; then
+    pass "--resize smallest takes the smallest rows and columns"
+else
+    fail "smallest: $out"
+fi
+"$BIN" kill "$SESSION_Z" >/dev/null 2>&1 || true
+
+"$BIN" create "$SESSION_Z" --resize largest -- "bash --norc" >/dev/null 2>&1
+out=$(resize_clients 100x40 70x30 120x20)
+if [ "$out" = "40 120" ]; then
+    pass "--resize largest takes the largest rows and columns"
+else
+    fail "largest: $out"
+fi
+"$BIN" kill "$SESSION_Z" >/dev/null 2>&1 || true
+
+"$BIN" create "$SESSION_Z" -- "bash --norc" >/dev/null 2>&1
+out=$(resize_clients burst 80x24)
+n=$(resizes)
+if [ "$out" = "34 99" ] && [ -n "$n" ] && [ "$n" -le 3 ]; then
+    pass "a burst of resizes is applied as $n"
+else
+    fail "debounce: size $out after $n resizes"
+fi
+# Attaching at the size the session already has changes nothing
+out=$(resize_clients 99x34)
+if [ "$(resizes)" = "$n" ]; then
+    pass "same-size attach skips the resize"
+else
+    fail "same-size attach resized: $(resizes) (was $n)"
+fi
+"$BIN" kill "$SESSION_Z" >/dev/null 2>&1 || true
+
+# Nor does --no-replay at that size, but without a replay the child still
+# has to be told to redraw
+"$BIN" create "$SESSION_Z" -- "exec python3 -c 'import signal, time
+signal.signal(signal.SIGWINCH, lambda *a: print(\"REDRAW-\", flush=True))
+print(\"READY\", flush=True)
+while True: time.sleep(1)'" >/dev/null 2>&1
+out=$(python3 - "/tmp/ghostly-$(id -u)/$SESSION_Z.sock" <<'EOF2'
+import select, socket, struct, sys, time
+def frame(t, p=b''):
+    return struct.pack('>BI', t, len(p)) + p
+def attach(flags, marker):
+    s = socket.socket(socket.AF_UNIX)
+    s.connect(sys.argv[1])
+    s.sendall(frame(5, struct.pack('>HHB', 80, 24, flags)))
+    buf, end = b'', time.time() + 5
+    while time.time() < end and marker not in buf:
+        if select.select([s], [], [], 0.1)[0]:
+            buf += s.recv(65536)
+    s.sendall(frame(3))
+    s.close()
+    return marker in buf
+attach(0, b'READY')
+print(attach(0x01, b'REDRAW-'))
+EOF2
+)
+if [ "$out" = "True" ]; then
+    pass "same-size attach --no-replay makes the child redraw"
+else
+    fail "same-size attach --no-replay left the screen blank"
+fi
+"$BIN" kill "$SESSION_Z" >/dev/null 2>&1 || true
+
+# ---------- 32. allocation-free receive path ----------
+bold "32. Receive buffers"
+
+SESSION_A="test-rxalloc-$$"
+track "$SESSION_A"
+"$BIN" create "$SESSION_A" -- "cat >/dev/null" >/dev/null 2>&1
+rx_allocs() { "$BIN" stats "$SESSION_A" | awk '$1 == "rx_allocs" { print $2 }'; }
+# A client types 2000 single keys, leaves, and another does the same
+keystrokes() {
+    python3 - "/tmp/ghostly-$(id -u)/$SESSION_A.sock" <<'EOF2'
+import socket, struct, sys, time
+def frame(t, p=b''):
+    return struct.pack('>BI', t, len(p)) + p
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+s.sendall(frame(5, struct.pack('>HHB', 80, 24, 0x01)))
+for i in range(2000):
+    s.sendall(frame(1, b'x'))
+s.sendall(frame(3))
+time.sleep(0.2)
+EOF2
+}
+keystrokes
+before=$(rx_allocs)
+keystrokes
+keystrokes
+after=$(rx_allocs)
+if [ -n "$before" ] && [ "$before" = "$after" ]; then
+    pass "4000 input frames and a reconnect allocate nothing (rx_allocs $after)"
+else
+    fail "rx_allocs went from $before to $after"
+fi
+"$BIN" kill "$SESSION_A" >/dev/null 2>&1 || true
+
+# ---------- 33. mux: several sessions over one stream ----------
+bold "33. Mux"
+
+SESSION_M1="test-mux1-$$"
+SESSION_M2="test-mux2-$$"
+track "$SESSION_M1"
+track "$SESSION_M2"
+"$BIN" create "$SESSION_M1" -- "bash --norc" >/dev/null 2>&1
+"$BIN" create "$SESSION_M2" --server -- "bash --norc" >/dev/null 2>&1
+# Channel 1: standalone session, channel 2: a server session, channel 3: one
+# that doesn't exist. Each open session runs a command; then channel 1
+# detaches. Prints what came back per channel.
+out=$(python3 - "$BIN" "$SESSION_M1" "$SESSION_M2" <<'EOF2'
+import select, struct, subprocess, sys, time
+binary, s1, s2 = sys.argv[1:4]
+p = subprocess.Popen([binary, 'mux'], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+def mux(chan, t, payload=b''):
+    body = struct.pack('>HB', chan, t) + payload
+    p.stdin.write(struct.pack('>BI', 0x10, len(body)) + body)
+    p.stdin.flush()
+def hello(chan, name):
+    mux(chan, 5, bytes([len(name)]) + name.encode() + struct.pack('>HHB', 80, 24, 0x01))
+got, buf = {}, b''
+def pump(secs, until=None):
+    global buf
+    end = time.time() + secs
+    while time.time() < end and not (until and until()):
+        if not select.select([p.stdout], [], [], 0.05)[0]: continue
+        buf += p.stdout.raw.read(65536)
+        while len(buf) >= 8 and len(buf) >= 5 + struct.unpack('>I', buf[1:5])[0]:
+            n = struct.unpack('>I', buf[1:5])[0]
+            assert buf[0] == 0x10
+            chan, t = struct.unpack('>HB', buf[5:8])
+            got.setdefault(chan, []).append((t, buf[8:5 + n]))
+            buf = buf[5 + n:]
+def text(chan):
+    return b''.join(d for t, d in got.get(chan, []) if t == 1)
+hello(1, s1); hello(2, s2); hello(3, 'no-such-mux-session')
+time.sleep(0.3)
+mux(1, 1, b'echo "ONE-$((1+1))"\n')
+mux(2, 1, b'echo "TWO-$((2+2))"\n')
+pump(10, lambda: b'ONE-2' in text(1) and b'TWO-4' in text(2) and 3 in [t for t, d in got.get(3, [])])
+mux(1, 3)
+pump(2, lambda: 3 in [t for t, d in got.get(1, [])])
+print(b'ONE-2' in text(1) and b'TWO-4' not in text(1),
+      b'TWO-4' in text(2) and b'ONE-2' not in text(2),
+      [t for t, d in got.get(3, [])] == [12, 3],
+      got.get(1, [])[-1][0] == 3)
+p.stdin.close()
+p.wait()
+EOF2
+)
+if [ "$out" = "True True True True" ]; then
+    pass "mux carries a standalone and a server session, refuses a missing one, detaches"
+else
+    fail "mux: $out"
+fi
+if [ "$("$BIN" list --json | python3 -c 'import json,sys; print([s["clients"] for s in json.load(sys.stdin)["sessions"] if s["name"] == sys.argv[1]])' "$SESSION_M2")" = "[0]" ]; then
+    pass "mux detaches its sessions when its input closes"
+else
+    fail "mux left a client attached"
+fi
+"$BIN" kill "$SESSION_M1" >/dev/null 2>&1 || true
+"$BIN" kill "$SESSION_M2" >/dev/null 2>&1 || true
+
+# ---------- 34. detached reading and pausable sessions ----------
+bold "34. Detached sessions"
+
+SESSION_D="test-detached-$$"
+track "$SESSION_D"
+stat_of() { "$BIN" stats "$SESSION_D" | awk -v k="$1" '$1 == k { print $2 }'; }
+
+# A child printing a line every 2ms (~300 writes/s) with nobody attached
+"$BIN" create "$SESSION_D" -- "while :; do echo tick; sleep 0.002; done" >/dev/null 2>&1
+sleep 2
+a=$(stat_of pty_reads)
+sleep 1
+b=$(stat_of pty_reads)
+if [ -n "$a" ] && [ $((b - a)) -le 80 ]; then
+    pass "detached output is read in batches ($((b - a)) reads/s)"
+else
+    fail "detached reads: $a -> $b"
+fi
+"$BIN" kill "$SESSION_D" >/dev/null 2>&1 || true
+
+# --pausable stops reading once the 16K scrollback is full, and carries on
+# when a client attaches
+"$BIN" create "$SESSION_D" --pausable --scrollback 16K -- "for i in \$(seq 1 5000); do echo line-\$i; done; echo PAUSE-DONE; sleep 30" >/dev/null 2>&1
+sleep 3
+out=$(stat_of pauses)
+bytes=$(stat_of pty_bytes)
+if [ "$out" = "1" ] && [ -n "$bytes" ] && [ "$bytes" -le 16384 ]; then
+    pass "pausable session stops at the scrollback size ($bytes bytes)"
+else
+    fail "pausable: pauses=$out bytes=$bytes"
+fi
+out=$(python3 - "/tmp/ghostly-$(id -u)/$SESSION_D.sock" <<'EOF2'
+import select, socket, struct, sys, time
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+s.sendall(struct.pack('>BIHHB', 5, 5, 80, 24, 0))
+buf, end = b'', time.time() + 10
+while b'PAUSE-DONE' not in buf and time.time() < end:
+    if select.select([s], [], [], 0.1)[0]:
+        d = s.recv(65536)
+        if not d: break
+        buf += d
+print(b'PAUSE-DONE' in buf and b'line-4999' in buf)
+EOF2
+)
+if [ "$out" = "True" ]; then
+    pass "attaching resumes a paused session"
+else
+    fail "paused session didn't resume"
+fi
+"$BIN" kill "$SESSION_D" >/dev/null 2>&1 || true
+
+# ---------- 35. list --watch ----------
+bold "35. List watch"
+
+SESSION_W="test-watch-$$"
+track "$SESSION_W"
+WATCH_OUT=$(mktemp)
+"$BIN" list --watch > "$WATCH_OUT" 2>/dev/null &
+WATCH_PID=$!
+# Wait until a line matching $1 has been printed (up to 10s)
+watch_wait() {
+    for _ in $(seq 1 100); do
+        grep -q "$1" "$WATCH_OUT" && return 0
+        sleep 0.1
+    done
+    return 1
+}
+if watch_wait '^{"sessions":\['; then
+    pass "list --watch starts with a snapshot"
+else
+    fail "list --watch printed no snapshot"
+fi
+"$BIN" create "$SESSION_W" -- "sleep 60" >/dev/null 2>&1
+if watch_wait "\"event\":\"added\",\"session\":{\"name\":\"$SESSION_W\""; then
+    pass "new session reported as added"
+else
+    fail "no added event: $(cat "$WATCH_OUT")"
+fi
+python3 - "/tmp/ghostly-$(id -u)/$SESSION_W.sock" <<'EOF2' &
+import socket, struct, sys, time
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+s.sendall(struct.pack('>BIHHB', 5, 5, 80, 24, 0))
+time.sleep(3)
+EOF2
+RAW_PID=$!
+# Well inside the 30s rescan: only the touched socket can report it this soon
+if watch_wait "\"event\":\"changed\",\"name\":\"$SESSION_W\",\"clients\":1"; then
+    pass "attached client reported as changed"
+else
+    fail "no changed event: $(cat "$WATCH_OUT")"
+fi
+wait "$RAW_PID" 2>/dev/null || true
+"$BIN" kill "$SESSION_W" >/dev/null 2>&1 || true
+if watch_wait "\"event\":\"removed\",\"name\":\"$SESSION_W\""; then
+    pass "killed session reported as removed"
+else
+    fail "no removed event: $(cat "$WATCH_OUT")"
+fi
+kill "$WATCH_PID" 2>/dev/null || true
+wait "$WATCH_PID" 2>/dev/null || true
+rm -f "$WATCH_OUT"
+
+# ---------- 36. I/O thread sessions ----------
+bold "36. I/O thread"
+
+SESSION_T="test-iothread-$$"
+track "$SESSION_T"
+# Three clients follow a 2MB flood, more than the reader thread's ring holds:
+# every one must see every line, in order
+"$BIN" create "$SESSION_T" --io-thread -- "sleep 1; seq 1 300000; echo IOT-''DONE; sleep 30" >/dev/null 2>&1
+out=$(python3 - "/tmp/ghostly-$(id -u)/$SESSION_T.sock" <<'EOF2'
+import select, socket, struct, sys, time
+cl = []
+for _ in range(3):
+    s = socket.socket(socket.AF_UNIX)
+    s.connect(sys.argv[1])
+    s.sendall(struct.pack('>BIHHB', 5, 5, 80, 24, 1))
+    cl.append([s, b'', b''])
+end = time.time() + 30
+while time.time() < end and not all(b'IOT-DONE' in c[2] for c in cl):
+    ready = select.select([c[0] for c in cl], [], [], 0.5)[0]
+    for c in cl:
+        if c[0] not in ready: continue
+        d = c[0].recv(1 << 20)
+        if not d: continue
+        c[1] += d
+        while len(c[1]) >= 5:
+            t, n = struct.unpack('>BI', c[1][:5])
+            if len(c[1]) < 5 + n: break
+            if t == 1: c[2] += c[1][5:5 + n]
+            c[1] = c[1][5 + n:]
+want = [str(i).encode() for i in range(1, 300001)]
+print(all([l for l in c[2].replace(b'\r', b'').split(b'\n') if l.isdigit()] == want for c in cl))
+EOF2
+)
+if [ "$out" = "True" ]; then
+    pass "io-thread session delivers a 2MB flood intact to 3 clients"
+else
+    fail "io-thread flood: $out"
+fi
+# The thread reads far faster than the loop parses and fans out 2MB
+stalls=$("$BIN" stats "$SESSION_T" | awk '$1 == "reader_stalls" { print $2 }')
+if [ -n "$stalls" ] && [ "$stalls" -gt 0 ]; then
+    pass "stats counts reader stalls ($stalls)"
+else
+    fail "reader_stalls: '$stalls'"
+fi
+"$BIN" kill "$SESSION_T" >/dev/null 2>&1 || true
+
+# A child that exits straight after a flood: the session ends only once the
+# ring is drained, so the journal has everything up to the last line
+"$BIN" create "$SESSION_T" --io-thread --journal -- "seq 1 300000; echo TAIL-''END" >/dev/null 2>&1
+for _ in $(seq 1 100); do
+    "$BIN" list | grep -q "$SESSION_T" || break
+    sleep 0.1
+done
+last=$("$BIN" log "$SESSION_T" 2>/dev/null | tr -d '\r' | grep -v '^$' | tail -2 | tr '\n' ' ')
+if [ "$last" = "300000 TAIL-END " ]; then
+    pass "io-thread session keeps the output written just before exit"
+else
+    fail "io-thread exit: log ends with '$last'"
+fi
+rm -rf "/tmp/ghostly-$(id -u)/$SESSION_T.journal"
+if "$BIN" create "$SESSION_T" --io-thread --pausable -- "sleep 5" >/dev/null 2>&1; then
+    fail "--io-thread was accepted with --pausable"
+    "$BIN" kill "$SESSION_T" >/dev/null 2>&1 || true
+else
+    pass "--io-thread is refused with --pausable"
+fi
+
+# ---------- 37. throughput benchmark (opt-in) ----------
+# GHOSTLY_BENCH=1 ./test.sh: cat a GHOSTLY_BENCH_MB (default 1024) file
+# through a session to 1 and 4 attached clients. Set GHOSTLY_BENCH_BASELINE
+# to another build to compare against it.
+if [ -n "${GHOSTLY_BENCH:-}" ]; then
+    bold "36. Throughput benchmark"
+
+    BENCH_DIR=$(mktemp -d)
+    BENCH_MB=${GHOSTLY_BENCH_MB:-1024}
+    yes "ghostly-session throughput benchmark line, some ordinary terminal text" |
+        head -c $((BENCH_MB * 1024 * 1024)) > "$BENCH_DIR/data" || true  # yes gets SIGPIPE
+
+    # MB/s of PTY output delivered to each of $3 clients of daemon $1
+    bench_throughput() {
+        local bin=$1 tag=$2 nclients=$3
+        local name="bench-$tag-$nclients-$$"
+        rm -f "$BENCH_DIR/gate"
+        mkfifo "$BENCH_DIR/gate"
+        track "$name"
+        "$bin" create "$name" -- "stty raw -echo; read g < $BENCH_DIR/gate; cat $BENCH_DIR/data" >/dev/null 2>&1
+        python3 - "/tmp/ghostly-$(id -u)/$name.sock" "$nclients" "$BENCH_DIR/gate" <<'EOF'
+import selectors, socket, struct, sys, time
+path, n, gate = sys.argv[1], int(sys.argv[2]), sys.argv[3]
+sel = selectors.DefaultSelector()
+state = {}
+for _ in range(n):
+    s = socket.socket(socket.AF_UNIX)
+    s.connect(path)
+    s.sendall(struct.pack('>BIHHB', 5, 5, 200, 50, 0x01))  # no replay
+    s.setblocking(False)
+    sel.register(s, selectors.EVENT_READ)
+    state[s] = [b'', 0, False]  # unparsed, DATA bytes, got EXIT
+time.sleep(0.2)
+with open(gate, 'w') as g:
+    g.write('go\n')
+start = time.time()
+left = n
+while left and time.time() - start < 600:
+    for key, _ in sel.select(1):
+        s = key.fileobj
+        st = state[s]
+        d = s.recv(1 << 20)
+        if not d:
+            st[2] = True
+        st[0] += d
+        while len(st[0]) >= 5:
+            t, l = struct.unpack('>BI', st[0][:5])
+            if len(st[0]) < 5 + l: break
+            if t == 1: st[1] += l
+            if t == 4: st[2] = True
+            st[0] = st[0][5 + l:]
+        if st[2]:
+            sel.unregister(s)
+            left -= 1
+elapsed = time.time() - start
+mb = min(st[1] for st in state.values()) / 1048576.0
+print("%.0f" % (mb / elapsed))
+EOF
+    }
+
+    for n in 1 4; do
+        cur=$(bench_throughput "$BIN" cur "$n")
+        msg="$n client(s): ${cur} MB/s"
+        if [ -n "${GHOSTLY_BENCH_BASELINE:-}" ]; then
+            base=$(bench_throughput "$GHOSTLY_BENCH_BASELINE" base "$n")
+            msg="$msg (baseline ${base} MB/s)"
+        fi
+        if [ -n "$cur" ] && [ "$cur" -gt 0 ]; then
+            pass "${BENCH_MB}MB cat to $msg"
+        else
+            fail "benchmark with $n client(s) failed"
+        fi
+    done
+    rm -rf "$BENCH_DIR"
+fi
+
 # ---------- summary ----------
 echo ""
 bold "=== Results ==="